@@ -106,17 +106,104 @@ static int significant_bits_part_length(uint64_t n)
 
 #endif /* end of significant_bits_part_length function */
 
-// number of bytes needed to encode bit_len
-static int bytes_needed(int bit_len)
+// number of bytes needed to encode bit_len,
+// bit lengths of 64 bit numbers including sign bit are covered
+static const uint8_t bytes_needed[66] = {
+	1, 1, 1, 1, 1, 1, 1, 1,
+	2, 2, 2, 2, 2, 2, 2,
+	3, 3, 3, 3, 3, 3, 3,
+	4, 4, 4, 4, 4, 4, 4,
+	5, 5, 5, 5,
+	6, 6, 6, 6, 6, 6, 6, 6,
+	7, 7, 7, 7, 7, 7, 7, 7,
+	8, 8, 8, 8, 8, 8, 8, 8,
+	9, 9, 9, 9, 9, 9, 9, 9,
+	10,
+};
+
+// big endian loads and stores of unaligned data
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+
+static inline uint32_t load_be32(const uint8_t *p)
 {
-	int cnt;
-	if(bit_len <= 28)
-		cnt = (bit_len - 1) / 7 + 1;
-	else
-		cnt = (bit_len - 1) / 8 + 2;
-	return cnt;
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return __builtin_bswap32(v);
+}
+
+static inline uint64_t load_be64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return __builtin_bswap64(v);
 }
 
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	v = __builtin_bswap32(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void store_be64(uint8_t *p, uint64_t v)
+{
+	v = __builtin_bswap64(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t load_be64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void store_be64(uint8_t *p, uint64_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+#else /* Fallback for generic compiler */
+
+static uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t load_be64(const uint8_t *p)
+{
+	return ((uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+	store_be32(p, (uint32_t)(v >> 32));
+	store_be32(p + 4, (uint32_t)v);
+}
+
+#endif /* end of big endian loads and stores */
+
 /* UInt
  0 ...  7 bits  1  byte  |0|x|x|x|x|x|x|x|<-- LSB
  8 ... 14 bits  2  bytes |1|0|x|x|x|x|x|x| |x|x|x|x|x|x|x|x|<-- LSB
@@ -129,36 +216,61 @@ static int bytes_needed(int bit_len)
                     n == 15 -> for future (number of bytes will be specified in next byte)
 */
 
-static void pack_uint_data_helper(ccpcp_pack_context* pack_context, uint64_t num, int bit_len)
+// maximal length of uint data of a 64 bit number
+#define UINT_DATA_MAX_LEN 9
+// maximal length of int data of a 64 bit number, one more bit for sign
+#define INT_DATA_MAX_LEN 10
+
+// Items are encoded straight into the pack buffer when there is room for
+// their maximal length, otherwise to the scratch buffer, which is then
+// copied piecewise through the overflow handler.
+static uint8_t *pack_begin(ccpcp_pack_context* pack_context, uint8_t *scratch, size_t max_len)
 {
-	int byte_cnt = bytes_needed(bit_len);
-	// 32 bytes should be enough for any number. Can't use a VLA for `bytes`, because MSVC doesn't support it.
-	if (byte_cnt > 32) {
-		abort();
-	}
-	uint8_t bytes[32];
-	int i;
-	for (i = byte_cnt-1; i >= 0; --i) {
-		uint8_t r = num & 255;
-		bytes[i] = r;
-		num = num >> 8;
-	}
+	uint8_t *p = ccpcp_pack_direct_begin(pack_context, max_len);
+	return p? p: scratch;
+}
 
-	uint8_t *head = bytes;
-	if(bit_len <= 28) {
-		uint8_t mask = (uint8_t)(0xf0 << (4 - byte_cnt));
-		*head = (uint8_t)(*head & ~mask);
-		mask = (uint8_t)(mask << 1);
-		*head = *head | mask;
+static void pack_end(ccpcp_pack_context* pack_context, const uint8_t *p, const uint8_t *scratch, size_t len)
+{
+	if (p == scratch)
+		ccpcp_pack_copy_bytes(pack_context, scratch, len);
+	else
+		ccpcp_pack_direct_end(pack_context, len);
+}
+
+// head bits of 1 to 4 bytes long uint data aligned to 32 bits
+static const uint32_t uint_data_head_bits[5] = {0, 0, 0x8000, 0xc00000, 0xe0000000};
+
+// bytes must have space for UINT_DATA_MAX_LEN bytes, INT_DATA_MAX_LEN in case of
+// int data, even when shorter data are encoded
+static size_t encode_uint_data_helper(uint8_t *bytes, uint64_t num, int bit_len)
+{
+	int byte_cnt = bytes_needed[bit_len];
+
+	if(byte_cnt <= 4) {
+		// num fits below the head bits, store all in one go
+		uint32_t data = (uint32_t)num | uint_data_head_bits[byte_cnt];
+		store_be32(bytes, data << (8 * (4 - byte_cnt)));
+	}
+	else if(byte_cnt <= 9) {
+		bytes[0] = (uint8_t)(0xf0 | (byte_cnt - 5));
+		store_be64(bytes + 1, num << (8 * (9 - byte_cnt)));
 	}
 	else {
-		*head = (uint8_t)(0xf0 | (byte_cnt - 5));
+		// 65 bits of negative int data
+		int i;
+		bytes[0] = (uint8_t)(0xf0 | (byte_cnt - 5));
+		for (i = byte_cnt-1; i >= 1; --i) {
+			bytes[i] = num & 255;
+			num = num >> 8;
+		}
 	}
+	return (size_t)byte_cnt;
+}
 
-	for ( i = 0; i < byte_cnt; ++i) {
-		uint8_t r = bytes[i];
-		ccpcp_pack_copy_byte(pack_context, r);
-	}
+static size_t encode_uint_data(uint8_t *bytes, uint64_t num)
+{
+	return encode_uint_data_helper(bytes, num, significant_bits_part_length(num));
 }
 
 void cchainpack_pack_uint_data(ccpcp_pack_context* pack_context, uint64_t num)
@@ -169,8 +281,9 @@ void cchainpack_pack_uint_data(ccpcp_pack_context* pack_context, uint64_t num)
 		return;
 	}
 
-	int bitlen = significant_bits_part_length(num);
-	pack_uint_data_helper(pack_context, num, bitlen);
+	uint8_t scratch[UINT_DATA_MAX_LEN];
+	uint8_t *p = pack_begin(pack_context, scratch, sizeof(scratch));
+	pack_end(pack_context, p, scratch, encode_uint_data(p, num));
 }
 
 /*
@@ -189,7 +302,7 @@ void cchainpack_pack_uint_data(ccpcp_pack_context* pack_context, uint64_t num)
 static int expand_bit_len(int bit_len)
 {
 	int ret;
-	int byte_cnt = bytes_needed(bit_len);
+	int byte_cnt = bytes_needed[bit_len];
 	if(bit_len <= 28) {
 		ret = byte_cnt * (8 - 1) - 1;
 	}
@@ -199,7 +312,7 @@ static int expand_bit_len(int bit_len)
 	return ret;
 }
 
-static void cchainpack_pack_int_data(ccpcp_pack_context* pack_context, int64_t snum)
+static size_t encode_int_data(uint8_t *bytes, int64_t snum)
 {
 	uint64_t num = (uint64_t)(snum < 0? -snum: snum);
 	bool neg = (snum < 0);
@@ -211,42 +324,57 @@ static void cchainpack_pack_int_data(ccpcp_pack_context* pack_context, int64_t s
 		uint64_t sign_bit_mask = (uint64_t)1 << sign_pos;
 		num |= sign_bit_mask;
 	}
-	pack_uint_data_helper(pack_context, num, bitlen);
+	return encode_uint_data_helper(bytes, num, bitlen);
 }
 
 void cchainpack_pack_uint(ccpcp_pack_context* pack_context, uint64_t i)
 {
 	if (pack_context->err_no)
 		return;
+
+	uint8_t scratch[1 + UINT_DATA_MAX_LEN];
+	uint8_t *p = pack_begin(pack_context, scratch, sizeof(scratch));
+	size_t len = 1;
 	if(i < 64) {
-		ccpcp_pack_copy_byte(pack_context, i % 64);
+		p[0] = i % 64;
 	}
 	else {
-		ccpcp_pack_copy_byte(pack_context, CP_UInt);
-		cchainpack_pack_uint_data(pack_context, i);
+		p[0] = CP_UInt;
+		len += encode_uint_data(p + 1, i);
 	}
+	pack_end(pack_context, p, scratch, len);
 }
 
 void cchainpack_pack_int(ccpcp_pack_context* pack_context, int64_t i)
 {
 	if (pack_context->err_no)
 		return;
+
+	uint8_t scratch[1 + INT_DATA_MAX_LEN];
+	uint8_t *p = pack_begin(pack_context, scratch, sizeof(scratch));
+	size_t len = 1;
 	if(i >= 0 && i < 64) {
-		ccpcp_pack_copy_byte(pack_context, (uint8_t)((i % 64) + 64));
+		p[0] = (uint8_t)((i % 64) + 64);
 	}
 	else {
-		ccpcp_pack_copy_byte(pack_context, CP_Int);
-		cchainpack_pack_int_data(pack_context, i);
+		p[0] = CP_Int;
+		len += encode_int_data(p + 1, i);
 	}
+	pack_end(pack_context, p, scratch, len);
 }
 
 void cchainpack_pack_decimal(ccpcp_pack_context *pack_context, int64_t i, int exponent)
 {
 	if (pack_context->err_no)
 		return;
-	ccpcp_pack_copy_byte(pack_context, CP_Decimal);
-	cchainpack_pack_int_data(pack_context, i);
-	cchainpack_pack_int_data(pack_context, exponent);
+
+	uint8_t scratch[1 + 2 * INT_DATA_MAX_LEN];
+	uint8_t *p = pack_begin(pack_context, scratch, sizeof(scratch));
+	size_t len = 1;
+	p[0] = CP_Decimal;
+	len += encode_int_data(p + len, i);
+	len += encode_int_data(p + len, exponent);
+	pack_end(pack_context, p, scratch, len);
 }
 
 void cchainpack_pack_double(ccpcp_pack_context* pack_context, double d)
@@ -254,7 +382,9 @@ void cchainpack_pack_double(ccpcp_pack_context* pack_context, double d)
 	if (pack_context->err_no)
 		return;
 
-	ccpcp_pack_copy_byte(pack_context, CP_Double);
+	uint8_t scratch[1 + sizeof(double)];
+	uint8_t *p = pack_begin(pack_context, scratch, sizeof(scratch));
+	p[0] = CP_Double;
 
 	const uint8_t*bytes = (const uint8_t*)&d;
 	int len = sizeof(double);
@@ -263,22 +393,17 @@ void cchainpack_pack_double(ccpcp_pack_context* pack_context, double d)
 	int i;
 	if(*(char *)&n == 1) {
 		// little endian if true
-		for (i=0; i<len; i++)
-			ccpcp_pack_copy_byte(pack_context, bytes[i]);
+		memcpy(p + 1, bytes, sizeof(double));
 	}
 	else {
-		for (i=len-1; i>=0; i--)
-			ccpcp_pack_copy_byte(pack_context, bytes[i]);
+		for (i=0; i<len; i++)
+			p[1 + i] = bytes[len - 1 - i];
 	}
+	pack_end(pack_context, p, scratch, sizeof(scratch));
 }
 
-void cchainpack_pack_date_time(ccpcp_pack_context *pack_context, int64_t epoch_msecs, int min_from_utc)
+static int64_t date_time_data(int64_t epoch_msecs, int min_from_utc)
 {
-	if (pack_context->err_no)
-		return;
-
-	ccpcp_pack_copy_byte(pack_context, CP_DateTime);
-
 	// some arguable optimizations when msec == 0 or TZ_offset == 0
 	// this can save byte in packed date-time, but packing scheme is more complicated
 	int64_t msecs = epoch_msecs - SHV_EPOCH_MSEC;
@@ -295,7 +420,19 @@ void cchainpack_pack_date_time(ccpcp_pack_context *pack_context, int64_t epoch_m
 		msecs |= 1;
 	if(ms == 0)
 		msecs |= 2;
-	cchainpack_pack_int_data(pack_context, msecs);
+	return msecs;
+}
+
+void cchainpack_pack_date_time(ccpcp_pack_context *pack_context, int64_t epoch_msecs, int min_from_utc)
+{
+	if (pack_context->err_no)
+		return;
+
+	int64_t msecs = date_time_data(epoch_msecs, min_from_utc);
+	uint8_t scratch[1 + INT_DATA_MAX_LEN];
+	uint8_t *p = pack_begin(pack_context, scratch, sizeof(scratch));
+	p[0] = CP_DateTime;
+	pack_end(pack_context, p, scratch, 1 + encode_int_data(p + 1, msecs));
 }
 
 void cchainpack_pack_null(ccpcp_pack_context* pack_context)
@@ -427,8 +564,79 @@ void cchainpack_pack_cstring_finish (ccpcp_pack_context* pack_context)
 	ccpcp_pack_copy_byte(pack_context, '\0');
 }
 
+//============================   S I Z E   ====================================
+
+size_t cchainpack_packed_size_uint_data(uint64_t num)
+{
+	return bytes_needed[significant_bits_part_length(num)];
+}
+
+static size_t packed_size_int_data(int64_t snum)
+{
+	uint64_t num = (uint64_t)(snum < 0? -snum: snum);
+	return bytes_needed[significant_bits_part_length(num) + 1];
+}
+
+size_t cchainpack_packed_size_int(int64_t i)
+{
+	if(i >= 0 && i < 64)
+		return 1;
+	return 1 + packed_size_int_data(i);
+}
+
+size_t cchainpack_packed_size_uint(uint64_t i)
+{
+	if(i < 64)
+		return 1;
+	return 1 + cchainpack_packed_size_uint_data(i);
+}
+
+size_t cchainpack_packed_size_double(void)
+{
+	return 1 + sizeof(double);
+}
+
+size_t cchainpack_packed_size_decimal(int64_t i, int exponent)
+{
+	return 1 + packed_size_int_data(i) + packed_size_int_data(exponent);
+}
+
+size_t cchainpack_packed_size_date_time(int64_t epoch_msecs, int min_from_utc)
+{
+	return 1 + packed_size_int_data(date_time_data(epoch_msecs, min_from_utc));
+}
+
+size_t cchainpack_packed_size_blob(size_t buff_len)
+{
+	return 1 + cchainpack_packed_size_uint_data(buff_len) + buff_len;
+}
+
+size_t cchainpack_packed_size_string(size_t buff_len)
+{
+	return 1 + cchainpack_packed_size_uint_data(buff_len) + buff_len;
+}
+
+size_t cchainpack_packed_size_cstring(const char* buff, size_t buff_len)
+{
+	size_t size = 1 + buff_len + 1;
+	size_t i;
+	for (i = 0; i < buff_len; ++i) {
+		if(buff[i] == '\0' || buff[i] == '\\')
+			size++;
+	}
+	return size;
+}
+
+size_t cchainpack_packed_size_marker(void)
+{
+	return 1;
+}
+
 //============================   U N P A C K   =================================
 
+// length of 1 to 4 bytes long uint data indexed by the upper half of the head byte
+static const uint8_t uint_data_len_from_head[15] = {1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 4};
+
 /// @pbitlen is used to enable same function usage for signed int unpacking
 static void unpack_uint(ccpcp_unpack_context* unpack_context, int *pbitlen)
 {
@@ -437,6 +645,31 @@ static void unpack_uint(ccpcp_unpack_context* unpack_context, int *pbitlen)
 	uint64_t num = 0;
 	int bitlen = 0;
 
+	if (unpack_context->end - unpack_context->current >= UINT_DATA_MAX_LEN) {
+		// all up to 64 bit numbers are in the buffer, decode without byte by byte reads
+		const uint8_t *data = (const uint8_t*)unpack_context->current;
+		uint8_t head = data[0];
+		int byte_cnt = 0;
+		if(head < 0xf0) {
+			byte_cnt = uint_data_len_from_head[head >> 4];
+			bitlen = 7 * byte_cnt;
+			num = (load_be32(data) >> (8 * (4 - byte_cnt))) & ((UINT32_C(1) << bitlen) - 1);
+		}
+		else if(head <= 0xf4) {
+			byte_cnt = (head & 0xf) + 5;
+			bitlen = (byte_cnt - 1) * 8;
+			num = load_be64(data + 1) >> (8 * (9 - byte_cnt));
+		}
+		if(byte_cnt) {
+			unpack_context->current += byte_cnt;
+			unpack_context->item.as.UInt = num;
+			unpack_context->item.type = CCPCP_ITEM_UINT;
+			if(pbitlen)
+				*pbitlen = bitlen;
+			return;
+		}
+	}
+
 	const char *p;
 	UNPACK_TAKE_BYTE(p);
 	uint8_t head = (uint8_t)(*p);
@@ -525,11 +758,37 @@ void unpack_string(ccpcp_unpack_context* unpack_context)
 		}
 	}
 	else {
+		bool in_place = false;
 		it->chunk_size = 0;
-		while(it->size_to_load > 0 && it->chunk_size < it->chunk_buff_len) {
-			UNPACK_TAKE_BYTE(p);
-			(it->chunk_start)[it->chunk_size++] = *p;
-			it->size_to_load--;
+		if(unpack_context->zero_copy_strings && it->size_to_load > 0) {
+			if(unpack_context->current >= unpack_context->end)
+				UNPACK_PEEK_BYTE(p);
+			size_t available = (size_t)(unpack_context->end - unpack_context->current);
+			size_t to_load = (size_t)it->size_to_load;
+			// rest of the string is in the input buffer or it would be chunked anyway
+			if(to_load <= available || to_load > it->chunk_buff_len) {
+				it->chunk_start = (char*)unpack_context->current;
+				it->chunk_size = to_load < available? to_load: available;
+				unpack_context->current += it->chunk_size;
+				it->size_to_load -= (long)it->chunk_size;
+				in_place = true;
+			}
+			else {
+				// short string split by the buffer end, copy it to have it in one chunk
+				it->chunk_start = unpack_context->string_chunk_buff;
+			}
+		}
+		while(!in_place && it->size_to_load > 0 && it->chunk_size < it->chunk_buff_len) {
+			UNPACK_PEEK_BYTE(p);
+			size_t n = (size_t)(unpack_context->end - p);
+			if(n > (size_t)it->size_to_load)
+				n = (size_t)it->size_to_load;
+			if(n > it->chunk_buff_len - it->chunk_size)
+				n = it->chunk_buff_len - it->chunk_size;
+			memcpy(it->chunk_start + it->chunk_size, p, n);
+			unpack_context->current += n;
+			it->chunk_size += n;
+			it->size_to_load -= (long)n;
 		}
 		it->last_chunk = (it->size_to_load == 0);
 	}
@@ -572,10 +831,236 @@ bool mul_overflow(int64_t a, int64_t b, int64_t* result)
 #endif
 }
 
-void cchainpack_unpack_next (ccpcp_unpack_context* unpack_context)
+// Item decoders dispatched by the packing schema byte
+typedef void (*unpack_schema_handler)(ccpcp_unpack_context* unpack_context, uint8_t packing_schema);
+
+static void unpack_tiny_uint(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	unpack_context->item.type = CCPCP_ITEM_UINT;
+	unpack_context->item.as.UInt = packing_schema & 63;
+}
+
+static void unpack_tiny_int(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	unpack_context->item.type = CCPCP_ITEM_INT;
+	unpack_context->item.as.Int = packing_schema & 63;
+}
+
+static void unpack_null(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_NULL;
+}
+
+static void unpack_false(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_BOOLEAN;
+	unpack_context->item.as.Bool = 0;
+}
+
+static void unpack_true(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_BOOLEAN;
+	unpack_context->item.as.Bool = 1;
+}
+
+static void unpack_schema_int(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_int(unpack_context);
+}
+
+static void unpack_schema_uint(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_uint(unpack_context, NULL);
+}
+
+static void unpack_double(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	const char *p;
+	unpack_context->item.type = CCPCP_ITEM_DOUBLE;
+	uint8_t*bytes = (uint8_t*)&(unpack_context->item.as.Double);
+	int len = sizeof(double);
+
+	int n = 1;
+	int i;
+	if(*(char *)&n == 1) {
+		// little endian if true
+		for (i=0; i<len; i++) {
+			UNPACK_TAKE_BYTE(p);
+			bytes[i] = (uint8_t)(*p);
+		}
+	}
+	else {
+		for (i=len-1; i>=0; i--) {
+			UNPACK_TAKE_BYTE(p);
+			bytes[i] = (uint8_t)(*p);
+		}
+	}
+}
+
+static void unpack_decimal(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_int(unpack_context);
+	int64_t mant = unpack_context->item.as.Int;
+	unpack_int(unpack_context);
+	int64_t exp = unpack_context->item.as.Int;
+	unpack_context->item.type = CCPCP_ITEM_DECIMAL;
+	unpack_context->item.as.Decimal.mantisa = mant;
+	unpack_context->item.as.Decimal.exponent = (int)exp;
+}
+
+static void unpack_date_time(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_int(unpack_context);
+	int64_t d = unpack_context->item.as.Int;
+	int8_t offset = 0;
+	bool has_tz_offset = d & 1;
+	bool has_not_msec = d & 2;
+	d >>= 2;
+	if (has_tz_offset) {
+		offset = d & 0x7F;
+		offset = (int8_t)(offset << 1);
+		offset >>= 1; // sign extension
+		d >>= 7;
+	}
+	if (has_not_msec) {
+		if (mul_overflow(d, 1000, &d)) {
+			UNPACK_ERROR(CCPCP_RC_MALFORMED_INPUT, "DateTime msec value overflow.");
+		}
+	}
+	d += SHV_EPOCH_MSEC;
+
+	unpack_context->item.type = CCPCP_ITEM_DATE_TIME;
+	ccpcp_date_time *it = &unpack_context->item.as.DateTime;
+	it->msecs_since_epoch = d;
+	it->minutes_from_utc = offset * (int)15;
+}
+
+static void unpack_meta_map(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_META;
+}
+
+static void unpack_map(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_MAP;
+}
+
+static void unpack_imap(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_IMAP;
+}
+
+static void unpack_list(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_LIST;
+}
+
+static void unpack_term(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	unpack_context->item.type = CCPCP_ITEM_CONTAINER_END;
+}
+
+static void unpack_blob_start(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	ccpcp_string *it = &unpack_context->item.as.String;
+	ccpcp_string_init(it, unpack_context);
+	unpack_uint(unpack_context, NULL);
+	if(unpack_context->err_no == CCPCP_RC_OK) {
+		it->string_size = (long)(unpack_context->item.as.UInt);
+		it->size_to_load = it->string_size;
+		unpack_blob(unpack_context);
+	}
+}
+
+static void unpack_string_start(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	ccpcp_string *it = &unpack_context->item.as.String;
+	ccpcp_string_init(it, unpack_context);
+	unpack_uint(unpack_context, NULL);
+	if(unpack_context->err_no == CCPCP_RC_OK) {
+		it->string_size = (long)(unpack_context->item.as.UInt);
+		it->size_to_load = it->string_size;
+		unpack_string(unpack_context);
+	}
+}
+
+static void unpack_cstring_start(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	ccpcp_string *it = &unpack_context->item.as.String;
+	ccpcp_string_init(it, unpack_context);
+	it->string_size = -1;
+	it->size_to_load = it->string_size;
+	unpack_string(unpack_context);
+}
+
+static void unpack_invalid(ccpcp_unpack_context* unpack_context, uint8_t packing_schema)
+{
+	(void)packing_schema;
+	UNPACK_ERROR(CCPCP_RC_MALFORMED_INPUT, "Invalid type info.");
+}
+
+#define UNPACK_H2(h) h, h
+#define UNPACK_H4(h) UNPACK_H2(h), UNPACK_H2(h)
+#define UNPACK_H8(h) UNPACK_H4(h), UNPACK_H4(h)
+#define UNPACK_H16(h) UNPACK_H8(h), UNPACK_H8(h)
+#define UNPACK_H32(h) UNPACK_H16(h), UNPACK_H16(h)
+#define UNPACK_H64(h) UNPACK_H32(h), UNPACK_H32(h)
+
+static const unpack_schema_handler unpack_schema_handlers[256] = {
+	UNPACK_H64(unpack_tiny_uint), // 0 - 63
+	UNPACK_H64(unpack_tiny_int), // 64 - 127
+	unpack_null, // CP_Null
+	unpack_schema_uint, // CP_UInt
+	unpack_schema_int, // CP_Int
+	unpack_double, // CP_Double
+	unpack_invalid, // CP_Bool
+	unpack_blob_start, // CP_Blob
+	unpack_string_start, // CP_String
+	unpack_invalid, // CP_DateTimeEpoch_depr
+	unpack_list, // CP_List
+	unpack_map, // CP_Map
+	unpack_imap, // CP_IMap
+	unpack_meta_map, // CP_MetaMap
+	unpack_decimal, // CP_Decimal
+	unpack_date_time, // CP_DateTime
+	unpack_cstring_start, // CP_CString
+	// 143 - 252
+	UNPACK_H64(unpack_invalid), UNPACK_H32(unpack_invalid), UNPACK_H8(unpack_invalid),
+	UNPACK_H4(unpack_invalid), UNPACK_H2(unpack_invalid),
+	unpack_false, // CP_FALSE
+	unpack_true, // CP_TRUE
+	unpack_term, // CP_TERM
+};
+
+#undef UNPACK_H2
+#undef UNPACK_H4
+#undef UNPACK_H8
+#undef UNPACK_H16
+#undef UNPACK_H32
+#undef UNPACK_H64
+
+// Returns true when a new item was read, false on error or for another chunk
+// of already started String or Blob.
+static inline bool unpack_next_item(ccpcp_unpack_context* unpack_context)
 {
 	if (unpack_context->err_no)
-		return;
+		return false;
 
 	if(unpack_context->item.type == CCPCP_ITEM_STRING || unpack_context->item.type == CCPCP_ITEM_BLOB) {
 		ccpcp_string *str_it = &unpack_context->item.as.String;
@@ -584,166 +1069,212 @@ void cchainpack_unpack_next (ccpcp_unpack_context* unpack_context)
 				unpack_string(unpack_context);
 			else
 				unpack_blob(unpack_context);
-			return;
+			return false;
 		}
 	}
 
-	const char *p;
-	UNPACK_TAKE_BYTE(p);
+	const char *p = ccpcp_unpack_take_byte(unpack_context);
+	if(!p)
+		return false;
 
 	uint8_t packing_schema = (uint8_t)(*p);
-
 	unpack_context->item.type = CCPCP_ITEM_INVALID;
-	if(packing_schema < 128) {
-		if(packing_schema & 64) {
-			// tiny Int
-			unpack_context->item.type = CCPCP_ITEM_INT;
-			unpack_context->item.as.Int = packing_schema & 63;
-		}
-		else {
-			// tiny UInt
-			unpack_context->item.type = CCPCP_ITEM_UINT;
-			unpack_context->item.as.UInt = packing_schema & 63;
-		}
+	unpack_schema_handlers[packing_schema](unpack_context, packing_schema);
+	return unpack_context->err_no == CCPCP_RC_OK;
+}
+
+void cchainpack_unpack_next_untracked (ccpcp_unpack_context* unpack_context)
+{
+	unpack_next_item(unpack_context);
+}
+
+void cchainpack_unpack_next (ccpcp_unpack_context* unpack_context)
+{
+	if(unpack_context->container_stack == NULL) {
+		// nothing to track, ccpcp_unpack_context_update_container_state() would be no-op
+		unpack_next_item(unpack_context);
+		return;
 	}
-	else {
-		switch(packing_schema) {
-		case CP_Null: {
-			unpack_context->item.type = CCPCP_ITEM_NULL;
-			break;
-		}
-		case CP_TRUE: {
-			unpack_context->item.type = CCPCP_ITEM_BOOLEAN;
-			unpack_context->item.as.Bool = 1;
-			break;
-		}
-		case CP_FALSE: {
-			unpack_context->item.type = CCPCP_ITEM_BOOLEAN;
-			unpack_context->item.as.Bool = 0;
-			break;
-		}
-		case CP_Int: {
-			unpack_int(unpack_context);
-			break;
-		}
-		case CP_UInt: {
-			unpack_uint(unpack_context, NULL);
-			break;
-		}
-		case CP_Double: {
-			unpack_context->item.type = CCPCP_ITEM_DOUBLE;
-			uint8_t*bytes = (uint8_t*)&(unpack_context->item.as.Double);
-			int len = sizeof(double);
-
-			int n = 1;
-			int i;
-			if(*(char *)&n == 1) {
-				// little endian if true
-				for (i=0; i<len; i++) {
-					UNPACK_TAKE_BYTE(p);
-					bytes[i] = (uint8_t)(*p);
-				}
-			}
-			else {
-				for (i=len-1; i>=0; i--) {
-					UNPACK_TAKE_BYTE(p);
-					bytes[i] = (uint8_t)(*p);
-				}
-			}
-			break;
-		}
-		case CP_Decimal: {
-			unpack_int(unpack_context);
-			int64_t mant = unpack_context->item.as.Int;
-			unpack_int(unpack_context);
-			int64_t exp = unpack_context->item.as.Int;
-			unpack_context->item.type = CCPCP_ITEM_DECIMAL;
-			unpack_context->item.as.Decimal.mantisa = mant;
-			unpack_context->item.as.Decimal.exponent = (int)exp;
-			break;
-		}
-		case CP_DateTime: {
-			unpack_int(unpack_context);
-			int64_t d = unpack_context->item.as.Int;
-			int8_t offset = 0;
-			bool has_tz_offset = d & 1;
-			bool has_not_msec = d & 2;
-			d >>= 2;
-			if (has_tz_offset) {
-				offset = d & 0x7F;
-				offset = (int8_t)(offset << 1);
-				offset >>= 1; // sign extension
-				d >>= 7;
-			}
-			if (has_not_msec) {
-				if (mul_overflow(d, 1000, &d)) {
-					UNPACK_ERROR(CCPCP_RC_MALFORMED_INPUT, "DateTime msec value overflow.");
-				}
-			}
-			d += SHV_EPOCH_MSEC;
+	if(unpack_next_item(unpack_context))
+		ccpcp_unpack_context_update_container_state(unpack_context);
+}
 
-			unpack_context->item.type = CCPCP_ITEM_DATE_TIME;
-			ccpcp_date_time *it = &unpack_context->item.as.DateTime;
-			it->msecs_since_epoch = d;
-			it->minutes_from_utc = offset * (int)15;
-			break;
-		}
-		case CP_MetaMap: {
-			unpack_context->item.type = CCPCP_ITEM_META;
-			break;
-		}
-		case CP_Map: {
-			unpack_context->item.type = CCPCP_ITEM_MAP;
-			break;
-		}
-		case CP_IMap: {
-			unpack_context->item.type = CCPCP_ITEM_IMAP;
-			break;
-		}
-		case CP_List: {
-			unpack_context->item.type = CCPCP_ITEM_LIST;
-			break;
-		}
-		case CP_TERM: {
-			unpack_context->item.type = CCPCP_ITEM_CONTAINER_END;
-			break;
+//============================   S K I P   ====================================
+
+static bool skip_bytes(ccpcp_unpack_context* unpack_context, uint64_t n)
+{
+	while(n > 0) {
+		if(unpack_context->current >= unpack_context->end) {
+			if(!ccpcp_unpack_peek_byte(unpack_context))
+				return false;
 		}
-		case CP_Blob: {
-			ccpcp_string *it = &unpack_context->item.as.String;
-			ccpcp_string_init(it, unpack_context);
-			unpack_uint(unpack_context, NULL);
-			if(unpack_context->err_no == CCPCP_RC_OK) {
-				it->string_size = (long)(unpack_context->item.as.UInt);
-				it->size_to_load = it->string_size;
-				unpack_blob(unpack_context);
+		size_t available = (size_t)(unpack_context->end - unpack_context->current);
+		if(available > n)
+			available = (size_t)n;
+		unpack_context->current += available;
+		n -= available;
+	}
+	return true;
+}
+
+static bool skip_uint_data(ccpcp_unpack_context* unpack_context)
+{
+	const char *p = ccpcp_unpack_take_byte(unpack_context);
+	if(!p)
+		return false;
+	uint8_t head = (uint8_t)*p;
+	if(head < 0xf0)
+		return skip_bytes(unpack_context, uint_data_len_from_head[head >> 4] - 1);
+	if(head <= 0xf4)
+		return skip_bytes(unpack_context, (head & 0xf) + 4);
+	unpack_context->err_no = CCPCP_RC_MALFORMED_INPUT;
+	unpack_context->err_msg = "Invalid uint data length.";
+	return false;
+}
+
+static bool skip_cstring_rest(ccpcp_unpack_context* unpack_context)
+{
+	for(;;) {
+		if(!ccpcp_unpack_peek_byte(unpack_context))
+			return false;
+		const char *p = unpack_context->current;
+		const char *end = unpack_context->end;
+		while(p < end && *p != '\0') {
+			if(*p == '\\') {
+				if(p + 1 == end)
+					break;
+				p++;
 			}
-			break;
+			p++;
 		}
-		case CP_String: {
-			ccpcp_string *it = &unpack_context->item.as.String;
-			ccpcp_string_init(it, unpack_context);
-			unpack_uint(unpack_context, NULL);
-			if(unpack_context->err_no == CCPCP_RC_OK) {
-				it->string_size = (long)(unpack_context->item.as.UInt);
-				it->size_to_load = it->string_size;
-				unpack_string(unpack_context);
+		unpack_context->current = end;
+		if(p < end) {
+			if(*p == '\0') {
+				unpack_context->current = p + 1;
+				return true;
 			}
-			break;
+			// escaped character is in the next buffer
+			if(!ccpcp_unpack_take_byte(unpack_context))
+				return false;
 		}
-		case CP_CString: {
-			ccpcp_string *it = &unpack_context->item.as.String;
-			ccpcp_string_init(it, unpack_context);
-			it->string_size = -1;
-			it->size_to_load = it->string_size;
-			unpack_string(unpack_context);
-			break;
-		}
-		default:
-			UNPACK_ERROR(CCPCP_RC_MALFORMED_INPUT, "Invalid type info.");
+	}
+}
+
+static bool skip_counted_string(ccpcp_unpack_context* unpack_context)
+{
+	unpack_uint(unpack_context, NULL);
+	if(unpack_context->err_no != CCPCP_RC_OK)
+		return false;
+	return skip_bytes(unpack_context, unpack_context->item.as.UInt);
+}
+
+// Skip items until depth container ends are consumed. With depth == 0
+// exactly one value is skipped, meta data included.
+static void skip_items(ccpcp_unpack_context* unpack_context, int depth)
+{
+	bool top_meta = false;
+	for(;;) {
+		const char *p = ccpcp_unpack_take_byte(unpack_context);
+		if(!p)
+			return;
+		uint8_t packing_schema = (uint8_t)*p;
+		bool ok = true;
+		if(packing_schema >= 128) {
+			switch(packing_schema) {
+			case CP_Null:
+			case CP_TRUE:
+			case CP_FALSE:
+				break;
+			case CP_UInt:
+			case CP_Int:
+			case CP_DateTime:
+				ok = skip_uint_data(unpack_context);
+				break;
+			case CP_Decimal:
+				ok = skip_uint_data(unpack_context) && skip_uint_data(unpack_context);
+				break;
+			case CP_Double:
+				ok = skip_bytes(unpack_context, sizeof(double));
+				break;
+			case CP_Blob:
+			case CP_String:
+				ok = skip_counted_string(unpack_context);
+				break;
+			case CP_CString:
+				ok = skip_cstring_rest(unpack_context);
+				break;
+			case CP_MetaMap:
+				if(depth == 0)
+					top_meta = true;
+				depth++;
+				continue;
+			case CP_List:
+			case CP_Map:
+			case CP_IMap:
+				depth++;
+				continue;
+			case CP_TERM:
+				if(depth == 0)
+					UNPACK_ERROR(CCPCP_RC_MALFORMED_INPUT, "Unexpected container end.");
+				depth--;
+				if(depth == 0 && top_meta) {
+					// meta data are followed by the value they belong to
+					top_meta = false;
+					continue;
+				}
+				break;
+			default:
+				UNPACK_ERROR(CCPCP_RC_MALFORMED_INPUT, "Invalid type info.");
+			}
 		}
+		if(!ok)
+			return;
+		if(depth == 0)
+			return;
+	}
+}
+
+void cchainpack_skip_string_rest(ccpcp_unpack_context* unpack_context)
+{
+	if (unpack_context->err_no)
+		return;
+	if(unpack_context->item.type != CCPCP_ITEM_STRING && unpack_context->item.type != CCPCP_ITEM_BLOB)
+		return;
+	ccpcp_string *it = &unpack_context->item.as.String;
+	if(it->last_chunk)
+		return;
+	bool ok;
+	if(it->string_size < 0) {
+		ok = skip_cstring_rest(unpack_context);
+	}
+	else {
+		ok = skip_bytes(unpack_context, (uint64_t)it->size_to_load);
+		if(ok)
+			it->size_to_load = 0;
+	}
+	if(ok) {
+		it->chunk_size = 0;
+		it->last_chunk = 1;
 	}
+}
+
+void cchainpack_skip_value(ccpcp_unpack_context* unpack_context)
+{
+	cchainpack_skip_string_rest(unpack_context);
+	if (unpack_context->err_no)
+		return;
+	skip_items(unpack_context, 0);
+	unpack_context->item.type = CCPCP_ITEM_INVALID;
+}
 
-	ccpcp_unpack_context_update_container_state(unpack_context);
+void cchainpack_skip_container_levels(ccpcp_unpack_context* unpack_context, int levels)
+{
+	cchainpack_skip_string_rest(unpack_context);
+	if (unpack_context->err_no || levels <= 0)
+		return;
+	skip_items(unpack_context, levels);
+	if (unpack_context->err_no == CCPCP_RC_OK)
+		unpack_context->item.type = CCPCP_ITEM_CONTAINER_END;
 }
 
 uint64_t cchainpack_unpack_uint_data(ccpcp_unpack_context *unpack_context, bool *ok)
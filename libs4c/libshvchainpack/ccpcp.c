@@ -88,6 +88,13 @@ static char* ccpcp_pack_reserve_space(ccpcp_pack_context* pack_context, size_t m
 
 size_t ccpcp_pack_copy_byte(ccpcp_pack_context *pack_context, uint8_t b)
 {
+	uint8_t *p0 = ccpcp_pack_direct_begin(pack_context, 1);
+	if (p0) {
+		*p0 = b;
+		ccpcp_pack_direct_end(pack_context, 1);
+		return 1;
+	}
+
 	pack_context->bytes_written += 1;
 	if(is_dry_run(pack_context))
 		return 1;
@@ -172,6 +179,7 @@ void ccpcp_unpack_context_init (ccpcp_unpack_context* self, const void *data, si
 	self->container_stack = stack;
 	self->string_chunk_buff = self->default_string_chunk_buff;
 	self->string_chunk_buff_len = sizeof(self->default_string_chunk_buff);
+	self->zero_copy_strings = false;
 }
 
 ccpcp_container_state *ccpcp_unpack_context_push_container_state(ccpcp_unpack_context *self, ccpcp_item_types container_type)
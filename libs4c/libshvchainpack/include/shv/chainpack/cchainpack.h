@@ -68,9 +68,119 @@ void cchainpack_pack_meta_begin (ccpcp_pack_context* pack_context);
 
 void cchainpack_pack_container_end(ccpcp_pack_context* pack_context);
 
+// Exact number of bytes the corresponding cchainpack_pack_* call produces,
+// computed without packing anything.
+size_t cchainpack_packed_size_uint_data(uint64_t num);
+size_t cchainpack_packed_size_int(int64_t i);
+size_t cchainpack_packed_size_uint(uint64_t i);
+size_t cchainpack_packed_size_double(void);
+size_t cchainpack_packed_size_decimal(int64_t i, int exponent);
+size_t cchainpack_packed_size_date_time(int64_t epoch_msecs, int min_from_utc);
+size_t cchainpack_packed_size_blob(size_t buff_len);
+size_t cchainpack_packed_size_string(size_t buff_len);
+size_t cchainpack_packed_size_cstring(const char* buff, size_t buff_len);
+// null, boolean, container begin and container end
+size_t cchainpack_packed_size_marker(void);
+
+// Accumulates packed size of a sequence of values, for example
+// cchainpack_size_builder b;
+// cchainpack_size_builder_init(&b);
+// cchainpack_size_add_imap_begin(&b);
+// cchainpack_size_add_int(&b, 1);
+// cchainpack_size_add_string(&b, strlen(str));
+// cchainpack_size_add_container_end(&b);
+// then b.size == bytes written by same sequence of cchainpack_pack_* calls.
+typedef struct {
+	size_t size;
+} cchainpack_size_builder;
+
+static inline void cchainpack_size_builder_init(cchainpack_size_builder* builder)
+{
+	builder->size = 0;
+}
+
+static inline void cchainpack_size_add_uint_data(cchainpack_size_builder* builder, uint64_t num)
+{
+	builder->size += cchainpack_packed_size_uint_data(num);
+}
+
+static inline void cchainpack_size_add_null(cchainpack_size_builder* builder)
+{
+	builder->size += 1;
+}
+
+static inline void cchainpack_size_add_boolean(cchainpack_size_builder* builder)
+{
+	builder->size += 1;
+}
+
+static inline void cchainpack_size_add_int(cchainpack_size_builder* builder, int64_t i)
+{
+	builder->size += (i >= 0 && i < 64)? 1: cchainpack_packed_size_int(i);
+}
+
+static inline void cchainpack_size_add_uint(cchainpack_size_builder* builder, uint64_t i)
+{
+	builder->size += (i < 64)? 1: cchainpack_packed_size_uint(i);
+}
+
+static inline void cchainpack_size_add_double(cchainpack_size_builder* builder)
+{
+	builder->size += 1 + sizeof(double);
+}
+
+static inline void cchainpack_size_add_blob(cchainpack_size_builder* builder, size_t buff_len)
+{
+	builder->size += cchainpack_packed_size_blob(buff_len);
+}
+
+static inline void cchainpack_size_add_string(cchainpack_size_builder* builder, size_t buff_len)
+{
+	builder->size += cchainpack_packed_size_string(buff_len);
+}
+
+static inline void cchainpack_size_add_list_begin(cchainpack_size_builder* builder)
+{
+	builder->size += 1;
+}
+
+static inline void cchainpack_size_add_map_begin(cchainpack_size_builder* builder)
+{
+	builder->size += 1;
+}
+
+static inline void cchainpack_size_add_imap_begin(cchainpack_size_builder* builder)
+{
+	builder->size += 1;
+}
+
+static inline void cchainpack_size_add_meta_begin(cchainpack_size_builder* builder)
+{
+	builder->size += 1;
+}
+
+static inline void cchainpack_size_add_container_end(cchainpack_size_builder* builder)
+{
+	builder->size += 1;
+}
+
 uint64_t cchainpack_unpack_uint_data(ccpcp_unpack_context *unpack_context, bool *ok);
 uint64_t cchainpack_unpack_uint_data2(ccpcp_unpack_context *unpack_context, int *err_code);
 void cchainpack_unpack_next (ccpcp_unpack_context* unpack_context);
+// Same as cchainpack_unpack_next(), but container states are never updated,
+// even if unpack_context has the container_stack set.
+void cchainpack_unpack_next_untracked (ccpcp_unpack_context* unpack_context);
+
+// Skipping does not build items and does not copy String and Blob data,
+// container states are not updated either.
+// Advance past the next complete value, nested containers and meta data included.
+// Rest of the String or Blob currently being unpacked is skipped first.
+void cchainpack_skip_value(ccpcp_unpack_context* unpack_context);
+// Advance past levels container ends, 1 finishes the container just unpacked.
+// The item type is CCPCP_ITEM_CONTAINER_END afterwards.
+void cchainpack_skip_container_levels(ccpcp_unpack_context* unpack_context, int levels);
+// Skip remaining chunks of the String or Blob currently being unpacked.
+void cchainpack_skip_string_rest(ccpcp_unpack_context* unpack_context);
 
 #ifdef __cplusplus
 }
@@ -59,6 +59,27 @@ void ccpcp_pack_context_dry_run_init(ccpcp_pack_context* pack_context);
 size_t ccpcp_pack_copy_byte(ccpcp_pack_context* pack_context, uint8_t b);
 size_t ccpcp_pack_copy_bytes(ccpcp_pack_context* pack_context, const void *str, size_t len);
 
+// Direct write access to the pack buffer.
+// Returns pointer where up to len bytes can be written straight away,
+// or NULL when the buffer end is closer than len, the context is in error
+// or it is a dry run. Overflow handler is never called, the caller is
+// expected to fall back to ccpcp_pack_copy_bytes() when NULL is returned.
+static inline uint8_t* ccpcp_pack_direct_begin(ccpcp_pack_context* pack_context, size_t len)
+{
+	if (pack_context->err_no == CCPCP_RC_OK
+			&& (size_t)(pack_context->end - pack_context->current) >= len
+			&& pack_context->current != NULL)
+		return (uint8_t*)pack_context->current;
+	return NULL;
+}
+
+// Commit len bytes written to the pointer returned by ccpcp_pack_direct_begin()
+static inline void ccpcp_pack_direct_end(ccpcp_pack_context* pack_context, size_t len)
+{
+	pack_context->current += len;
+	pack_context->bytes_written += len;
+}
+
 //=========================== UNPACK ============================
 
 struct ccpcp_unpack_context;
@@ -165,6 +186,12 @@ typedef struct ccpcp_unpack_context {
 	char default_string_chunk_buff[CCPCP_STRING_CHUNK_BUFF_LEN];
 	char *string_chunk_buff;
 	size_t string_chunk_buff_len;
+	/* ChainPack String and Blob chunk_start points into the input buffer
+	 * instead of string_chunk_buff whenever the data are there. Such chunk
+	 * is valid until the next underflow handler call and must not be modified.
+	 * Strings up to string_chunk_buff_len long are still returned in one chunk.
+	 */
+	bool zero_copy_strings;
 } ccpcp_unpack_context;
 
 void ccpcp_unpack_context_init(ccpcp_unpack_context* self, const void* data, size_t length
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <shv/chainpack/ccpcp.h>
+#include <shv/chainpack/cchainpack.h>
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+// Packing throughput benchmark, not a test.
+// The packed data go to a small buffer which is recycled by the overflow
+// handler, the same way libshvtree streams its messages.
+
+#define BUFFLEN 1024ul
+#define ITEMS_PER_ROUND 1000
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static char buff[BUFFLEN];
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t flushed;
+
+static void overflow_handler(ccpcp_pack_context *ctx, size_t size_hint)
+{
+	(void)size_hint;
+	flushed += (size_t)(ctx->current - ctx->start);
+	ctx->current = ctx->start;
+}
+
+static void pack_small_int(ccpcp_pack_context *ctx, int i)
+{
+	cchainpack_pack_int(ctx, i & 63);
+}
+
+static void pack_int(ccpcp_pack_context *ctx, int i)
+{
+	cchainpack_pack_int(ctx, (int64_t)i * 7919 - 1000000);
+}
+
+static void pack_uint(ccpcp_pack_context *ctx, int i)
+{
+	cchainpack_pack_uint(ctx, (uint64_t)i * 0x9E3779B97F4A7C15u >> (i & 63));
+}
+
+static void pack_double(ccpcp_pack_context *ctx, int i)
+{
+	cchainpack_pack_double(ctx, i * 1.25);
+}
+
+static void pack_date_time(ccpcp_pack_context *ctx, int i)
+{
+	cchainpack_pack_date_time(ctx, 1700000000000 + i * 1001, 60);
+}
+
+static void pack_reply(ccpcp_pack_context *ctx, int i)
+{
+	// shape of a typical SHV RPC reply <1:1,8:rid,11:cid>i{2:value}
+	cchainpack_pack_meta_begin(ctx);
+	cchainpack_pack_int(ctx, 1);
+	cchainpack_pack_int(ctx, 1);
+	cchainpack_pack_int(ctx, 8);
+	cchainpack_pack_int(ctx, i);
+	cchainpack_pack_int(ctx, 11);
+	cchainpack_pack_int(ctx, 3);
+	cchainpack_pack_container_end(ctx);
+	cchainpack_pack_imap_begin(ctx);
+	cchainpack_pack_int(ctx, 2);
+	cchainpack_pack_double(ctx, i * 0.5);
+	cchainpack_pack_container_end(ctx);
+}
+
+typedef struct {
+	const char *name;
+	void (*pack)(ccpcp_pack_context *ctx, int i);
+} bench_case;
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void run_case(const bench_case *bc, int rounds)
+{
+	ccpcp_pack_context ctx;
+	ccpcp_pack_context_init(&ctx, buff, BUFFLEN, overflow_handler);
+	flushed = 0;
+
+	double t0 = now_sec();
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < ITEMS_PER_ROUND; i++)
+			bc->pack(&ctx, i + r);
+	}
+	double t = now_sec() - t0;
+	overflow_handler(&ctx, 0);
+
+	double items = (double)rounds * ITEMS_PER_ROUND;
+	printf("%-12s %8.1f MB/s %8.1f Mitems/s %6.2f bytes/item%s\n", bc->name,
+		   (double)flushed / t / 1e6, items / t / 1e6, (double)flushed / items,
+		   ctx.err_no == CCPCP_RC_OK? "": " ERROR");
+}
+
+static void run_unpack_case(const bench_case *bc, int rounds)
+{
+	static char data[32 * ITEMS_PER_ROUND];
+	ccpcp_pack_context ctx;
+	ccpcp_pack_context_init(&ctx, data, sizeof(data), NULL);
+	for (int i = 0; i < ITEMS_PER_ROUND; i++)
+		bc->pack(&ctx, i);
+	size_t len = (size_t)(ctx.current - ctx.start);
+
+	ccpcp_unpack_context in_ctx;
+	uint64_t sum = 0;
+	double t0 = now_sec();
+	for (int r = 0; r < rounds; r++) {
+		ccpcp_unpack_context_init(&in_ctx, data, len, NULL, NULL);
+		while (in_ctx.current < in_ctx.end) {
+			cchainpack_unpack_next(&in_ctx);
+			sum += in_ctx.item.as.UInt;
+		}
+	}
+	double t = now_sec() - t0;
+
+	double items = (double)rounds * ITEMS_PER_ROUND;
+	printf("unpack_%-5s %8.1f MB/s %8.1f Mitems/s %6.2f bytes/item%s\n", bc->name,
+		   (double)len * rounds / t / 1e6, items / t / 1e6, (double)len / ITEMS_PER_ROUND,
+		   in_ctx.err_no == CCPCP_RC_OK && sum? "": " ERROR");
+}
+
+int main(int argc, char *argv[])
+{
+	static const bench_case cases[] = {
+		{"small_int", pack_small_int},
+		{"int", pack_int},
+		{"uint", pack_uint},
+		{"double", pack_double},
+		{"date_time", pack_date_time},
+		{"rpc_reply", pack_reply},
+	};
+	int rounds = 20000;
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		run_case(&cases[i], rounds);
+	for (size_t i = 1; i < 3; i++)
+		run_unpack_case(&cases[i], rounds);
+	run_unpack_case(&cases[5], rounds);
+	return 0;
+}
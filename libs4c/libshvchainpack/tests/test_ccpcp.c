@@ -402,6 +402,348 @@ static void test_dry_run_int(int n)
 	assert(dry_run_size == packed_size);
 }
 
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static char varint_stream[64];
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t varint_stream_len;
+
+static void varint_pack_overflow(ccpcp_pack_context *ctx, size_t size_hint)
+{
+	(void)size_hint;
+	// one byte buffer, stream it to varint_stream
+	if(ctx->current > ctx->start)
+		varint_stream[varint_stream_len++] = *ctx->start;
+	ctx->current = ctx->start;
+}
+
+static size_t varint_unpack_underflow(ccpcp_unpack_context *ctx)
+{
+	// feed the data back byte by byte
+	ctx->start = ctx->end;
+	ctx->end = ctx->start + 1;
+	return 1;
+}
+
+static void test_chainpack_varint(uint64_t n, bool is_signed)
+{
+	int64_t sn = (int64_t)n;
+	char out_buff[32];
+	char byte_buff[1];
+	ccpcp_pack_context out_ctx;
+	ccpcp_unpack_context in_ctx;
+
+	// packed in one piece and through the overflow handler byte by byte
+	ccpcp_pack_context_init(&out_ctx, out_buff, sizeof (out_buff), NULL);
+	if(is_signed)
+		cchainpack_pack_int(&out_ctx, sn);
+	else
+		cchainpack_pack_uint(&out_ctx, n);
+	size_t len = (size_t)(out_ctx.current - out_ctx.start);
+	// followed by nulls, so the decoder has the whole number in the buffer
+	for (int i = 0; i < 10; i++)
+		cchainpack_pack_null(&out_ctx);
+	assert(out_ctx.err_no == CCPCP_RC_OK);
+
+	varint_stream_len = 0;
+	ccpcp_pack_context_init(&out_ctx, byte_buff, sizeof (byte_buff), varint_pack_overflow);
+	if(is_signed)
+		cchainpack_pack_int(&out_ctx, sn);
+	else
+		cchainpack_pack_uint(&out_ctx, n);
+	varint_pack_overflow(&out_ctx, 0);
+	assert(varint_stream_len == len);
+	assert(memcmp(varint_stream, out_buff, len) == 0);
+
+	// unpacked from the whole buffer and byte by byte
+	for (int byte_by_byte = 0; byte_by_byte < 2; byte_by_byte++) {
+		ccpcp_unpack_context_init(&in_ctx, out_buff, byte_by_byte? 1: sizeof (out_buff),
+								  byte_by_byte? varint_unpack_underflow: NULL, NULL);
+		cchainpack_unpack_next(&in_ctx);
+		assert(in_ctx.err_no == CCPCP_RC_OK);
+		if(is_signed) {
+			assert(in_ctx.item.type == CCPCP_ITEM_INT);
+			assert(in_ctx.item.as.Int == sn);
+		}
+		else {
+			assert(in_ctx.item.type == CCPCP_ITEM_UINT);
+			assert(in_ctx.item.as.UInt == n);
+		}
+		cchainpack_unpack_next(&in_ctx);
+		assert(in_ctx.item.type == CCPCP_ITEM_NULL);
+	}
+}
+
+static void test_chainpack_varints(void)
+{
+	printf("------------- chainpack varint lengths\n");
+	for (int bits = 0; bits <= 64; bits++) {
+		uint64_t max = bits == 64? UINT64_MAX: ((uint64_t)1 << bits) - 1;
+		test_chainpack_varint(max, false);
+		test_chainpack_varint(max + 1, false);
+		if(bits < 64) {
+			// magnitude of INT64_MIN does not fit the int64_t, it cannot be packed
+			test_chainpack_varint(max, true);
+			test_chainpack_varint((uint64_t)-(int64_t)max, true);
+		}
+		if(bits < 63)
+			test_chainpack_varint(max + 1, true);
+	}
+}
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static const char *string_stream_end;
+
+static size_t string_unpack_underflow(ccpcp_unpack_context *ctx)
+{
+	// feed the data back in 7 byte pieces
+	ctx->start = ctx->end;
+	ctx->end = ctx->start + 7;
+	if(ctx->end > string_stream_end)
+		ctx->end = string_stream_end;
+	return (size_t)(ctx->end - ctx->start);
+}
+
+static void test_chainpack_zero_copy_strings(void)
+{
+	printf("------------- chainpack zero copy strings\n");
+	static const size_t lens[] = {0, 1, 6, 100, 255, 256, 257, 1000};
+	static char out_buff[2 * 1024 * 8];
+	char str[1000];
+	for (size_t i = 0; i < sizeof(str); i++)
+		str[i] = (char)('a' + i % 26);
+
+	ccpcp_pack_context out_ctx;
+	ccpcp_pack_context_init(&out_ctx, out_buff, sizeof (out_buff), NULL);
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		cchainpack_pack_string(&out_ctx, str, lens[i]);
+		cchainpack_pack_blob(&out_ctx, (const uint8_t*)str, lens[i]);
+	}
+	assert(out_ctx.err_no == CCPCP_RC_OK);
+	string_stream_end = out_ctx.current;
+
+	for (int mode = 0; mode < 3; mode++) {
+		// zero copy from whole buffer, zero copy and copy from 7 byte pieces
+		bool pieces = mode > 0;
+		ccpcp_unpack_context in_ctx;
+		ccpcp_unpack_context_init(&in_ctx, out_buff, pieces? 7: (size_t)(out_ctx.current - out_ctx.start),
+								  pieces? string_unpack_underflow: NULL, NULL);
+		in_ctx.zero_copy_strings = mode < 2;
+		for (size_t i = 0; i < 2 * sizeof(lens) / sizeof(lens[0]); i++) {
+			size_t len = lens[i / 2];
+			size_t loaded = 0;
+			do {
+				cchainpack_unpack_next(&in_ctx);
+				assert(in_ctx.err_no == CCPCP_RC_OK);
+				assert(in_ctx.item.type == (i % 2? CCPCP_ITEM_BLOB: CCPCP_ITEM_STRING));
+				ccpcp_string *it = &in_ctx.item.as.String;
+				assert(loaded + it->chunk_size <= len);
+				assert(memcmp(it->chunk_start, str + loaded, it->chunk_size) == 0);
+				bool in_input = it->chunk_start >= out_buff && it->chunk_start < out_buff + sizeof(out_buff);
+				if(in_ctx.zero_copy_strings && !pieces)
+					assert(in_input || it->chunk_size == 0);
+				if(!in_ctx.zero_copy_strings)
+					assert(!in_input);
+				// short strings are never split
+				if(len <= in_ctx.string_chunk_buff_len)
+					assert(it->chunk_cnt == 1 && it->last_chunk);
+				loaded += it->chunk_size;
+			} while (!in_ctx.item.as.String.last_chunk);
+			assert(loaded == len);
+		}
+	}
+}
+
+// NOLINTNEXTLINE(cppcoreguidelines-avoid-non-const-global-variables)
+static size_t skip_piece_len;
+
+static size_t skip_unpack_underflow(ccpcp_unpack_context *ctx)
+{
+	ctx->start = ctx->end;
+	ctx->end = ctx->start + skip_piece_len;
+	if(ctx->end > string_stream_end)
+		ctx->end = string_stream_end;
+	return (size_t)(ctx->end - ctx->start);
+}
+
+static void pack_skip_values(ccpcp_pack_context *ctx, int i)
+{
+	static const char cstr[] = "esc\\ap\0ed\\";
+	static char long_str[1000];
+	switch (i) {
+	case 0: cchainpack_pack_int(ctx, -123456789); break;
+	case 1: cchainpack_pack_uint(ctx, UINT64_MAX); break;
+	case 2: cchainpack_pack_double(ctx, 1.5); break;
+	case 3: cchainpack_pack_decimal(ctx, -1234567, -3); break;
+	case 4: cchainpack_pack_date_time(ctx, 1700000000123, 60); break;
+	case 5: cchainpack_pack_string(ctx, long_str, sizeof(long_str)); break;
+	case 6: cchainpack_pack_blob(ctx, (const uint8_t*)long_str, 300); break;
+	case 7: cchainpack_pack_cstring(ctx, cstr, sizeof(cstr) - 1); break;
+	case 8: cchainpack_pack_null(ctx); break;
+	case 9:
+		// <1:"meta",2:[]>i{1:[1,"a",{"k":<>null}],2:b"xx"}
+		cchainpack_pack_meta_begin(ctx);
+		cchainpack_pack_int(ctx, 1);
+		cchainpack_pack_string(ctx, "meta", 4);
+		cchainpack_pack_int(ctx, 2);
+		cchainpack_pack_list_begin(ctx);
+		cchainpack_pack_container_end(ctx);
+		cchainpack_pack_container_end(ctx);
+		cchainpack_pack_imap_begin(ctx);
+		cchainpack_pack_int(ctx, 1);
+		cchainpack_pack_list_begin(ctx);
+		cchainpack_pack_int(ctx, 1);
+		cchainpack_pack_cstring(ctx, cstr, sizeof(cstr) - 1);
+		cchainpack_pack_map_begin(ctx);
+		cchainpack_pack_string(ctx, "k", 1);
+		cchainpack_pack_meta_begin(ctx);
+		cchainpack_pack_container_end(ctx);
+		cchainpack_pack_null(ctx);
+		cchainpack_pack_container_end(ctx);
+		cchainpack_pack_container_end(ctx);
+		cchainpack_pack_int(ctx, 2);
+		cchainpack_pack_blob(ctx, (const uint8_t*)"xx", 2);
+		cchainpack_pack_container_end(ctx);
+		break;
+	}
+}
+
+#define SKIP_VALUES_CNT 10
+
+static void test_chainpack_skip(void)
+{
+	printf("------------- chainpack skip\n");
+	static char out_buff[4096];
+	ccpcp_pack_context out_ctx;
+	ccpcp_pack_context_init(&out_ctx, out_buff, sizeof (out_buff), NULL);
+	for (int i = 0; i < SKIP_VALUES_CNT; i++) {
+		pack_skip_values(&out_ctx, i);
+		cchainpack_pack_int(&out_ctx, i);
+	}
+	// a list left after its first item and a string left after its first chunk
+	cchainpack_pack_list_begin(&out_ctx);
+	pack_skip_values(&out_ctx, 0);
+	pack_skip_values(&out_ctx, 9);
+	cchainpack_pack_container_end(&out_ctx);
+	pack_skip_values(&out_ctx, 5);
+	pack_skip_values(&out_ctx, 7);
+	cchainpack_pack_int(&out_ctx, 63);
+	assert(out_ctx.err_no == CCPCP_RC_OK);
+	string_stream_end = out_ctx.current;
+
+	static const size_t pieces[] = {0, 1, 2, 7, 100};
+	for (size_t k = 0; k < sizeof(pieces) / sizeof(pieces[0]); k++) {
+		skip_piece_len = pieces[k];
+		ccpcp_unpack_context in_ctx;
+		ccpcp_unpack_context_init(&in_ctx, out_buff, skip_piece_len? skip_piece_len: (size_t)(out_ctx.current - out_ctx.start),
+								  skip_piece_len? skip_unpack_underflow: NULL, NULL);
+		in_ctx.zero_copy_strings = true;
+		for (int i = 0; i < SKIP_VALUES_CNT; i++) {
+			cchainpack_skip_value(&in_ctx);
+			assert(in_ctx.err_no == CCPCP_RC_OK);
+			cchainpack_unpack_next(&in_ctx);
+			assert(in_ctx.err_no == CCPCP_RC_OK);
+			assert(in_ctx.item.type == CCPCP_ITEM_INT && in_ctx.item.as.Int == i);
+		}
+		cchainpack_unpack_next(&in_ctx);
+		assert(in_ctx.item.type == CCPCP_ITEM_LIST);
+		cchainpack_unpack_next(&in_ctx);
+		assert(in_ctx.item.type == CCPCP_ITEM_INT);
+		cchainpack_skip_container_levels(&in_ctx, 1);
+		assert(in_ctx.err_no == CCPCP_RC_OK);
+		assert(in_ctx.item.type == CCPCP_ITEM_CONTAINER_END);
+		for (int i = 0; i < 2; i++) {
+			cchainpack_unpack_next(&in_ctx);
+			assert(in_ctx.item.type == CCPCP_ITEM_STRING);
+			if(skip_piece_len && i == 0)
+				assert(!in_ctx.item.as.String.last_chunk);
+			cchainpack_skip_string_rest(&in_ctx);
+			assert(in_ctx.err_no == CCPCP_RC_OK);
+			assert(in_ctx.item.as.String.last_chunk);
+		}
+		cchainpack_unpack_next(&in_ctx);
+		assert(in_ctx.err_no == CCPCP_RC_OK);
+		assert(in_ctx.item.type == CCPCP_ITEM_INT && in_ctx.item.as.Int == 63);
+		assert(in_ctx.current == string_stream_end);
+	}
+}
+
+static void test_chainpack_packed_size(void)
+{
+	printf("------------- chainpack packed size\n");
+	static char out_buff[1024];
+	static char seq_buff[512];
+	ccpcp_pack_context out_ctx;
+	// seq_ctx packs the same sequence of values as is added to the size builder
+	ccpcp_pack_context seq_ctx;
+	cchainpack_size_builder b;
+	cchainpack_size_builder_init(&b);
+	ccpcp_pack_context_init(&out_ctx, out_buff, sizeof (out_buff), NULL);
+	ccpcp_pack_context_init(&seq_ctx, seq_buff, sizeof (seq_buff), NULL);
+#define CHECK_SIZE(pack, size) \
+	{ \
+		size_t before = out_ctx.bytes_written; \
+		pack; \
+		assert(out_ctx.err_no == CCPCP_RC_OK); \
+		assert(out_ctx.bytes_written - before == (size)); \
+		out_ctx.current = out_ctx.start; \
+	}
+	for (int bits = 0; bits <= 64; bits++) {
+		uint64_t max = bits == 64? UINT64_MAX: ((uint64_t)1 << bits) - 1;
+		uint64_t vals[] = {max, max + 1, max / 3};
+		for (size_t i = 0; i < sizeof(vals) / sizeof(vals[0]); i++) {
+			uint64_t n = vals[i];
+			int64_t s = (int64_t)(n >> 1);
+			CHECK_SIZE(cchainpack_pack_uint_data(&out_ctx, n), cchainpack_packed_size_uint_data(n));
+			CHECK_SIZE(cchainpack_pack_uint(&out_ctx, n), cchainpack_packed_size_uint(n));
+			CHECK_SIZE(cchainpack_pack_int(&out_ctx, s), cchainpack_packed_size_int(s));
+			CHECK_SIZE(cchainpack_pack_int(&out_ctx, -s), cchainpack_packed_size_int(-s));
+			CHECK_SIZE(cchainpack_pack_decimal(&out_ctx, -s, bits - 32), cchainpack_packed_size_decimal(-s, bits - 32));
+			cchainpack_size_add_uint(&b, n);
+			cchainpack_size_add_int(&b, -s);
+			cchainpack_pack_uint(&seq_ctx, n);
+			cchainpack_pack_int(&seq_ctx, -s);
+			seq_ctx.current = seq_ctx.start;
+		}
+	}
+	static const int64_t dts[] = {0, 1517529600000, 1517529600001, 1700000000000, -1000, 4102444800123};
+	static const int offsets[] = {0, 60, -120, 15};
+	for (size_t i = 0; i < sizeof(dts) / sizeof(dts[0]); i++) {
+		for (size_t j = 0; j < sizeof(offsets) / sizeof(offsets[0]); j++) {
+			CHECK_SIZE(cchainpack_pack_date_time(&out_ctx, dts[i], offsets[j])
+					   , cchainpack_packed_size_date_time(dts[i], offsets[j]));
+		}
+	}
+	static const char str[] = "a\\b\0c\\\\d";
+	static const size_t lens[] = {0, 1, 9, 127, 128, 300};
+	static char long_str[300];
+	for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+		CHECK_SIZE(cchainpack_pack_string(&out_ctx, long_str, lens[i]), cchainpack_packed_size_string(lens[i]));
+		CHECK_SIZE(cchainpack_pack_blob(&out_ctx, (const uint8_t*)long_str, lens[i]), cchainpack_packed_size_blob(lens[i]));
+		cchainpack_size_add_string(&b, lens[i]);
+		cchainpack_pack_string(&seq_ctx, long_str, lens[i]);
+		seq_ctx.current = seq_ctx.start;
+	}
+	CHECK_SIZE(cchainpack_pack_cstring(&out_ctx, str, sizeof(str) - 1), cchainpack_packed_size_cstring(str, sizeof(str) - 1));
+	CHECK_SIZE(cchainpack_pack_double(&out_ctx, 1.5), cchainpack_packed_size_double());
+	CHECK_SIZE(cchainpack_pack_null(&out_ctx), cchainpack_packed_size_marker());
+	CHECK_SIZE(cchainpack_pack_boolean(&out_ctx, true), cchainpack_packed_size_marker());
+	CHECK_SIZE(cchainpack_pack_imap_begin(&out_ctx), cchainpack_packed_size_marker());
+	CHECK_SIZE(cchainpack_pack_container_end(&out_ctx), cchainpack_packed_size_marker());
+#undef CHECK_SIZE
+	cchainpack_size_add_meta_begin(&b);
+	cchainpack_size_add_null(&b);
+	cchainpack_size_add_boolean(&b);
+	cchainpack_size_add_double(&b);
+	cchainpack_size_add_container_end(&b);
+	cchainpack_pack_meta_begin(&seq_ctx);
+	cchainpack_pack_null(&seq_ctx);
+	cchainpack_pack_boolean(&seq_ctx, false);
+	cchainpack_pack_double(&seq_ctx, 0.25);
+	cchainpack_pack_container_end(&seq_ctx);
+	assert(seq_ctx.err_no == CCPCP_RC_OK);
+	assert(seq_ctx.bytes_written == b.size);
+}
+
 #define INIT_OUT_CONTEXT() \
 	char out_buff1[1024]; \
 	ccpcp_pack_context out_ctx; \
@@ -744,6 +1086,11 @@ int main(int argc, const char * argv[])
 	test_dry_run_int(1234);
 	test_dry_run_int(-12345);
 
+	test_chainpack_varints();
+	test_chainpack_zero_copy_strings();
+	test_chainpack_packed_size();
+	test_chainpack_skip();
+
 	test_pack_decimal(0, 0, "0.");
 	test_pack_decimal(83, 1, "830.");
 	test_pack_decimal(83, 0, "83.");
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_arena.h
+ * @brief Arena allocator a whole tree can be built into
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+struct shv_arena_chunk;
+
+/**
+ * @brief A bump allocator.
+ *
+ * Memory is handed out from large chunks in the order it is asked for,
+ * so the nodes of a tree built into the arena are packed next to each
+ * other. Nothing is freed separately, all the chunks are freed at once
+ * by shv_arena_destroy().
+ */
+struct shv_arena
+{
+    size_t chunk_size;              /* Size of a newly allocated chunk */
+    size_t used;                    /* Used bytes of the current chunk */
+    struct shv_arena_chunk *chunks; /* Allocated chunks, the current one first */
+};
+
+/**
+ * @brief Initialize the arena, no memory is allocated until asked for.
+ *
+ * @param arena
+ * @param chunk_size Size of the chunks memory is allocated in
+ */
+void shv_arena_init(struct shv_arena *arena, size_t chunk_size);
+
+/**
+ * @brief Free all memory of the arena.
+ *
+ * @param arena
+ */
+void shv_arena_destroy(struct shv_arena *arena);
+
+/**
+ * @brief Allocate zeroed memory suitably aligned for any type.
+ *
+ * A request larger than the chunk size gets a chunk of its own.
+ *
+ * @param arena
+ * @param size Number of bytes
+ * @return The memory, NULL if it cannot be allocated
+ */
+void *shv_arena_alloc(struct shv_arena *arena, size_t size);
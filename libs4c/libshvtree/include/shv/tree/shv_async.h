@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_async.h
+ * @brief Worker pool for the methods replying asynchronously
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "shv_com.h"
+#include "shv_txq.h"
+
+/**
+ * @brief What is needed to reply to a request once the method returned
+ */
+struct shv_reply_token
+{
+    struct shv_con_ctx *shv_ctx;       /* Connection the request came from */
+    int rid;                           /* Request ID */
+    int cid_cnt;                       /* Number of caller IDs */
+    int *cids;                         /* Caller IDs, cid_inline or heap */
+    int cid_inline[SHV_CID_INLINE_LEN];
+};
+
+struct shv_work;
+
+/**
+ * @brief Does the work, called by a worker thread
+ */
+typedef void (*shv_work_fnc)(struct shv_work *work);
+
+/**
+ * @brief Sends the reply by shv_send_*(shv_ctx, rid, ...), called by
+ *        the communication thread once the work is done
+ */
+typedef void (*shv_work_reply_fnc)(struct shv_con_ctx *shv_ctx, struct shv_work *work,
+                                   int rid);
+
+/**
+ * @brief A slow part of a method, done by the worker pool.
+ *
+ * Embed it in a structure holding the parameters and results
+ * of the work, the method fills it and passes it to shv_work_submit().
+ */
+struct shv_work
+{
+    struct shv_txq_msg msg;                 /* Submits the reply */
+    struct shv_work *next;                  /* Next work queued to the pool */
+    shv_work_fnc fnc;
+    shv_work_reply_fnc reply;
+    void (*release)(struct shv_work *work); /* Called once replied, NULL if not needed */
+    struct shv_reply_token token;
+};
+
+/**
+ * @brief Threads doing the work of the asynchronous methods.
+ *
+ * A pool can serve more connections, set it as shv_con_ctx.work_pool.
+ */
+struct shv_work_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct shv_work *head;              /* Queued works, done in order */
+    struct shv_work *tail;
+    bool stop;
+    int nthreads;
+    pthread_t *threads;
+};
+
+/**
+ * @brief Start the worker threads
+ *
+ * @param pool
+ * @param nthreads Number of threads
+ * @return 0 on success, -1 if the threads cannot be started
+ */
+int shv_work_pool_init(struct shv_work_pool *pool, int nthreads);
+
+/**
+ * @brief Finish the queued works and stop the threads
+ *
+ * Destroy the pool before the connections it serves.
+ *
+ * @param pool
+ */
+void shv_work_pool_destroy(struct shv_work_pool *pool);
+
+/**
+ * @brief Take a snapshot of the request being processed to reply later
+ *
+ * @param token
+ * @param shv_ctx
+ * @param rid
+ * @return 0 on success, -1 if memory cannot be allocated
+ */
+int shv_reply_token_init(struct shv_reply_token *token, struct shv_con_ctx *shv_ctx, int rid);
+
+/**
+ * @brief Free the memory held by the token
+ *
+ * @param token
+ */
+void shv_reply_token_free(struct shv_reply_token *token);
+
+/**
+ * @brief Queue the work of the request being processed to the worker pool
+ *
+ * Once done, the reply is sent by the communication thread and the work
+ * is released. The method returns without replying then.
+ *
+ * @param shv_ctx
+ * @param work With fnc, reply and release set
+ * @param rid Request ID
+ * @return 0 on success, -1 if there is no pool or memory, the method
+ *         has to do the work itself then
+ */
+int shv_work_submit(struct shv_con_ctx *shv_ctx, struct shv_work *work, int rid);
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_buf_pool.h
+ * @brief Pool of message buffers reused across messages
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * @brief A pool of equally sized buffers.
+ *
+ * The buffers are allocated when the pool is initialized and returned
+ * to it once not needed, so no allocation is done per message. A buffer
+ * can grow up to max_size for a message not fitting it, such buffer is
+ * freed instead of being returned to the pool.
+ */
+struct shv_buf_pool
+{
+    size_t buf_size;   /* Size of the pooled buffers */
+    size_t max_size;   /* Size a buffer can grow up to */
+    int count;         /* Number of free buffers kept at most */
+    int free_cnt;      /* Number of free buffers */
+    void **free_bufs;  /* Free buffers */
+};
+
+/**
+ * @brief Initialize the pool and allocate its buffers.
+ *
+ * @param pool
+ * @param buf_size Size of the buffers
+ * @param count Number of the buffers
+ * @param max_size Size a buffer can grow up to, buf_size at least
+ * @return 0 in case of success, -1 if memory cannot be allocated
+ */
+int shv_buf_pool_init(struct shv_buf_pool *pool, size_t buf_size, int count,
+                      size_t max_size);
+
+/**
+ * @brief Free the pool and its free buffers.
+ *
+ * @param pool
+ */
+void shv_buf_pool_destroy(struct shv_buf_pool *pool);
+
+/**
+ * @brief Take a buffer of pool->buf_size bytes from the pool.
+ *
+ * A new buffer is allocated if all of them are taken.
+ *
+ * @param pool
+ * @return The buffer, NULL if memory cannot be allocated
+ */
+void *shv_buf_pool_get(struct shv_buf_pool *pool);
+
+/**
+ * @brief Return the buffer to the pool.
+ *
+ * @param pool
+ * @param buf The buffer, NULL is ignored
+ * @param size Current size of the buffer
+ */
+void shv_buf_pool_put(struct shv_buf_pool *pool, void *buf, size_t size);
+
+/**
+ * @brief Grow the buffer to hold at least need bytes.
+ *
+ * The buffer is kept untouched if it cannot grow.
+ *
+ * @param pool
+ * @param buf The buffer
+ * @param size Current size of the buffer, updated
+ * @param need Number of bytes needed
+ * @return The grown buffer, NULL if need exceeds pool->max_size
+ *         or memory cannot be allocated
+ */
+void *shv_buf_pool_grow(struct shv_buf_pool *pool, void *buf, size_t *size, size_t need);
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_chng.h
+ * @brief Publication of value changes by chng signals
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "shv_com.h"
+#include "shv_value.h"
+
+enum shv_chng_deadband
+{
+    SHV_CHNG_DEADBAND_NONE = 0, /* Any change is sent */
+    SHV_CHNG_DEADBAND_ABS,      /* Changes smaller than the deadband are not sent */
+    SHV_CHNG_DEADBAND_REL       /* Changes smaller than the deadband times
+                                 * the last sent value are not sent */
+};
+
+/**
+ * @brief A value cell whose changes are sent as chng signals.
+ *
+ * The application updates the cell and marks the node by shv_chng_mark().
+ * The communication thread sends the current value of the marked nodes
+ * once woken, so any number of updates between two sends results in
+ * one signal. The deadband applies to numeric cells and is evaluated
+ * against the last value sent, changes of bool and string cells are
+ * always sent.
+ *
+ * The node is linked to the list of one connection while marked and
+ * remembers the value sent over it, so it belongs to that connection
+ * only. Publishing one cell over more connections takes a node for each
+ * of them, bound to the same cell.
+ */
+struct shv_chng_node
+{
+    struct shv_value_cell *cell;        /* Value published */
+    const char *path;                   /* Path of the node the signals are sent on */
+    enum shv_chng_deadband deadband_type;
+    double deadband;
+    struct shv_chng_node *next;         /* Next marked node */
+    atomic_bool marked;                 /* Waiting to be sent */
+    bool sent;                          /* Some value was sent */
+    union
+    {
+        double d;
+        int64_t i;
+        bool b;
+    } last;                             /* Value sent last */
+};
+
+/**
+ * @brief Initialize the node
+ *
+ * @param node
+ * @param cell The value published
+ * @param path Path of the tree node the cell is bound to
+ * @param deadband_type
+ * @param deadband Absolute value or a fraction of the last value
+ */
+void shv_chng_node_init(struct shv_chng_node *node, struct shv_value_cell *cell,
+                        const char *path, enum shv_chng_deadband deadband_type,
+                        double deadband);
+
+/**
+ * @brief Mark the cell of the node as changed
+ *
+ * Safe to call from any thread, it does not block. The communication
+ * thread is woken by shv_process_wake() if nothing was marked yet.
+ *
+ * @param shv_ctx Connection the signal is sent over, always the same
+ *                for the node
+ * @param node
+ */
+void shv_chng_mark(struct shv_con_ctx *shv_ctx, struct shv_chng_node *node);
+
+/**
+ * @brief Send the signals of the marked nodes
+ *
+ * Called by the communication thread when woken and with the replies
+ * to the received requests, call it only if the thread is driven
+ * by other means than shv_process(). The nodes stay marked while
+ * the transport is congested, see shv_com_tx_congested().
+ *
+ * @param shv_ctx
+ * @return Number of signals sent
+ */
+int shv_chng_flush(struct shv_con_ctx *shv_ctx);
@@ -12,6 +12,8 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <termios.h>
 #include <stddef.h>
 #include <poll.h>
@@ -20,10 +22,33 @@
 
 #define SHV_FILE_POSIX_BITFLAG_OPENED ((uint32_t)(1 << 0)) /* File already opened flag */
 
+/* The send queue keeps the data the socket does not accept. It reports
+ * congestion once SHV_TCPIP_TXQ_LEN bytes are queued and grows up to
+ * SHV_TCPIP_TXQ_MAX bytes, a write not fitting it fails with EAGAIN.
+ */
+
+#ifndef SHV_TCPIP_TXQ_INIT
+  #ifdef CONFIG_SHV_LIBS4C_PLATFORM_LINUX
+    #define SHV_TCPIP_TXQ_INIT 16384  /* Bytes the send queue is allocated for first */
+  #else
+    #define SHV_TCPIP_TXQ_INIT 1024
+  #endif
+#endif
+#ifndef SHV_TCPIP_TXQ_LEN
+  #ifdef CONFIG_SHV_LIBS4C_PLATFORM_LINUX
+    #define SHV_TCPIP_TXQ_LEN  (256 * 1024)
+    #define SHV_TCPIP_TXQ_MAX  (4 * 1024 * 1024)
+  #else
+    #define SHV_TCPIP_TXQ_LEN  16384
+    #define SHV_TCPIP_TXQ_MAX  65536
+  #endif
+#endif
+
 /* Forward declarations */
 struct shv_dotdevice_node;
 struct shv_file_node;
 struct shv_connection;
+struct iovec;
 
 struct shv_file_node_fctx
 {
@@ -42,8 +67,13 @@ struct shv_tlayer_serial_ctx
 
 struct shv_tlayer_tcpip_ctx
 {
-    int sockfd;                 /* A descriptor to access the socket */
+    int sockfd;                 /* A descriptor to access the socket (non-blocking) */
+    bool connecting;            /* The connect is in progress, see shv_tcpip_posix_init() */
     struct pollfd pfds[2];      /* To signal data ready to be read */
+    char *txq;                  /* Ring of data not accepted by the socket yet */
+    size_t txq_size;            /* Size of txq */
+    size_t txq_rd;              /* Index of the first queued byte */
+    size_t txq_len;             /* Number of queued bytes */
 };
 
 struct shv_tlayer_canbus_ctx
@@ -56,6 +86,8 @@ struct shv_thrd_ctx
     pthread_t id;
     int thrd_ret;
     int fildes[2]; /* Create a virtual pipe whose end will be polled by poll in dataready */
+    atomic_bool wake_ready; /* The pipe is open, see shv_process_wake() */
+    atomic_bool loop_served; /* Served by a thread of shv_loop, there is no thread to join */
 };
 
 /**
@@ -129,8 +161,13 @@ int shv_dotdevice_node_posix_reset(void);
 /**
  * @brief POSIX shv_tcpip_init implementation
  *
+ * The connect does not wait for the server. While it is in progress,
+ * shv_tcpip_posix_dataready() waits for the socket to be writable and
+ * the next call finishes the connect.
+ *
  * @param connection
- * @return int
+ * @return 0 once connected, 1 while the connect is in progress,
+ *         -1 if the server cannot be connected, -2 on failure
  */
 int shv_tcpip_posix_init(struct shv_connection *connection);
 
@@ -140,7 +177,7 @@ int shv_tcpip_posix_init(struct shv_connection *connection);
  * @param connection
  * @param buf
  * @param len
- * @return int
+ * @return the number of bytes read, -1 with errno EAGAIN if there are none yet
  */
 int shv_tcpip_posix_read(struct shv_connection *connection, void *buf, size_t len);
 
@@ -154,6 +191,38 @@ int shv_tcpip_posix_read(struct shv_connection *connection, void *buf, size_t le
  */
 int shv_tcpip_posix_write(struct shv_connection *connection, void *buf, size_t len);
 
+/**
+ * @brief POSIX shv_tcpip_writev implementation
+ *
+ * The data the socket does not accept are queued, the function never
+ * waits for the socket.
+ *
+ * @param connection
+ * @param iov
+ * @param iovcnt
+ * @return the number of bytes written or queued, -1 with errno EAGAIN
+ *         if the send queue is full
+ */
+int shv_tcpip_posix_writev(struct shv_connection *connection, const struct iovec *iov,
+                           int iovcnt);
+
+/**
+ * @brief POSIX shv_tcpip_txroom implementation
+ *
+ * @param connection
+ * @return the number of bytes to be queued before SHV_TCPIP_TXQ_LEN is reached,
+ *         SIZE_MAX if nothing is queued
+ */
+size_t shv_tcpip_posix_txroom(struct shv_connection *connection);
+
+/**
+ * @brief Send as much of the data queued by shv_tcpip_posix_writev() as the socket accepts
+ *
+ * @param connection
+ * @return the number of bytes still queued, -1 on error
+ */
+int shv_tcpip_posix_txflush(struct shv_connection *connection);
+
 /**
  * @brief POSIX shv_tcpip_close implementation
  *
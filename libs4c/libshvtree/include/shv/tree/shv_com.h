@@ -14,22 +14,90 @@
 
 #include <stdint.h>
 #include <stdatomic.h>
+#include <sys/uio.h>
 #include <shv/chainpack/cchainpack.h>
 
 #if defined(CONFIG_SHV_LIBS4C_PLATFORM_LINUX) || defined(CONFIG_SHV_LIBS4C_PLATFORM_NUTTX)
   #include "shv_clayer_posix.h"
 #endif
 #include "shv_connection.h"
+#include "shv_buf_pool.h"
+#include "shv_txq.h"
 
 #define SHV_BUF_LEN  1024
+
+/* Default receive buffer size, the longest frame accepted.
+ * See shv_com_set_rx_buf_size().
+ */
+
+#ifndef SHV_RX_BUF_LEN
+  #ifdef CONFIG_SHV_LIBS4C_PLATFORM_LINUX
+    #define SHV_RX_BUF_LEN 16384
+  #else
+    #define SHV_RX_BUF_LEN (2 * SHV_BUF_LEN)
+  #endif
+#endif
+
+/* Default message buffer pool. Replies of one input batch are queued
+ * in one buffer, a message longer than max size is streamed out
+ * in buffer sized chunks. See shv_com_set_buf_pool().
+ */
+
+#ifndef SHV_BUF_POOL_SIZE
+  #ifdef CONFIG_SHV_LIBS4C_PLATFORM_LINUX
+    #define SHV_BUF_POOL_SIZE  65536
+    #define SHV_BUF_POOL_MAX   (1024 * 1024)
+  #else
+    #define SHV_BUF_POOL_SIZE  SHV_BUF_LEN
+    #define SHV_BUF_POOL_MAX   SHV_BUF_LEN
+  #endif
+#endif
+#ifndef SHV_BUF_POOL_COUNT
+  #define SHV_BUF_POOL_COUNT 2
+#endif
+#define SHV_BUF_POOL_MIN_SIZE 128  /* Smallest buffer accepted */
+
+/* Default number of paths in the path index, 0 for none. The index is
+ * sized for the tree nodes up to it. See shv_com_set_path_index().
+ */
+
+#ifndef SHV_PATH_INDEX_LEN
+  #ifdef CONFIG_SHV_LIBS4C_PLATFORM_LINUX
+    #define SHV_PATH_INDEX_LEN 65536
+  #else
+    #define SHV_PATH_INDEX_LEN 0
+  #endif
+#endif
+
+#define SHV_TX_IOV_MAX 16     /* Frames queued at most, one iovec each */
 #define SHV_MET_LEN  64
 #define SHV_PATH_LEN 256
+#define SHV_ACCESS_LEN  64
+#define SHV_USER_ID_LEN 64
 
-#define TAG_ERROR       8
-#define TAG_REQUEST_ID  8
-#define TAG_SHV_PATH    9
-#define TAG_METHOD      10
-#define TAG_CALLER_IDS  11
+/* Caller IDs kept in the RPC head itself, longer lists go to the heap
+ * space reserved for SHV_CID_PREALLOC_LEN of them by shv_com_init().
+ */
+
+#define SHV_CID_INLINE_LEN   8
+#define SHV_CID_PREALLOC_LEN 64
+
+/* Space for the virtual nodes resolved by a request, see struct shv_node_provider
+ * and shv_com_set_vnode_scratch().
+ */
+
+#ifndef SHV_VNODE_SCRATCH_LEN
+  #define SHV_VNODE_SCRATCH_LEN 1024
+#endif
+
+#define TAG_ERROR         8
+#define TAG_REQUEST_ID    8
+#define TAG_SHV_PATH      9
+#define TAG_METHOD        10
+#define TAG_CALLER_IDS    11
+#define TAG_ACCESS        14
+#define TAG_USER_ID       16
+#define TAG_ACCESS_LEVEL  17
 
 /**
  * @brief SHV Method response error codes enum.
@@ -93,6 +161,87 @@ typedef void (*shv_attention_signaller)(struct shv_con_ctx *shv_ctx,
 
 /* Forward declaration */
 struct shv_node;
+struct shv_path_index;
+struct shv_dmap;
+struct shv_chng_node;
+struct shv_work_pool;
+
+/**
+ * @brief Memory the virtual nodes of a path are resolved to,
+ *        see struct shv_node_provider.
+ *
+ * The nodes are valid until the next path is resolved using the scratch.
+ */
+struct shv_vnode_scratch
+{
+  char *buf;
+  size_t size;                   /* Size of buf */
+  size_t used;                   /* Used bytes of buf */
+};
+
+/**
+ * @brief State of the outgoing message framing, see shv_pack_frame_begin().
+ *
+ */
+enum shv_frame_mode
+{
+    SHV_FRAME_BUFFERED = 0,  /* Body packed into shv_data, prefix patched in on frame end */
+    SHV_FRAME_MEASURE,       /* Body did not fit, only its length is being counted */
+    SHV_FRAME_STREAM         /* Prefix sent, body is written out as the buffer fills */
+};
+
+/**
+ * @brief Meta data of the received RPC message, see shv_unpack_rpc_head().
+ *
+ * Strings are not NUL terminated. They point into rx_buf while
+ * the data are there and to the buffers below once the receive buffer
+ * is about to be refilled. A NULL string means the tag was not present.
+ */
+struct shv_rpc_head
+{
+    int rid;                           /* Request ID, -1 if not present */
+    int access_level;                  /* Access level, -1 if not present */
+    const char *path;                  /* SHV path */
+    size_t path_len;
+    const char *method;                /* Method name, NULL for responses */
+    size_t method_len;
+    const char *access;                /* Access granted by the broker */
+    size_t access_len;
+    const char *user_id;               /* User ID */
+    size_t user_id_len;
+    int cid_cnt;                       /* Number of caller IDs */
+    int *cids;                         /* Caller IDs, cid_inline or heap */
+    size_t params_offset;              /* Params start relative to unpack_ctx.start */
+    int cid_inline[SHV_CID_INLINE_LEN];
+    char path_buf[SHV_PATH_LEN];
+    char method_buf[SHV_MET_LEN];
+    char access_buf[SHV_ACCESS_LEN];
+    char user_id_buf[SHV_USER_ID_LEN];
+};
+
+/**
+ * @brief States of the connection, see shv_process_step()
+ */
+enum shv_con_state
+{
+    SHV_CON_NOT_INIT = 0,              /* The transport layer is to be initialized */
+    SHV_CON_NO_CONN,                   /* Waiting to connect again */
+    SHV_CON_CONNECTING,                /* Waiting for the transport layer to connect */
+    SHV_CON_HELLO,                     /* Waiting for the reply to hello */
+    SHV_CON_LOGIN,                     /* Waiting for the reply to login */
+    SHV_CON_CONN                       /* Logged in */
+};
+
+/**
+ * @brief Events driving the connection, the results of shv_tops.dataready
+ */
+enum shv_con_event
+{
+    SHV_CON_EV_ERROR = -1,             /* The transport layer failed */
+    SHV_CON_EV_TIMEOUT = 0,            /* The wait elapsed */
+    SHV_CON_EV_READ = 1,               /* Data are ready to be read */
+    SHV_CON_EV_WAKE = 2                /* Woken by shv_process_wake() */
+};
 
 /**
  * @brief Main SHV Communication context.
@@ -103,21 +252,43 @@ struct shv_con_ctx
     int stream_fd;
     int timeout;
     int rid;
-    int cid_cnt;
     int cid_capacity;
-    int *cid_ptr;
+    int *cid_ptr;                                 /* Caller IDs not fitting rpc_head */
+    struct shv_rpc_head rpc_head;                 /* Head of the message being processed */
     enum shv_con_errno err_no;
     struct ccpcp_pack_context pack_ctx;
     struct ccpcp_unpack_context unpack_ctx;
-    char shv_data[SHV_BUF_LEN];
-    char shv_rd_data[SHV_BUF_LEN];
+    struct shv_buf_pool buf_pool;                 /* Message buffers */
+    char *shv_data;                               /* Pack buffer, from buf_pool */
+    size_t shv_data_len;                          /* Size of shv_data */
+    char *rx_buf;                                 /* Receive ring buffer */
+    size_t rx_size;                               /* Size of rx_buf */
+    size_t rx_rd;                                 /* Index of the first unprocessed byte */
+    size_t rx_len;                                /* Number of unprocessed bytes */
+    size_t rx_discard;                            /* Rest of an oversized frame to be dropped */
+    size_t rx_wrap_len;                           /* Frame bytes at rx_buf start, for the underflow */
+    char *tx_buf;                                 /* Transmit queue, frames are packed in place */
+    size_t tx_size;                               /* Size of tx_buf */
+    size_t tx_len;                                /* Bytes of tx_buf used by queued frames */
+    struct iovec tx_iov[SHV_TX_IOV_MAX];          /* Queued frames */
+    int tx_iovcnt;                                /* Number of queued frames */
+    bool tx_batch;                                /* Queue frames until shv_com_flush() */
     int write_err;
     int shv_len;
-    int shv_send;
+    enum shv_frame_mode frame_mode;
     int reconnects;
+    enum shv_con_state con_state;                 /* State of shv_process_step() */
+    unsigned int connects;                        /* Times the transport layer was connected
+                                                   * or started to connect */
     atomic_bool running;
     struct shv_thrd_ctx thrd_ctx;
     struct shv_node *root;
+    struct shv_path_index *path_index;            /* Path lookup cache, can be NULL */
+    struct shv_vnode_scratch vnode_scratch;       /* Virtual nodes of the request path */
+    _Atomic(struct shv_chng_node *) chng_dirty;   /* Changes to be sent, see shv_chng_mark() */
+    struct shv_txq txq;                           /* Messages submitted by other threads */
+    struct shv_work_pool *work_pool;              /* Workers of the slow methods, see
+                                                   * shv_work_submit(), NULL for none */
     struct shv_connection *connection;            /* Transport layer information */
     shv_attention_signaller at_signlr;            /* A user defined attention signaller callback */
 };
@@ -137,6 +308,18 @@ struct shv_str_list_it {
    const char * (*get_next_entry)(struct shv_str_list_it *it, int reset_to_first);
 };
 
+/**
+ * @brief Result of a reply packed in advance, see shv_send_packed_result().
+ *
+ * Replies that do not change (dir, ls of a node) are packed once
+ * and kept in this form.
+ */
+struct shv_packed_result {
+  atomic_int refs;               /* References, see shv_packed_result_put() */
+  size_t len;                    /* Length of data */
+  char data[];                   /* ChainPack encoded result */
+};
+
 /**
  * @brief Get str of errno contained in ctx
  *
@@ -150,18 +333,185 @@ static inline const char *shv_errno_str(struct shv_con_ctx *ctx)
 
 void shv_send_int(struct shv_con_ctx *shv_ctx, int rid, int num);
 void shv_send_uint(struct shv_con_ctx *shv_ctx, int rid, unsigned int num);
+void shv_send_int64(struct shv_con_ctx *shv_ctx, int rid, int64_t num);
+void shv_send_bool(struct shv_con_ctx *shv_ctx, int rid, bool val);
 void shv_send_double(struct shv_con_ctx *shv_ctx, int rid, double num);
 void shv_send_str(struct shv_con_ctx *shv_ctx, int rid, const char *str);
 void shv_send_str_list(struct shv_con_ctx *shv_ctx, int rid, int num_str, const char **str);
 void shv_send_str_list_it(struct shv_con_ctx *shv_ctx, int rid, int num_str, struct shv_str_list_it *str_it);
 void shv_send_dir(struct shv_con_ctx *shv_ctx, const struct shv_dir_res *results, int cnt, int rid);
+void shv_send_dir_dmap(struct shv_con_ctx *shv_ctx, const struct shv_dmap *dmap, int rid);
 void shv_send_error(struct shv_con_ctx *shv_ctx, int rid, enum shv_response_error_code code,
                     const char *msg);
 void shv_send_ping(struct shv_con_ctx *shv_ctx);
 void shv_send_empty_response(struct shv_con_ctx *shv_ctx, int rid);
 
+/**
+ * @brief Send a reply with the result packed in advance
+ *
+ * @param shv_ctx
+ * @param rid
+ * @param res Result packed by shv_pack_result_*()
+ */
+void shv_send_packed_result(struct shv_con_ctx *shv_ctx, int rid,
+                            const struct shv_packed_result *res);
+
+/**
+ * @brief Pack a list of strings as a reply result
+ *
+ * @param num_str Number of strings
+ * @param str_it Iterator providing the strings
+ * @return Allocated result to be freed by free(), NULL on failure
+ */
+struct shv_packed_result *shv_pack_result_str_list_it(int num_str,
+                                                      struct shv_str_list_it *str_it);
+
+/**
+ * @brief Pack the result of dir call listing the methods of dmap
+ *
+ * @param dmap
+ * @return Allocated result to be freed by free(), NULL on failure
+ */
+struct shv_packed_result *shv_pack_result_dir_dmap(const struct shv_dmap *dmap);
+
+/**
+ * @brief Drop a reference to the result, the last one frees it
+ *
+ * A result is allocated with one reference.
+ *
+ * @param res The result, can be NULL
+ */
+void shv_packed_result_put(struct shv_packed_result *res);
+
 int shv_unpack_data(ccpcp_unpack_context * ctx, int * v, double * d);
 
+/**
+ * @brief Set the size of the receive buffer.
+ *
+ * Only frames fitting the buffer are processed, longer ones are dropped.
+ * A request in such a frame is answered by SHV_RE_INVALID_PARAMS. Unlike
+ * the received ones, the messages sent are not limited by the buffers.
+ * The default is SHV_RX_BUF_LEN, set a larger one before the connection
+ * is made if bigger requests are expected. File nodes limit the write
+ * size they report by stat to fit the buffer.
+ *
+ * @param shv_ctx
+ * @param size Buffer size in bytes, at least SHV_BUF_LEN
+ * @return 0 on success, -1 if memory cannot be allocated or data are pending
+ */
+int shv_com_set_rx_buf_size(struct shv_con_ctx *shv_ctx, size_t size);
+
+/**
+ * @brief Configure the message buffers of the connection.
+ *
+ * count buffers of size bytes are allocated up front and reused for
+ * all messages. A message not fitting the buffer is packed to a grown
+ * one, up to max_size bytes, and sent by a single write, longer ones
+ * are streamed out. Call before the connection is made, the defaults
+ * are SHV_BUF_POOL_SIZE, SHV_BUF_POOL_COUNT and SHV_BUF_POOL_MAX.
+ *
+ * @param shv_ctx
+ * @param size Buffer size in bytes, at least SHV_BUF_POOL_MIN_SIZE
+ * @param count Number of buffers, two are used by a connection
+ * @param max_size Size a buffer can grow up to
+ * @return 0 on success, -1 if memory cannot be allocated
+ */
+int shv_com_set_buf_pool(struct shv_con_ctx *shv_ctx, size_t size, int count,
+                         size_t max_size);
+
+/**
+ * @brief Set up the index of the paths requests are sent to.
+ *
+ * Nodes of the indexed paths are found by a single hash table lookup
+ * instead of searching the tree level by level. The index is rebuilt
+ * whenever the tree changes. It is shared by the connections to the same
+ * root, see shv_path_index_get(). The default is SHV_PATH_INDEX_LEN paths.
+ *
+ * @param shv_ctx
+ * @param capacity Number of paths indexed at most, 0 to disable the index
+ * @return 0 on success, -1 if memory cannot be allocated
+ */
+int shv_com_set_path_index(struct shv_con_ctx *shv_ctx, size_t capacity);
+
+/**
+ * @brief Set the size of the memory virtual nodes are resolved to.
+ *
+ * The virtual nodes of a request path have to fit it, otherwise
+ * the path is not found. The default is SHV_VNODE_SCRATCH_LEN.
+ *
+ * @param shv_ctx
+ * @param size Size in bytes, 0 to disable virtual nodes
+ * @return 0 on success, -1 if memory cannot be allocated
+ */
+int shv_com_set_vnode_scratch(struct shv_con_ctx *shv_ctx, size_t size);
+
+/**
+ * @brief Submit a message to be sent by the communication thread.
+ *
+ * Safe to call from any thread, it does not block. The thread is woken
+ * by shv_process_wake() and sends the submitted messages in the order
+ * they were submitted, messages submitted while disconnected are sent
+ * once connected again.
+ *
+ * @param shv_ctx
+ * @param msg Message, released once sent, see shv_txq_msg_new()
+ */
+void shv_com_submit(struct shv_con_ctx *shv_ctx, struct shv_txq_msg *msg);
+
+/**
+ * @brief Send the messages submitted by shv_com_submit().
+ *
+ * Called by the communication thread when woken, call it only if
+ * the thread is driven by other means than shv_process(). The messages
+ * stay queued while the transport is congested, see shv_com_tx_congested().
+ *
+ * @param shv_ctx
+ * @return Number of messages sent
+ */
+int shv_com_send_submitted(struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief Send all queued frames.
+ *
+ * Replies to the messages processed by one shv_process_input() call
+ * are queued and sent together once all of them are processed. This
+ * is done automatically, call the function only to push out frames
+ * queued by the user code in between.
+ *
+ * @param shv_ctx
+ * @return 0 on success, -1 on a write error
+ */
+int shv_com_flush(struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief Tell whether the peer does not keep up with the sent data.
+ *
+ * The frames queued for the batch count in, they are sent first.
+ * Sending more could fill the queue of the transport, its writes then
+ * fail and the connection is closed. Requests should be rejected with
+ * SHV_RE_TRY_AGAIN_LATER meanwhile, the dispatcher does so before
+ * calling the method and reserves SHV_BUF_LEN for the reply.
+ * The submitted messages and the chng signals wait until the transport
+ * has sent its queue.
+ *
+ * @param shv_ctx
+ * @param len Length of the frames to be sent
+ * @return true if the transport has no room for them
+ */
+bool shv_com_tx_congested(struct shv_con_ctx *shv_ctx, size_t len);
+
+/**
+ * @brief Unpack the length, protocol and meta data of a received message.
+ *
+ * Only the tags known to libshvtree are decoded, values of other tags
+ * are skipped without unpacking. The unpack context is left at the params.
+ *
+ * @param shv_ctx
+ * @param head Filled with the decoded meta data
+ * @return 0 on success, -1 in case of malformed message
+ */
+int shv_unpack_rpc_head(struct shv_con_ctx *shv_ctx, struct shv_rpc_head *head);
+
 /**
  * @brief Platform dependant function. Creates the communication processing thread.
  *
@@ -175,10 +525,24 @@ int shv_create_process_thread(int thrd_prio, struct shv_con_ctx *ctx);
 /**
  * @brief Platform dependant function. Stops the communication processing thread.
  *
+ * A connection served by shv_loop is finished by the loop thread instead,
+ * the function returns once the loop does not access it anymore.
+ *
  * @param shv_ctx
  */
 void shv_stop_process_thread(struct shv_con_ctx *shv_ctx);
 
+/**
+ * @brief Platform dependant function. Wakes the communication processing thread
+ *        to send the changes marked by shv_chng_mark().
+ *
+ * Safe to call from any thread, it does not block. Nothing is done
+ * unless the thread was created by shv_create_process_thread().
+ *
+ * @param shv_ctx
+ */
+void shv_process_wake(struct shv_con_ctx *shv_ctx);
+
 /**
  * @brief Allocate and initialize a shv_com_ctx_t struct.
  *
@@ -214,3 +578,22 @@ void shv_com_connection_close(struct shv_con_ctx *shv_ctx);
  * @return 0 on success, -1 on failure
  */
 int shv_process(struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief Advance the connection state machine of shv_process() by an event.
+ *
+ * Lets the connection be driven by other means than shv_process(),
+ * such as an event loop serving many of them. Set shv_ctx->running and
+ * shv_ctx->con_state to SHV_CON_NOT_INIT and make the first step,
+ * the event is not used then. The next step is made once the transport
+ * layer is ready to be read (unless in SHV_CON_NO_CONN), to be written
+ * in SHV_CON_CONNECTING, shv_process_wake() is called or the wait elapses,
+ * whatever comes first. The step never waits for the transport layer.
+ *
+ * @param shv_ctx
+ * @param event What ended the wait, one of enum shv_con_event
+ * @param wait Set to the time to wait for the next event (in ms)
+ * @return 1 to wait for the next event, 0 once the connection is closed
+ *         on request, -1 on failure
+ */
+int shv_process_step(struct shv_con_ctx *shv_ctx, int event, int *wait);
@@ -16,6 +16,16 @@
 
 struct shv_con_ctx;
 
+/**
+ * @brief Read the available data and process all complete messages,
+ *        as shv_process() does when data are ready
+ *
+ * @param shv_ctx
+ * @return Number of bytes read, 0 at the end of the stream, -1 on error,
+ *         -1 with errno EAGAIN if there are no data yet
+ */
+int shv_process_input(struct shv_con_ctx *shv_ctx);
+
 /**
  * @brief A handler responsible for the sending of data
  *
@@ -25,14 +35,75 @@ struct shv_con_ctx;
 void shv_overflow_handler(struct ccpcp_pack_context *ctx, size_t size_hint);
 
 /**
- * @brief A handler responsible for the reception of data, in case
- *        the request needs more
+ * @brief Prepare the pack context of shv_ctx for a new message.
+ *
+ * The message body is packed into the buffer once, leaving room in front
+ * of it for the chainpack length prefix. Use together with
+ * shv_pack_frame_end() as
+ * @code
+ * shv_pack_frame_begin(shv_ctx);
+ * do {
+ *     ... pack the body ...
+ * } while (shv_pack_frame_end(shv_ctx));
+ * @endcode
+ * The body is packed again only if it does not fit the buffer.
+ *
+ * @param shv_ctx
+ */
+void shv_pack_frame_begin(struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief Prepare the pack context of shv_ctx for a message of known length.
+ *
+ * A body fitting the buffer, grown up to the pool limit if needed,
+ * is packed as by shv_pack_frame_begin(). A longer one is streamed out
+ * as the buffer fills, after its length prefix. Either way it is packed
+ * exactly once.
+ * The length is best computed with cchainpack_packed_size_*() functions
+ * or cchainpack_size_builder. Finish the message with shv_pack_frame_end(),
+ * which returns 0 in this case and reports a streamed body of different
+ * length.
+ *
+ * @param shv_ctx
+ * @param len Exact length of the message body in bytes
+ */
+void shv_pack_frame_begin_sized(struct shv_con_ctx *shv_ctx, size_t len);
+
+/**
+ * @brief Finish the message started by shv_pack_frame_begin().
+ *
+ * @param shv_ctx
+ * @return 1 if the body has to be packed once more to stream it out,
+ *         0 once the message was sent
+ */
+int shv_pack_frame_end(struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief A handler providing the rest of the frame being unpacked
+ *        when it wraps around the receive ring buffer end
  *
  * @param ctx
- * @return Number of read bytes, -1 in case of failure
+ * @return Number of available bytes, 0 at the frame end
  */
 size_t shv_underrflow_handler(struct ccpcp_unpack_context * ctx);
 
+/**
+ * @brief Move strings of shv_ctx->rpc_head out of the receive buffer,
+ *        called before the buffer is refilled
+ *
+ * @param shv_ctx
+ */
+void shv_rpc_head_pin(struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief Packs the head of a signal
+ *
+ * @param shv_ctx
+ * @param sig Signal name
+ * @param path Path of the node the signal is sent on
+ */
+void shv_pack_head_signal(struct shv_con_ctx *shv_ctx, const char *sig, const char *path);
+
 /**
  * @brief Packs the head of the message for client reply
  *
@@ -41,6 +112,15 @@ size_t shv_underrflow_handler(struct ccpcp_unpack_context * ctx);
  */
 void shv_pack_head_reply(struct shv_con_ctx *shv_ctx, int rid);
 
+/**
+ * @brief Number of bytes shv_pack_head_reply() packs
+ *
+ * @param shv_ctx
+ * @param rid
+ * @return Packed size of the reply head
+ */
+size_t shv_head_reply_packed_size(struct shv_con_ctx *shv_ctx, int rid);
+
 /**
  * @brief Skip all data until `levels` of container ends are reached.
  *
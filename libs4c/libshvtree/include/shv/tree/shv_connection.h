@@ -49,13 +49,17 @@ enum shv_tlayer_canbus_pack_state
 
 /* Forward declaration */
 struct shv_connection;
+struct iovec;
 
 /**
  * @brief Platform dependant function. Inits the transport layer
  *        communication.
  * 
  * @param connection
- * @return 0 in case of success, -1 otherwise
+ * @return 0 in case of success, 1 if the connection is in progress,
+ *         -1 if the peer cannot be connected, -2 on failure.
+ *         A connection in progress is finished by calling the function
+ *         again once dataready reports an event.
  */
 typedef int (*shv_tlayer_init)(struct shv_connection *connection);
 
@@ -68,7 +72,8 @@ typedef int (*shv_tlayer_init)(struct shv_connection *connection);
  * @param len 
  * @return > 0 (read bytes) in case of success, -1 in case of failure,
  *         When 0 is returned, it indicates no available data in near future,
- *         stopping the connection.
+ *         stopping the connection. A non-blocking transport returns -1
+ *         with errno EAGAIN if there are no data yet.
  * @attention The function can be blocking.
  */
 typedef int (*shv_tlayer_read)(struct shv_connection *connection, void *buf, size_t len);
@@ -85,6 +90,34 @@ typedef int (*shv_tlayer_read)(struct shv_connection *connection, void *buf, siz
  */
 typedef int (*shv_tlayer_write)(struct shv_connection *sctx, void *buf, size_t len);
 
+/**
+ * @brief Platform dependant function, optional. Writes at most the total
+ *        length of iovcnt buffers described by iov to the transport layer,
+ *        in their order. Used to send several queued frames at once.
+ *        When not provided, the frames are joined and sent by write.
+ *
+ * @param connection
+ * @param iov
+ * @param iovcnt
+ * @return >= 0 (written bytes) in case of success, -1 otherwise
+ * @attention The function can be blocking, unless the transport
+ *            provides txroom.
+ */
+typedef int (*shv_tlayer_writev)(struct shv_connection *connection,
+                                 const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Platform dependant function, optional. Tells how many bytes
+ *        can be written before the transport is congested. Transports
+ *        queueing the data the peer is not ready to receive use it
+ *        to report congestion, their writes do not block then and fail
+ *        with EAGAIN once the queue is full.
+ *
+ * @param connection
+ * @return Number of bytes
+ */
+typedef size_t (*shv_tlayer_txroom)(struct shv_connection *connection);
+
 /**
  * @brief Platform dependant function. Terminates the transport layer connection.
  * 
@@ -99,7 +132,9 @@ typedef int (*shv_tlayer_close)(struct shv_connection *connection);
  * 
  * @param connection 
  * @param timeout in ms, anything < -1 means infinite waiting
- * @return -1 in case of error, 0 in case the polling timeouted, 1 in case of ready data
+ * @return -1 in case of error, 0 in case the polling timeouted, 1 in case of ready data,
+ *         2 in case the thread was woken by shv_process_wake() or the data
+ *         queued by the transport were sent
  */
 typedef int (*shv_tlayer_dataready)(struct shv_connection *connection, int timeout);
 
@@ -140,6 +175,8 @@ struct shv_connection
         shv_tlayer_init      init;
         shv_tlayer_read      read;
         shv_tlayer_write     write;
+        shv_tlayer_writev    writev;
+        shv_tlayer_txroom    txroom;
         shv_tlayer_close     close;
         shv_tlayer_dataready dataready;
     } tops; /* Transport layer ops */
@@ -51,3 +51,14 @@ extern const struct shv_dmap shv_dotapp_dmap;
  * @return non NULL reference on success, NULL otherwise
  */
 struct shv_dotapp_node *shv_tree_dotapp_node_new(const struct shv_dmap *dir, int mode);
+
+/**
+ * @brief Allocate a new standard .app node in the arena
+ *
+ * @param arena The arena, NULL allocates from the heap
+ * @param dir
+ * @param mode
+ * @return non NULL reference on success, NULL otherwise
+ */
+struct shv_dotapp_node *shv_tree_arena_dotapp_node_new(struct shv_arena *arena,
+                                                       const struct shv_dmap *dir, int mode);
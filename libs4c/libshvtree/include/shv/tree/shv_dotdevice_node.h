@@ -61,3 +61,15 @@ extern const struct shv_dmap shv_dotdevice_dmap;
  * @return non NULL reference on success, NULL otherwise
  */
 struct shv_dotdevice_node *shv_tree_dotdevice_node_new(const struct shv_dmap *dir, int mode);
+
+/**
+ * @brief Allocate a new standard .dotdevice node in the arena
+ *
+ * @param arena The arena, NULL allocates from the heap
+ * @param dir
+ * @param mode
+ * @return non NULL reference on success, NULL otherwise
+ */
+struct shv_dotdevice_node *shv_tree_arena_dotdevice_node_new(struct shv_arena *arena,
+                                                             const struct shv_dmap *dir,
+                                                             int mode);
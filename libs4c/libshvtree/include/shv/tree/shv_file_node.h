@@ -11,6 +11,8 @@
 
 #pragma once
 
+#include <stdatomic.h>
+
 #include "shv_tree.h"
 
 struct shv_con_ctx;
@@ -121,6 +123,8 @@ struct shv_file_node
                                            take this into consideration. */
     bool ignored;                       /* TEMPORARY hack: indication of a message that
                                            should be ignored. Used internally. */
+    atomic_bool busy;                   /* The CRC is being computed by the worker pool,
+                                           see shv_con_ctx.work_pool */
 };
 
 /**
@@ -209,3 +213,16 @@ extern const struct shv_dmap shv_file_node_dmap;
  * @return A nonNULL pointer on success, NULL otherwise
  */
 struct shv_file_node *shv_tree_file_node_new(const char *child_name, const struct shv_dmap *dir, int mode);
+
+/**
+ * @brief Allocates and initializes a file node in the arena
+ *
+ * @param arena The arena, NULL allocates from the heap
+ * @param child_name
+ * @param dir
+ * @param mode
+ * @return A nonNULL pointer on success, NULL otherwise
+ */
+struct shv_file_node *shv_tree_arena_file_node_new(struct shv_arena *arena,
+                                                   const char *child_name,
+                                                   const struct shv_dmap *dir, int mode);
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_loop.h
+ * @brief Event loop serving many connections by a few threads
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "shv_com.h"
+
+struct shv_loop_con;
+
+/**
+ * @brief A thread of the loop, it waits for the events of its connections
+ *        by a single epoll instance.
+ */
+struct shv_loop_thread
+{
+    pthread_t id;
+    int epfd;                           /* The epoll instance */
+    int fildes[2];                      /* Wakes the thread, shared by its connections */
+    pthread_mutex_t lock;               /* Guards added and stop */
+    struct shv_loop_con *added;         /* Connections to be served from now on */
+    struct shv_loop_con *cons;          /* Connections served, owned by the thread */
+    atomic_int count;                   /* Number of connections served or added */
+    bool stop;
+};
+
+/**
+ * @brief Event loop driving the connections by shv_process_step().
+ *
+ * It replaces a thread created by shv_create_process_thread() for each
+ * connection. A connection is served by one thread of the loop only,
+ * the connections are spread over the threads.
+ */
+struct shv_loop
+{
+    int nthreads;
+    struct shv_loop_thread *threads;
+};
+
+/**
+ * @brief Start the threads of the loop
+ *
+ * @param loop
+ * @param nthreads Number of threads
+ * @return 0 on success, -1 on failure
+ */
+int shv_loop_init(struct shv_loop *loop, int nthreads);
+
+/**
+ * @brief Let the loop connect and serve the connection
+ *
+ * Safe to call from any thread. The connection is served until it fails,
+ * the loop is destroyed or shv_com_destroy() stops it,
+ * shv_ctx->thrd_ctx.thrd_ret holds the result of shv_process_step() then.
+ * A failure is reported by SHV_ATTENTION_ERROR, do not destroy
+ * the connection from the signaller.
+ *
+ * @param loop
+ * @param shv_ctx Not served by shv_create_process_thread()
+ * @return 0 on success, -1 on failure
+ */
+int shv_loop_add(struct shv_loop *loop, struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief Close the connections and stop the threads
+ *
+ * The connections are not freed, destroy them by shv_com_destroy()
+ * afterwards.
+ *
+ * @param loop
+ */
+void shv_loop_destroy(struct shv_loop *loop);
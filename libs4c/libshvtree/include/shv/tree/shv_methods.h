@@ -30,6 +30,7 @@
 
 extern const struct shv_method_des shv_dmap_item_ls;
 extern const struct shv_method_des shv_dmap_item_dir;
+extern const struct shv_method_des shv_dmap_item_type;
 
 extern const struct shv_dmap shv_double_dmap;
 extern const struct shv_dmap shv_double_read_only_dmap;
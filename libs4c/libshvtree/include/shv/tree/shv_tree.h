@@ -17,17 +17,22 @@
 #include <shv/chainpack/cchainpack.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #if defined(CONFIG_SHV_LIBS4C_PLATFORM_LINUX) || defined(CONFIG_SHV_LIBS4C_PLATFORM_NUTTX)
     #include "shv_clayer_posix.h"
 #endif
 #include "shv_com.h"
+#include "shv_arena.h"
 
 #define SHV_NLIST_MODE_GAVL   0
 #define SHV_NLIST_MODE_GSA    1
-#define SHV_NLIST_MODE_STATIC 2
+#define SHV_NLIST_MODE_STATIC 2 /* Not allocated, may be const, see shvtreegen */
 
-/* A helper macro that defines the node's methods */
+/* A helper macro that defines the node's methods, along with their hashed index
+ * and reply cache
+ */
 #define SHV_CREATE_NODE_DMAP(node, list_of_addrs)\
     {\
         .methods =\
@@ -35,7 +40,17 @@
             .items = (void **)list_of_addrs,\
             .count = sizeof(list_of_addrs) / sizeof(list_of_addrs[0]),\
             .alloc_count = 0\
-        }\
+        },\
+        .index = SHV_DMAP_INDEX(sizeof(list_of_addrs) / sizeof(list_of_addrs[0])),\
+        .cache = &(struct shv_dmap_cache){0}\
+    }
+
+/* Storage for the hashed index of a dmap with count methods */
+#define SHV_DMAP_INDEX(count)\
+    &(struct shv_dmap_index)\
+    {\
+        .size = 2 * (count),\
+        .slots = (struct shv_dmap_index_slot[2 * (count)]){{0}}\
     }
 
 struct shv_node_list
@@ -52,11 +67,65 @@ struct shv_node_list
   } list;
 };
 
+/**
+ * @brief Hashed index of dmap methods, see shv_dmap_find_n().
+ *
+ * The index is built by the first lookup. It has to have at least twice
+ * as many slots as the dmap has methods, SHV_DMAP_INDEX() provides it.
+ */
+struct shv_dmap_index_slot
+{
+  uint32_t hash;                   /* FNV-1a hash of the method name */
+  uint32_t item;                   /* Index of the method + 1, 0 for an unused slot */
+};
+
+struct shv_dmap_index
+{
+  atomic_int state;                /* 0 not built, 1 being built, 2 ready */
+  unsigned int size;               /* Number of slots */
+  struct shv_dmap_index_slot *slots;
+};
+
+/**
+ * @brief Replies depending only on the dmap, packed by the first call
+ */
+struct shv_dmap_cache
+{
+  _Atomic(struct shv_packed_result *) dir;  /* Result of dir */
+};
+
 struct shv_dmap {
-  gsa_array_field_t methods;  /* GSA array of methods */
+  gsa_array_field_t methods;    /* GSA array of methods */
+  struct shv_dmap_index *index; /* Hashed index of methods, NULL for none */
+  struct shv_dmap_cache *cache; /* Reply cache, NULL for none */
 };
 
 struct shv_node;
+
+/**
+ * @brief Provider of virtual children of a node.
+ *
+ * The children of a node with a provider are not stored in the tree,
+ * they are resolved by the provider once looked up. The provider makes
+ * a transient node in the scratch memory, by shv_vnode_alloc() and
+ * shv_tree_vnode_init(), which is valid until the scratch is reused
+ * for another path. A virtual node can have a provider as well.
+ */
+struct shv_node_provider
+{
+  /* Resolve the child of given name, NULL if it does not exist.
+   * The scratch is NULL if the caller provides none.
+   */
+  struct shv_node *(*find_child)(struct shv_node *parent, const char *name,
+                                 struct shv_vnode_scratch *scratch);
+
+  /* Number of children, listed by ls */
+  int (*child_count)(struct shv_node *parent);
+
+  /* Name of the i-th child, buf of size bytes can be used to print it to */
+  const char *(*child_name)(struct shv_node *parent, int i, char *buf, size_t size);
+};
+
 struct shv_node
 {
   struct {
@@ -66,6 +135,8 @@ struct shv_node
   gavl_node_t gavl_node;         /* GAVL instance */
   struct shv_dmap *dir;          /* Pointer to supported methods */
   struct shv_node_list children; /* List of node children */
+  struct shv_packed_result *ls_cache; /* Result of ls, see shv_node_ls_cache_get() */
+  const struct shv_node_provider *provider; /* Virtual children, NULL for none */
 };
 
 struct shv_node_typed_val
@@ -142,6 +213,39 @@ shv_node_list_count(struct shv_node_list *node_list)
     }
 }
 
+/**
+ * @brief Full path to node lookup cache, see shv_path_index_find().
+ *
+ * Resolved paths are remembered in an open addressing hash table sized
+ * for the nodes of the tree. The entries are valid for the tree
+ * generation they were made in, any change of the tree drops them.
+ * One index serves all connections to the same root.
+ */
+struct shv_path_index_entry
+{
+  uint32_t hash;                 /* FNV-1a hash of the path */
+  uint32_t path_len;             /* Length of the path */
+  size_t path_offs;              /* Offset of the path in shv_path_index.paths */
+  struct shv_node *node;         /* Node found, NULL for an unused entry */
+};
+
+struct shv_path_index
+{
+  struct shv_node *root;                 /* The paths are relative to it */
+  struct shv_path_index *next;           /* Index of another root */
+  int refs;                              /* Number of users, see shv_path_index_get() */
+  pthread_mutex_t lock;                  /* Guards the fields below */
+  size_t max_count;                      /* Number of paths indexed at most */
+  unsigned int gen;                      /* Tree generation of the entries */
+  size_t capacity;                       /* Number of entries, a power of two */
+  size_t count;                          /* Number of used entries */
+  struct shv_path_index_entry *entries;
+  char *paths;                           /* Indexed paths, not NUL terminated */
+  size_t paths_len;                      /* Used bytes of paths */
+  size_t paths_live;                     /* Bytes of paths of the used entries */
+  size_t paths_size;                     /* Size of paths */
+};
+
 struct shv_node_list_names_it
 {
   struct shv_str_list_it str_it;
@@ -150,16 +254,178 @@ struct shv_node_list_names_it
 
 void shv_node_list_names_it_init(struct shv_node_list *list, struct shv_node_list_names_it *names_it);
 
+#define SHV_VNODE_NAME_LEN 64  /* Longest virtual node name listed */
+
+struct shv_node_provider_names_it
+{
+  struct shv_str_list_it str_it;
+  struct shv_node *node;
+  int indx;
+  char buf[SHV_VNODE_NAME_LEN];
+};
+
+void shv_node_provider_names_it_init(struct shv_node *node,
+                                     struct shv_node_provider_names_it *names_it);
+
 /* Public functions definition */
 
 int shv_node_process(struct shv_con_ctx *shv_ctx, int rid, const char * met, const char * path);
+int shv_node_process_head(struct shv_con_ctx *shv_ctx, const struct shv_rpc_head *head);
 struct shv_node *shv_node_find(struct shv_node *node, const char * path);
+struct shv_node *shv_node_find_n(struct shv_node *node, const char *path, size_t path_len);
+
+/**
+ * @brief Find node based on a path, including virtual nodes
+ *
+ * shv_node_find_n() resolves virtual nodes with NULL scratch.
+ *
+ * @param node The node the path is relative to
+ * @param path
+ * @param path_len
+ * @param scratch Memory for the virtual nodes, reset by the caller
+ * @return The node, NULL if it does not exist
+ */
+struct shv_node *shv_node_find_vn(struct shv_node *node, const char *path, size_t path_len,
+                                  struct shv_vnode_scratch *scratch);
+
+/**
+ * @brief Allocate zeroed memory of a virtual node from the scratch
+ *
+ * @param scratch
+ * @param size
+ * @return The memory, NULL if the scratch is NULL or full
+ */
+void *shv_vnode_alloc(struct shv_vnode_scratch *scratch, size_t size);
+
+/**
+ * @brief Copy a virtual node name to the scratch
+ *
+ * @param scratch
+ * @param name
+ * @return The copy, NULL if the scratch is NULL or full
+ */
+char *shv_vnode_strdup(struct shv_vnode_scratch *scratch, const char *name);
+
+/**
+ * @brief Initialize a virtual node
+ *
+ * @param item
+ * @param name
+ * @param dir
+ * @param provider Provider of its children, NULL for a leaf
+ */
+void shv_tree_vnode_init(struct shv_node *item, const char *name, const struct shv_dmap *dir,
+                         const struct shv_node_provider *provider);
+const struct shv_method_des *shv_dmap_find_n(const struct shv_dmap *dmap, const char *name, size_t len);
 void shv_tree_add_child(struct shv_node *node, struct shv_node *child);
+
+/**
+ * @brief Add a child to a node without keeping the children sorted
+ *
+ * Meant for building nodes with many children. The children of a GSA
+ * node are appended as they come and sorted at once by
+ * shv_tree_bulk_finish(), its children cannot be looked up until then.
+ * Children of a GAVL node are added by shv_tree_add_child().
+ *
+ * @param node
+ * @param child
+ * @return 0 on success, -1 if memory cannot be allocated
+ */
+int shv_tree_bulk_add_child(struct shv_node *node, struct shv_node *child);
+
+/**
+ * @brief Sort the children added by shv_tree_bulk_add_child()
+ *
+ * A child named the same as another one is dropped and destroyed.
+ *
+ * @param node
+ * @param shrink Shrink the array of children to its exact size
+ * @return 0 on success, -1 if a duplicate child was dropped
+ */
+int shv_tree_bulk_finish(struct shv_node *node, bool shrink);
+
+/**
+ * @brief Get the tree generation, it changes with every change of any tree
+ *
+ * @return The generation number
+ */
+unsigned int shv_tree_generation(void);
+
+/**
+ * @brief Get the cached result of ls of the node
+ *
+ * The cache is dropped once a child is added, the reference keeps
+ * the result while it is sent. Safe to call from more threads.
+ *
+ * @param node
+ * @return A referenced result to be released by shv_packed_result_put(),
+ *         NULL if nothing is cached
+ */
+struct shv_packed_result *shv_node_ls_cache_get(struct shv_node *node);
+
+/**
+ * @brief Cache the result of ls of the node
+ *
+ * The result is not cached if another thread cached one first, that
+ * one is returned then, or if the tree changed since gen.
+ *
+ * @param node
+ * @param res Result packed by shv_pack_result_str_list_it(), can be NULL
+ * @param gen shv_tree_generation() before the children were packed
+ * @return A referenced result to be released by shv_packed_result_put(),
+ *         NULL if res is NULL
+ */
+struct shv_packed_result *shv_node_ls_cache_publish(struct shv_node *node,
+                                                    struct shv_packed_result *res,
+                                                    unsigned int gen);
+
+/**
+ * @brief Get the path index of the root
+ *
+ * The index is allocated by the first call for the root and shared
+ * by the following ones, release it by shv_path_index_put().
+ *
+ * @param root
+ * @param max_count Number of paths indexed at most, the tree nodes
+ *                  are indexed up to it. The first call for the root
+ *                  sets it.
+ * @return A nonNULL pointer on success, NULL otherwise
+ */
+struct shv_path_index *shv_path_index_get(struct shv_node *root, size_t max_count);
+
+/**
+ * @brief Release the path index, it is freed once nobody uses it
+ *
+ * @param index The index, can be NULL
+ */
+void shv_path_index_put(struct shv_path_index *index);
+
+/**
+ * @brief Find node based on a path, looking at the index first
+ *
+ * The path is resolved by shv_node_find_vn() on a miss and the result
+ * is indexed, unless it is a virtual node. The index is dropped once
+ * the tree changes. A path indexed beyond max_count replaces
+ * the one it hashes to. Safe to call from more threads.
+ *
+ * @param index The index, NULL just calls shv_node_find_vn()
+ * @param root The node the path is relative to, the root of the index
+ * @param path
+ * @param path_len
+ * @param scratch Memory for the virtual nodes, can be NULL
+ * @return The node, NULL if it does not exist
+ */
+struct shv_node *shv_path_index_find(struct shv_path_index *index, struct shv_node *root,
+                                     const char *path, size_t path_len,
+                                     struct shv_vnode_scratch *scratch);
 void shv_tree_node_init(struct shv_node *item, const char *child_name, const struct shv_dmap *dir, int mode);
 
 /**
  * @brief Destroy the whole SHV tree, given the parent node
  *
+ * Nodes allocated from an arena are not freed, free the arena
+ * by shv_arena_destroy() once the tree is destroyed.
+ *
  * @param parent
  */
 void shv_tree_destroy(struct shv_node *parent);
@@ -174,6 +440,18 @@ void shv_tree_destroy(struct shv_node *parent);
  */
 struct shv_node *shv_tree_node_new(const char *child_name, const struct shv_dmap *dir, int mode);
 
+/**
+ * @brief Allocates and initializes a simple node in the arena
+ *
+ * @param arena The arena, NULL allocates from the heap
+ * @param child_name
+ * @param dir
+ * @param mode
+ * @return A nonNULL pointer on success, NULL otherwise
+ */
+struct shv_node *shv_tree_arena_node_new(struct shv_arena *arena, const char *child_name,
+                                         const struct shv_dmap *dir, int mode);
+
 /**
  * @brief Initialize the struct shv_node_typed_val node
  *
@@ -183,3 +461,26 @@ struct shv_node *shv_tree_node_new(const char *child_name, const struct shv_dmap
  * @return A nonNULL pointer on success, NULL otherwise
  */
 struct shv_node_typed_val *shv_tree_node_typed_val_new(const char *child_name, const struct shv_dmap *dir, int mode);
+
+/**
+ * @brief Allocates and initializes the struct shv_node_typed_val node in the arena
+ *
+ * @param arena The arena, NULL allocates from the heap
+ * @param child_name
+ * @param dir
+ * @param mode
+ * @return A nonNULL pointer on success, NULL otherwise
+ */
+struct shv_node_typed_val *shv_tree_arena_node_typed_val_new(struct shv_arena *arena,
+                                                             const char *child_name,
+                                                             const struct shv_dmap *dir,
+                                                             int mode);
+
+/**
+ * @brief Allocate zeroed memory of a node
+ *
+ * @param arena The arena, NULL allocates from the heap
+ * @param size
+ * @return A nonNULL pointer on success, NULL otherwise
+ */
+void *shv_tree_node_alloc(struct shv_arena *arena, size_t size);
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_txq.h
+ * @brief Queue of messages submitted to the communication thread
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct shv_con_ctx;
+struct shv_txq_msg;
+
+/**
+ * @brief Packs and sends the message, called by the communication thread
+ */
+typedef void (*shv_txq_send_t)(struct shv_con_ctx *shv_ctx, struct shv_txq_msg *msg);
+
+/**
+ * @brief A message queued to be sent by the communication thread.
+ *
+ * The message is either packed in advance, data then holds the whole
+ * chainpack message without the length prefix, or it is packed by
+ * the send callback once its turn comes. The release callback is called
+ * once the message is sent or dropped.
+ */
+struct shv_txq_msg
+{
+    _Atomic(struct shv_txq_msg *) next;
+    shv_txq_send_t send;                       /* NULL to send data as is */
+    void (*release)(struct shv_txq_msg *msg);  /* NULL if not needed */
+    const void *data;                          /* Packed message */
+    size_t len;                                /* Length of data */
+};
+
+/**
+ * @brief Intrusive multi-producer single-consumer queue.
+ *
+ * Any thread can push a message by a single atomic exchange, without
+ * locks or allocations, only the communication thread pops them.
+ */
+struct shv_txq
+{
+    _Atomic(struct shv_txq_msg *) head;        /* The message pushed last */
+    struct shv_txq_msg *tail;                  /* The message popped next */
+    struct shv_txq_msg stub;
+    struct shv_txq_msg *held;                  /* Popped but put back, popped next */
+    atomic_bool wake;                          /* The consumer is to be woken */
+};
+
+/**
+ * @brief Initialize an empty queue
+ *
+ * @param q
+ */
+void shv_txq_init(struct shv_txq *q);
+
+/**
+ * @brief Push a message to the queue, safe to call from any thread
+ *
+ * @param q
+ * @param msg
+ * @return true if the consumer has to be woken
+ */
+bool shv_txq_push(struct shv_txq *q, struct shv_txq_msg *msg);
+
+/**
+ * @brief Pop the oldest message, only one thread may call it
+ *
+ * Call shv_txq_pop_begin() before popping the messages.
+ *
+ * @param q
+ * @return The message, NULL if there is none or its push is not finished
+ *         yet, the consumer is woken again then
+ */
+struct shv_txq_msg *shv_txq_pop(struct shv_txq *q);
+
+/**
+ * @brief Put the popped message back, it is popped first next time
+ *
+ * Only the thread popping the messages may call it, once per pop.
+ *
+ * @param q
+ * @param msg The message popped last
+ */
+void shv_txq_unpop(struct shv_txq *q, struct shv_txq_msg *msg);
+
+/**
+ * @brief Let the next push wake the consumer
+ *
+ * @param q
+ */
+void shv_txq_pop_begin(struct shv_txq *q);
+
+/**
+ * @brief Tell whether messages were pushed since shv_txq_pop_begin()
+ *
+ * @param q
+ * @return true if the consumer has messages to pop
+ */
+bool shv_txq_pushed(struct shv_txq *q);
+
+/**
+ * @brief Allocate a message with a copy of packed data
+ *
+ * The message is freed once sent.
+ *
+ * @param data The whole chainpack message, without the length prefix
+ * @param len
+ * @return The message, NULL if memory cannot be allocated
+ */
+struct shv_txq_msg *shv_txq_msg_new(const void *data, size_t len);
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_value.h
+ * @brief Value cells shared by the application and the SHV tree
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shv_tree.h"
+
+/* Longest string a cell holds, including the terminating NUL */
+
+#ifndef SHV_VALUE_STR_LEN
+  #define SHV_VALUE_STR_LEN 32
+#endif
+
+#define SHV_VALUE_WORDS ((SHV_VALUE_STR_LEN + sizeof(unsigned int) - 1) / sizeof(unsigned int))
+
+enum shv_value_type
+{
+    SHV_VALUE_DOUBLE = 0,
+    SHV_VALUE_INT,
+    SHV_VALUE_BOOL,
+    SHV_VALUE_STR
+};
+
+/**
+ * @brief A value updated by one thread and read by others.
+ *
+ * The cell is a sequence lock. A writer never waits for the readers,
+ * a reader retries only if it raced with a write, so a control loop
+ * can update thousands of cells per cycle without blocking the thread
+ * serving the requests and no reader sees a torn value.
+ *
+ * Writers never wait for each other either. A write that finds another
+ * write to the cell in progress (the application and a "set" request)
+ * is not stored and the setter returns -1, the "set" request is answered
+ * by SHV_RE_TRY_AGAIN_LATER then. A cell written by the application
+ * should have the read only dmap, unless the application can retry
+ * or skip a failed write.
+ *
+ * A cell is bound to a node by setting shv_node_typed_val.val_ptr to it,
+ * the node methods are given by shv_value_*_dmap.
+ */
+struct shv_value_cell
+{
+    atomic_uint seq;                        /* Odd while being written */
+    enum shv_value_type type;
+    atomic_uint data[SHV_VALUE_WORDS];
+};
+
+/**
+ * @brief Static initializer of a cell of given type, holding zero
+ */
+#define SHV_VALUE_CELL_INIT(value_type) { .type = (value_type) }
+
+/**
+ * @brief Initialize a cell of given type, holding zero
+ *
+ * @param cell
+ * @param type
+ */
+void shv_value_cell_init(struct shv_value_cell *cell, enum shv_value_type type);
+
+/**
+ * @brief Store a value to the cell
+ *
+ * The setters return 0 on success, -1 if another write to the cell
+ * was in progress and the value was not stored.
+ */
+int shv_value_set_double(struct shv_value_cell *cell, double val);
+double shv_value_get_double(struct shv_value_cell *cell);
+int shv_value_set_int(struct shv_value_cell *cell, int64_t val);
+int64_t shv_value_get_int(struct shv_value_cell *cell);
+int shv_value_set_bool(struct shv_value_cell *cell, bool val);
+bool shv_value_get_bool(struct shv_value_cell *cell);
+
+/**
+ * @brief Store a string to the cell
+ *
+ * @param cell
+ * @param str
+ * @return 0 on success, 1 if the string was truncated to fit the cell,
+ *         -1 if another write to the cell was in progress and nothing
+ *         was stored
+ */
+int shv_value_set_str(struct shv_value_cell *cell, const char *str);
+
+/**
+ * @brief Copy the string of the cell to a buffer
+ *
+ * @param cell
+ * @param buf
+ * @param size Size of buf, SHV_VALUE_STR_LEN fits any string
+ * @return Length of the cell string, it was truncated if not less than size
+ */
+size_t shv_value_get_str(struct shv_value_cell *cell, char *buf, size_t size);
+
+/* Methods of the nodes holding a cell */
+
+extern const struct shv_dmap shv_value_double_dmap;
+extern const struct shv_dmap shv_value_double_read_only_dmap;
+extern const struct shv_dmap shv_value_int_dmap;
+extern const struct shv_dmap shv_value_int_read_only_dmap;
+extern const struct shv_dmap shv_value_bool_dmap;
+extern const struct shv_dmap shv_value_bool_read_only_dmap;
+extern const struct shv_dmap shv_value_str_dmap;
+extern const struct shv_dmap shv_value_str_read_only_dmap;
+
+int shv_value_get(struct shv_con_ctx *shv_ctx, struct shv_node *item, int rid);
+int shv_value_set(struct shv_con_ctx *shv_ctx, struct shv_node *item, int rid);
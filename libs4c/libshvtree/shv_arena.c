@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_arena.c
+ * @brief Arena allocator a whole tree can be built into
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <shv/tree/shv_arena.h>
+
+#define SHV_ARENA_ALIGN (_Alignof(max_align_t))
+
+struct shv_arena_chunk
+{
+    struct shv_arena_chunk *next;
+    size_t size;                    /* Size of data */
+    max_align_t data[];
+};
+
+void shv_arena_init(struct shv_arena *arena, size_t chunk_size)
+{
+    arena->chunk_size = chunk_size;
+    arena->used = 0;
+    arena->chunks = NULL;
+}
+
+void shv_arena_destroy(struct shv_arena *arena)
+{
+    while (arena->chunks != NULL) {
+        struct shv_arena_chunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+    arena->used = 0;
+}
+
+void *shv_arena_alloc(struct shv_arena *arena, size_t size)
+{
+    struct shv_arena_chunk *chunk = arena->chunks;
+    void *mem;
+
+    size = (size + SHV_ARENA_ALIGN - 1) & ~(SHV_ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->size - arena->used < size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+
+        chunk = malloc(sizeof(struct shv_arena_chunk) + chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+
+        if (arena->chunks != NULL && chunk_size > arena->chunk_size) {
+            /* An oversized request, keep bumping in the current chunk */
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+            memset(chunk->data, 0, size);
+            return chunk->data;
+        }
+
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->used = 0;
+    }
+
+    mem = (char *)chunk->data + arena->used;
+    arena->used += size;
+    memset(mem, 0, size);
+    return mem;
+}
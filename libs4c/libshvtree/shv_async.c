@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_async.c
+ * @brief Worker pool for the methods replying asynchronously
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shv/tree/shv_async.h>
+#include <ulut/ul_utdefs.h>
+
+static void *shv_work_pool_thread(void *arg)
+{
+    struct shv_work_pool *pool = (struct shv_work_pool *)arg;
+    struct shv_work *work;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && !pool->stop) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        work = pool->head;
+        if (work == NULL) {
+            break;
+        }
+        pool->head = work->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        work->fnc(work);
+        shv_com_submit(work->token.shv_ctx, &work->msg);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int shv_work_pool_init(struct shv_work_pool *pool, int nthreads)
+{
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->stop = false;
+    pool->nthreads = 0;
+    pool->threads = malloc(nthreads * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        printf("ERROR: Failed to allocate memory for the worker threads\n");
+        shv_work_pool_destroy(pool);
+        return -1;
+    }
+
+    while (pool->nthreads < nthreads) {
+        if (pthread_create(&pool->threads[pool->nthreads], NULL, shv_work_pool_thread,
+                           pool) != 0) {
+            printf("ERROR: Failed to create a worker thread\n");
+            shv_work_pool_destroy(pool);
+            return -1;
+        }
+        pool->nthreads++;
+    }
+
+    return 0;
+}
+
+void shv_work_pool_destroy(struct shv_work_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->nthreads = 0;
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+int shv_reply_token_init(struct shv_reply_token *token, struct shv_con_ctx *shv_ctx, int rid)
+{
+    int cid_cnt = shv_ctx->rpc_head.cid_cnt;
+
+    token->shv_ctx = shv_ctx;
+    token->rid = rid;
+    token->cid_cnt = cid_cnt;
+    token->cids = token->cid_inline;
+    if (cid_cnt > SHV_CID_INLINE_LEN) {
+        token->cids = malloc(cid_cnt * sizeof(int));
+        if (token->cids == NULL) {
+            printf("ERROR: Failed to allocate memory for the caller IDs\n");
+            return -1;
+        }
+    }
+    if (cid_cnt > 0) {
+        memcpy(token->cids, shv_ctx->rpc_head.cids, cid_cnt * sizeof(int));
+    }
+
+    return 0;
+}
+
+void shv_reply_token_free(struct shv_reply_token *token)
+{
+    if (token->cids != token->cid_inline) {
+        free(token->cids);
+    }
+    token->cids = token->cid_inline;
+}
+
+/****************************************************************************
+ * Name: shv_work_send_reply
+ *
+ * Description:
+ *   Send the reply of the done work on the communication thread. The reply
+ *   is packed for the caller IDs of the token instead of the request
+ *   being processed.
+ *
+ ****************************************************************************/
+
+static void shv_work_send_reply(struct shv_con_ctx *shv_ctx, struct shv_txq_msg *msg)
+{
+    struct shv_work *work = UL_CONTAINEROF(msg, struct shv_work, msg);
+    int cid_cnt = shv_ctx->rpc_head.cid_cnt;
+    int *cids = shv_ctx->rpc_head.cids;
+
+    shv_ctx->rpc_head.cid_cnt = work->token.cid_cnt;
+    shv_ctx->rpc_head.cids = work->token.cids;
+    work->reply(shv_ctx, work, work->token.rid);
+    shv_ctx->rpc_head.cid_cnt = cid_cnt;
+    shv_ctx->rpc_head.cids = cids;
+}
+
+static void shv_work_release_msg(struct shv_txq_msg *msg)
+{
+    struct shv_work *work = UL_CONTAINEROF(msg, struct shv_work, msg);
+
+    shv_reply_token_free(&work->token);
+    if (work->release != NULL) {
+        work->release(work);
+    }
+}
+
+int shv_work_submit(struct shv_con_ctx *shv_ctx, struct shv_work *work, int rid)
+{
+    struct shv_work_pool *pool = shv_ctx->work_pool;
+
+    if (pool == NULL || shv_reply_token_init(&work->token, shv_ctx, rid) < 0) {
+        return -1;
+    }
+
+    work->msg.send = shv_work_send_reply;
+    work->msg.release = shv_work_release_msg;
+    work->msg.data = NULL;
+    work->msg.len = 0;
+    work->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL) {
+        pool->tail->next = work;
+    } else {
+        pool->head = work;
+    }
+    pool->tail = work;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_buf_pool.c
+ * @brief Pool of message buffers reused across messages
+ */
+
+#include <stdlib.h>
+
+#include <shv/tree/shv_buf_pool.h>
+
+int shv_buf_pool_init(struct shv_buf_pool *pool, size_t buf_size, int count,
+                      size_t max_size)
+{
+    pool->buf_size = buf_size;
+    pool->max_size = max_size > buf_size ? max_size : buf_size;
+    pool->count = count > 0 ? count : 1;
+    pool->free_cnt = 0;
+    pool->free_bufs = malloc(pool->count * sizeof(void *));
+    if (pool->free_bufs == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < pool->count; i++) {
+        void *buf = malloc(buf_size);
+        if (buf == NULL) {
+            shv_buf_pool_destroy(pool);
+            return -1;
+        }
+        pool->free_bufs[pool->free_cnt++] = buf;
+    }
+
+    return 0;
+}
+
+void shv_buf_pool_destroy(struct shv_buf_pool *pool)
+{
+    if (pool->free_bufs == NULL) {
+        return;
+    }
+
+    while (pool->free_cnt > 0) {
+        free(pool->free_bufs[--pool->free_cnt]);
+    }
+    free(pool->free_bufs);
+    pool->free_bufs = NULL;
+}
+
+void *shv_buf_pool_get(struct shv_buf_pool *pool)
+{
+    if (pool->free_cnt > 0) {
+        return pool->free_bufs[--pool->free_cnt];
+    }
+
+    return malloc(pool->buf_size);
+}
+
+void shv_buf_pool_put(struct shv_buf_pool *pool, void *buf, size_t size)
+{
+    if (buf == NULL) {
+        return;
+    }
+
+    /* Grown buffers are not kept, the pool would grow for good */
+    if (size == pool->buf_size && pool->free_bufs != NULL && pool->free_cnt < pool->count) {
+        pool->free_bufs[pool->free_cnt++] = buf;
+    } else {
+        free(buf);
+    }
+}
+
+void *shv_buf_pool_grow(struct shv_buf_pool *pool, void *buf, size_t *size, size_t need)
+{
+    size_t new_size;
+    void *new_buf;
+
+    if (need <= *size) {
+        return buf;
+    }
+    if (need > pool->max_size) {
+        return NULL;
+    }
+
+    new_size = *size * 2 > need ? *size * 2 : need;
+    if (new_size > pool->max_size) {
+        new_size = pool->max_size;
+    }
+
+    new_buf = realloc(buf, new_size);
+    if (new_buf != NULL) {
+        *size = new_size;
+    }
+    return new_buf;
+}
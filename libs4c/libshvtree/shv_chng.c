@@ -0,0 +1,275 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_chng.c
+ * @brief Publication of value changes by chng signals
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <shv/tree/shv_chng.h>
+#include <shv/tree/shv_com_common.h>
+
+void shv_chng_node_init(struct shv_chng_node *node, struct shv_value_cell *cell,
+                        const char *path, enum shv_chng_deadband deadband_type,
+                        double deadband)
+{
+  node->cell = cell;
+  node->path = path;
+  node->deadband_type = deadband_type;
+  node->deadband = deadband;
+  node->next = NULL;
+  atomic_init(&node->marked, false);
+  node->sent = false;
+}
+
+/****************************************************************************
+ * Name: shv_chng_mark
+ *
+ * Description:
+ *   Push the node to the list of marked nodes unless it is there already.
+ *   The list is taken as a whole by the communication thread, so the push
+ *   does not suffer from ABA.
+ *
+ ****************************************************************************/
+
+void shv_chng_mark(struct shv_con_ctx *shv_ctx, struct shv_chng_node *node)
+{
+  struct shv_chng_node *head;
+
+  if (atomic_exchange(&node->marked, true))
+    {
+      return;
+    }
+
+  head = atomic_load_explicit(&shv_ctx->chng_dirty, memory_order_relaxed);
+  do
+    {
+      node->next = head;
+    }
+  while (!atomic_compare_exchange_weak_explicit(&shv_ctx->chng_dirty, &head, node,
+                                                memory_order_release,
+                                                memory_order_relaxed));
+
+  if (head == NULL)
+    {
+      shv_process_wake(shv_ctx);
+    }
+}
+
+/****************************************************************************
+ * Name: shv_chng_outside_deadband
+ *
+ * Description:
+ *   Check the numeric change is to be sent.
+ *
+ ****************************************************************************/
+
+static bool shv_chng_outside_deadband(struct shv_chng_node *node, double val,
+                                      double last)
+{
+  /* Zero deadband or last value must not let an unchanged value through */
+
+  if (val == last)
+    {
+      return false;
+    }
+
+  switch (node->deadband_type)
+    {
+      case SHV_CHNG_DEADBAND_ABS:
+        return fabs(val - last) >= node->deadband;
+      case SHV_CHNG_DEADBAND_REL:
+        return fabs(val - last) >= node->deadband * fabs(last);
+      default:
+        return true;
+    }
+}
+
+/****************************************************************************
+ * Name: shv_chng_send
+ *
+ * Description:
+ *   Send the signal with the current value of the node if it differs
+ *   enough from the value sent last. Returns 1 if sent.
+ *
+ ****************************************************************************/
+
+static int shv_chng_send(struct shv_con_ctx *shv_ctx, struct shv_chng_node *node)
+{
+  struct ccpcp_pack_context *pack_ctx = &shv_ctx->pack_ctx;
+  char str[SHV_VALUE_STR_LEN];
+  double d = 0;
+  int64_t i = 0;
+  bool b = false;
+
+  switch (node->cell->type)
+    {
+      case SHV_VALUE_DOUBLE:
+        d = shv_value_get_double(node->cell);
+        if (node->sent && !shv_chng_outside_deadband(node, d, node->last.d))
+          {
+            return 0;
+          }
+        node->last.d = d;
+        break;
+      case SHV_VALUE_INT:
+        i = shv_value_get_int(node->cell);
+        if (node->sent && (i == node->last.i ||
+                           !shv_chng_outside_deadband(node, (double)i,
+                                                      (double)node->last.i)))
+          {
+            return 0;
+          }
+        node->last.i = i;
+        break;
+      case SHV_VALUE_BOOL:
+        b = shv_value_get_bool(node->cell);
+        if (node->sent && b == node->last.b)
+          {
+            return 0;
+          }
+        node->last.b = b;
+        break;
+      case SHV_VALUE_STR:
+        shv_value_get_str(node->cell, str, sizeof(str));
+        break;
+    }
+
+  node->sent = true;
+
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(pack_ctx, 1);
+
+      shv_pack_head_signal(shv_ctx, "chng", node->path);
+
+      cchainpack_pack_imap_begin(pack_ctx);
+      cchainpack_pack_int(pack_ctx, 1);
+      switch (node->cell->type)
+        {
+          case SHV_VALUE_DOUBLE:
+            cchainpack_pack_double(pack_ctx, d);
+            break;
+          case SHV_VALUE_INT:
+            cchainpack_pack_int(pack_ctx, i);
+            break;
+          case SHV_VALUE_BOOL:
+            cchainpack_pack_boolean(pack_ctx, b);
+            break;
+          case SHV_VALUE_STR:
+            cchainpack_pack_string(pack_ctx, str, strlen(str));
+            break;
+        }
+      cchainpack_pack_container_end(pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+
+  return 1;
+}
+
+/****************************************************************************
+ * Name: shv_chng_unflush
+ *
+ * Description:
+ *   Return the nodes not sent to the list of marked nodes, still marked.
+ *   Unlike shv_chng_mark() the thread is not woken, the nodes are sent
+ *   once the transport is not congested.
+ *
+ ****************************************************************************/
+
+static void shv_chng_unflush(struct shv_con_ctx *shv_ctx, struct shv_chng_node *list)
+{
+  struct shv_chng_node *first = NULL;
+  struct shv_chng_node *last = list;
+  struct shv_chng_node *next;
+  struct shv_chng_node *head;
+
+  /* The list is kept with the node marked last in front */
+
+  while (list != NULL)
+    {
+      next = list->next;
+      list->next = first;
+      first = list;
+      list = next;
+    }
+
+  head = atomic_load_explicit(&shv_ctx->chng_dirty, memory_order_relaxed);
+  do
+    {
+      last->next = head;
+    }
+  while (!atomic_compare_exchange_weak_explicit(&shv_ctx->chng_dirty, &head, first,
+                                                memory_order_release,
+                                                memory_order_relaxed));
+}
+
+/****************************************************************************
+ * Name: shv_chng_flush
+ *
+ * Description:
+ *   Take the marked nodes and send their signals together.
+ *
+ ****************************************************************************/
+
+int shv_chng_flush(struct shv_con_ctx *shv_ctx)
+{
+  struct shv_chng_node *list;
+  struct shv_chng_node *prev = NULL;
+  struct shv_chng_node *next;
+  bool batch;
+  int cnt = 0;
+
+  list = atomic_exchange_explicit(&shv_ctx->chng_dirty, NULL, memory_order_acquire);
+  if (list == NULL)
+    {
+      return 0;
+    }
+
+  /* The nodes were pushed in front, send them in the order marked */
+
+  while (list != NULL)
+    {
+      next = list->next;
+      list->next = prev;
+      prev = list;
+      list = next;
+    }
+
+  batch = shv_ctx->tx_batch;
+  shv_ctx->tx_batch = shv_ctx->tx_buf != NULL;
+
+  for (list = prev; list != NULL; list = next)
+    {
+      /* Keep the rest marked until the transport sends what it has */
+
+      if (shv_com_tx_congested(shv_ctx, SHV_BUF_LEN))
+        {
+          shv_chng_unflush(shv_ctx, list);
+          break;
+        }
+
+      /* The node can be marked again once unmarked, take the next first.
+       * A change made after the value is read marks it again.
+       */
+
+      next = list->next;
+      atomic_store(&list->marked, false);
+      cnt += shv_chng_send(shv_ctx, list);
+    }
+
+  shv_ctx->tx_batch = batch;
+  if (!batch)
+    {
+      shv_com_flush(shv_ctx);
+    }
+
+  return cnt;
+}
@@ -10,7 +10,9 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -19,10 +21,12 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <string.h>
+#include <time.h>
 
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
@@ -286,9 +290,82 @@ int shv_serial_posix_dataready(struct shv_tlayer_serial_ctx *sctx, int timeout)
     return -1;
 }
 
+/* Tell whether the failed connect is to be tried again later */
+
+static int shv_tcpip_connect_error(int err)
+{
+    if (err == ECONNREFUSED ||
+        err == ENETUNREACH ||
+        err == ETIMEDOUT ||
+        err == ECONNRESET ||
+        err == EHOSTUNREACH ||
+        err == ENETDOWN) {
+        return -1;
+    }
+    return -2;
+}
+
+/* Prepare the connected socket for the communication */
+
+static int shv_tcpip_connected(struct shv_connection *connection)
+{
+    connection->tlayer.tcpip.ctx.txq_rd = 0;
+    connection->tlayer.tcpip.ctx.txq_len = 0;
+    if (connection->tlayer.tcpip.ctx.txq == NULL) {
+        connection->tlayer.tcpip.ctx.txq = malloc(SHV_TCPIP_TXQ_INIT);
+        connection->tlayer.tcpip.ctx.txq_size = SHV_TCPIP_TXQ_INIT;
+        if (connection->tlayer.tcpip.ctx.txq == NULL) {
+            fprintf(stderr, "ERROR: Cannot allocate the send queue.\n");
+            close(connection->tlayer.tcpip.ctx.sockfd);
+            return -2;
+        }
+    }
+
+    connection->tlayer.tcpip.ctx.pfds[0].fd = connection->tlayer.tcpip.ctx.sockfd;
+    connection->tlayer.tcpip.ctx.pfds[0].events = POLLIN;
+
+    printf("Connected to the server %s:%d.\n", connection->tlayer.tcpip.ip_addr,
+                                               connection->tlayer.tcpip.port);
+
+    return 0;
+}
+
+/* Finish the connect in progress once the socket is writable */
+
+static int shv_tcpip_connect_finish(struct shv_connection *connection)
+{
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int err = 0;
+
+    pfd.fd = connection->tlayer.tcpip.ctx.sockfd;
+    pfd.events = POLLOUT;
+    if (poll(&pfd, 1, 0) == 0) {
+        return 1;
+    }
+
+    connection->tlayer.tcpip.ctx.connecting = false;
+    if (getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        close(pfd.fd);
+        connection->tlayer.tcpip.ctx.sockfd = -1;
+        errno = err;
+        return shv_tcpip_connect_error(err);
+    }
+
+    return shv_tcpip_connected(connection);
+}
+
 int shv_tcpip_posix_init(struct shv_connection *connection)
 {
     struct sockaddr_in servaddr;
+    int err;
+
+    if (connection->tlayer.tcpip.ctx.connecting) {
+        return shv_tcpip_connect_finish(connection);
+    }
 
     /* Socket creation */
 
@@ -313,39 +390,228 @@ int shv_tcpip_posix_init(struct shv_connection *connection)
     servaddr.sin_addr.s_addr = inet_addr(connection->tlayer.tcpip.ip_addr);
     servaddr.sin_port = htons(connection->tlayer.tcpip.port);
 
+    /* Neither the connect nor the communication may stall the thread.
+     * Data the socket does not accept are queued and sent once it is
+     * writable again.
+     */
+
+    fcntl(connection->tlayer.tcpip.ctx.sockfd, F_SETFL,
+          fcntl(connection->tlayer.tcpip.ctx.sockfd, F_GETFL) | O_NONBLOCK);
+
     /* Connect the client socket to server socket */
 
     if (connect(connection->tlayer.tcpip.ctx.sockfd,
                 (struct sockaddr*)&servaddr, sizeof(servaddr)) != 0) {
+        if (errno == EINPROGRESS) {
+            /* Finished by the next call once dataready reports the socket */
+            connection->tlayer.tcpip.ctx.connecting = true;
+            connection->tlayer.tcpip.ctx.pfds[0].fd = connection->tlayer.tcpip.ctx.sockfd;
+            connection->tlayer.tcpip.ctx.pfds[0].events = POLLOUT;
+            return 1;
+        }
+        err = errno;
         close(connection->tlayer.tcpip.ctx.sockfd);
-        if (errno == ECONNREFUSED ||
-            errno == ENETUNREACH ||
-            errno == ETIMEDOUT ||
-            errno == ECONNRESET ||
-            errno == EHOSTUNREACH ||
-            errno == ENETDOWN) {
-            return -1;
+        connection->tlayer.tcpip.ctx.sockfd = -1;
+        return shv_tcpip_connect_error(err);
+    }
+
+    return shv_tcpip_connected(connection);
+}
+
+/* Send as much of the queued data as the socket accepts */
+
+static int shv_tcpip_txq_drain(struct shv_tlayer_tcpip_ctx *tctx)
+{
+    struct iovec iov[2];
+    size_t first;
+    ssize_t ret;
+
+    while (tctx->txq_len > 0) {
+        first = tctx->txq_size - tctx->txq_rd;
+        if (first > tctx->txq_len) {
+            first = tctx->txq_len;
         }
-        return -2;
+        iov[0].iov_base = tctx->txq + tctx->txq_rd;
+        iov[0].iov_len = first;
+        iov[1].iov_base = tctx->txq;
+        iov[1].iov_len = tctx->txq_len - first;
+
+        ret = writev(tctx->sockfd, iov, iov[1].iov_len > 0 ? 2 : 1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        tctx->txq_rd = (tctx->txq_rd + ret) % tctx->txq_size;
+        tctx->txq_len -= ret;
     }
 
-    connection->tlayer.tcpip.ctx.pfds[0].fd = connection->tlayer.tcpip.ctx.sockfd;
-    connection->tlayer.tcpip.ctx.pfds[0].events = POLLIN;
+    tctx->txq_rd = 0;
+    return 0;
+}
 
-    printf("Connected to the server %s:%d.\n", connection->tlayer.tcpip.ip_addr,
-                                               connection->tlayer.tcpip.port);
+/* Make room for len more bytes in the queue, it grows up to SHV_TCPIP_TXQ_MAX */
+
+static int shv_tcpip_txq_reserve(struct shv_tlayer_tcpip_ctx *tctx, size_t len)
+{
+    size_t size = tctx->txq_size;
+    size_t first;
+    char *txq;
 
+    if (len <= tctx->txq_size - tctx->txq_len) {
+        return 0;
+    }
+    if (len > SHV_TCPIP_TXQ_MAX - tctx->txq_len) {
+        errno = EAGAIN;
+        return -1;
+    }
+    while (size < tctx->txq_len + len) {
+        size *= 2;
+    }
+    if (size > SHV_TCPIP_TXQ_MAX) {
+        size = SHV_TCPIP_TXQ_MAX;
+    }
+
+    txq = malloc(size);
+    if (txq == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Unwrap the queued data to the start of the new ring */
+
+    first = tctx->txq_size - tctx->txq_rd;
+    if (first > tctx->txq_len) {
+        first = tctx->txq_len;
+    }
+    memcpy(txq, tctx->txq + tctx->txq_rd, first);
+    memcpy(txq + first, tctx->txq, tctx->txq_len - first);
+    free(tctx->txq);
+    tctx->txq = txq;
+    tctx->txq_size = size;
+    tctx->txq_rd = 0;
     return 0;
 }
 
+/* Append len bytes to the queue, the room is reserved by shv_tcpip_txq_reserve() */
+
+static void shv_tcpip_txq_put(struct shv_tlayer_tcpip_ctx *tctx, const char *buf, size_t len)
+{
+    size_t wr = (tctx->txq_rd + tctx->txq_len) % tctx->txq_size;
+    size_t first;
+
+    first = tctx->txq_size - wr;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(tctx->txq + wr, buf, first);
+    memcpy(tctx->txq, buf + first, len - first);
+    tctx->txq_len += len;
+}
+
 int shv_tcpip_posix_read(struct shv_connection *connection, void *buf, size_t len)
 {
-    return read(connection->tlayer.tcpip.ctx.sockfd, buf, len);
+    ssize_t ret;
+
+    /* Never wait for the data, the caller waits for dataready */
+
+    do {
+        ret = read(connection->tlayer.tcpip.ctx.sockfd, buf, len);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno == EWOULDBLOCK) {
+        errno = EAGAIN;
+    }
+    return ret;
 }
 
 int shv_tcpip_posix_write(struct shv_connection *connection, void *buf, size_t len)
 {
-    return write(connection->tlayer.tcpip.ctx.sockfd, buf, len);
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return shv_tcpip_posix_writev(connection, &iov, 1);
+}
+
+int shv_tcpip_posix_writev(struct shv_connection *connection, const struct iovec *iov,
+                           int iovcnt)
+{
+    struct shv_tlayer_tcpip_ctx *tctx = &connection->tlayer.tcpip.ctx;
+    size_t total = 0;
+    size_t sent = 0;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    /* Write directly if nothing is queued, keep the order otherwise */
+
+    if (shv_tcpip_txq_drain(tctx) < 0) {
+        return -1;
+    }
+    if (tctx->txq_len == 0) {
+        do {
+            ret = writev(tctx->sockfd, iov, iovcnt);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            ret = 0;
+        }
+        sent = ret;
+    }
+
+    /* Queue all of the rest or none of it. Nothing waits here for
+     * the socket, dataready sends the queue once it is writable.
+     */
+
+    if (shv_tcpip_txq_reserve(tctx, total - sent) < 0) {
+        if (errno == EAGAIN) {
+            fprintf(stderr, "ERROR: The send queue is full.\n");
+        }
+        return sent > 0 ? (int)sent : -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if (sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        shv_tcpip_txq_put(tctx, (const char *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        sent = 0;
+    }
+
+    return total;
+}
+
+size_t shv_tcpip_posix_txroom(struct shv_connection *connection)
+{
+    struct shv_tlayer_tcpip_ctx *tctx = &connection->tlayer.tcpip.ctx;
+
+    /* A frame longer than the limit goes out once nothing is queued */
+
+    if (tctx->txq == NULL || tctx->txq_len >= SHV_TCPIP_TXQ_LEN) {
+        return 0;
+    }
+    if (tctx->txq_len == 0) {
+        return SIZE_MAX;
+    }
+    return SHV_TCPIP_TXQ_LEN - tctx->txq_len;
+}
+
+int shv_tcpip_posix_txflush(struct shv_connection *connection)
+{
+    struct shv_tlayer_tcpip_ctx *tctx = &connection->tlayer.tcpip.ctx;
+
+    if (shv_tcpip_txq_drain(tctx) < 0) {
+        return -1;
+    }
+    return tctx->txq_len;
 }
 
 int shv_tcpip_posix_close(struct shv_connection *connection)
@@ -360,6 +626,11 @@ int shv_tcpip_posix_close(struct shv_connection *connection)
         fprintf(stderr, "Client successfully disconnected.\n");
     }
     connection->tlayer.tcpip.ctx.sockfd = -1;
+    connection->tlayer.tcpip.ctx.connecting = false;
+    free(connection->tlayer.tcpip.ctx.txq);
+    connection->tlayer.tcpip.ctx.txq = NULL;
+    connection->tlayer.tcpip.ctx.txq_size = 0;
+    connection->tlayer.tcpip.ctx.txq_len = 0;
 
     return ret;
 }
@@ -367,19 +638,55 @@ int shv_tcpip_posix_close(struct shv_connection *connection)
 int shv_tcpip_posix_dataready(struct shv_connection *connection, int timeout)
 {
     struct shv_tlayer_tcpip_ctx *tctx = &connection->tlayer.tcpip.ctx;
-    int ret = poll(tctx->pfds, 2, timeout);
-    if (ret <= 0) {
-        return ret;
-    }
+    struct timespec start;
+    struct timespec now;
+    int left = timeout;
+    int ret;
 
-    /* The pipe signalling termination has data ready - simulate this as a timeout */
-    if (tctx->pfds[1].revents & POLLIN) {
-        return 0;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        /* Send the queued data whenever the socket is writable,
+         * a connect in progress is finished then too
+         */
+        if (tctx->connecting) {
+            tctx->pfds[0].events = POLLOUT;
+        } else {
+            tctx->pfds[0].events = POLLIN | (tctx->txq_len > 0 ? POLLOUT : 0);
+        }
+        ret = poll(tctx->pfds, 2, left);
+        if (ret <= 0) {
+            return ret;
+        }
 
-    if (tctx->pfds[0].revents & POLLIN) {
-        return 1;
+        /* The pipe waking the thread has data ready, see shv_process_wake() */
+        if (tctx->pfds[1].revents & POLLIN) {
+            char buf[16];
+            while (read(tctx->pfds[1].fd, buf, sizeof(buf)) > 0);
+            return 2;
+        }
+
+        if (tctx->pfds[0].revents & POLLIN || tctx->connecting) {
+            return 1;
+        }
+        if ((tctx->pfds[0].revents & POLLOUT) == 0 || shv_tcpip_txq_drain(tctx) < 0) {
+            break;
+        }
+
+        /* Let the messages held back by the congestion go out */
+        if (tctx->txq_len == 0) {
+            return 2;
+        }
+
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = timeout - (int)((now.tv_sec - start.tv_sec) * 1000 +
+                                   (now.tv_nsec - start.tv_nsec) / 1000000);
+            if (left <= 0) {
+                return 0;
+            }
+        }
     }
+
     if (tctx->pfds[0].revents & POLLHUP || tctx->pfds[0].revents & POLLERR) {
         int dest;
         socklen_t len = sizeof(dest);
@@ -415,6 +722,11 @@ int shv_create_process_thread(int thrd_prio, struct shv_con_ctx *ctx)
         return -1;
     }
 
+    /* Neither the waking threads nor the woken one may block on the pipe */
+    fcntl(ctx->thrd_ctx.fildes[0], F_SETFL, O_NONBLOCK);
+    fcntl(ctx->thrd_ctx.fildes[1], F_SETFL, O_NONBLOCK);
+    atomic_store(&ctx->thrd_ctx.wake_ready, true);
+
     /* Do a bit of hacking - in this case, the connection is specified,
      * so we should have no problem assigning to pfds[1].
      */
@@ -456,15 +768,42 @@ error:
     return -1;
 }
 
+void shv_process_wake(struct shv_con_ctx *shv_ctx)
+{
+    /* The write is enclosed in {} to suppress warn_unused_result warning,
+     * a full pipe wakes the thread anyway.
+     */
+    if (atomic_load(&shv_ctx->thrd_ctx.wake_ready)) {
+        { write(shv_ctx->thrd_ctx.fildes[1], "w", 1); }
+    }
+}
+
 void shv_stop_process_thread(struct shv_con_ctx *shv_ctx)
 {
-    /* Write to the pipe to simulate the instant timeout */
-    /* The write is enclosed in {} to suppress warn_unused_result warning */
-    { write(shv_ctx->thrd_ctx.fildes[1], "x", 1); }
+    /* The thread and the pipe belong to the loop, wait for the loop
+     * to finish the connection.
+     */
+    if (atomic_load(&shv_ctx->thrd_ctx.loop_served)) {
+        atomic_store(&shv_ctx->running, false);
+        shv_process_wake(shv_ctx);
+        while (atomic_load(&shv_ctx->thrd_ctx.loop_served)) {
+            usleep(1000);
+        }
+        return;
+    }
+
+    /* Nothing to stop unless the thread was created */
+    if (!atomic_load(&shv_ctx->thrd_ctx.wake_ready)) {
+        return;
+    }
+
+    /* Wake the thread, it finds it is not running anymore */
+    shv_process_wake(shv_ctx);
 
     /* Wait for it to join */
     pthread_join(shv_ctx->thrd_ctx.id, NULL);
 
+    atomic_store(&shv_ctx->thrd_ctx.wake_ready, false);
     close(shv_ctx->thrd_ctx.fildes[0]);
     close(shv_ctx->thrd_ctx.fildes[1]);
 }
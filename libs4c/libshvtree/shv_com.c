@@ -10,6 +10,8 @@
  * @brief Main SHV communication and main SHV functions
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -28,44 +30,238 @@
 #include <shv/tree/shv_tree.h>
 #include <shv/tree/shv_com.h>
 #include <shv/tree/shv_com_common.h>
+#include <shv/tree/shv_chng.h>
 
 #define CHECK_STR(str) (str == NULL || strnlen(str, 100) == 0)
 
+/****************************************************************************
+ * Name: cid_reserve
+ *
+ * Description:
+ *   Resize the heap space for CIDs to capacity entries.
+ *
+ ****************************************************************************/
+
+static int cid_reserve(struct shv_con_ctx *shv_ctx, int capacity)
+{
+  struct shv_rpc_head *head = &shv_ctx->rpc_head;
+  int *tmp;
+
+  tmp = (int *)realloc(shv_ctx->cid_ptr, capacity * sizeof(int));
+  if (tmp == NULL)
+    {
+      fprintf(stderr, "ERROR cannot realloc\n");
+      return -1;
+    }
+
+  shv_ctx->cid_ptr = tmp;
+  shv_ctx->cid_capacity = capacity;
+  if (head->cids != NULL && head->cids != head->cid_inline)
+    {
+      head->cids = tmp;
+    }
+
+  return 1;
+}
+
 /****************************************************************************
  * Name: cid_alloc
  *
  * Description:
- *   Allocate (or reallocate) for CIDs.
+ *   Make room for cnt CIDs. Up to SHV_CID_INLINE_LEN of them are kept
+ *   in the RPC head, longer lists are moved to the heap space reserved
+ *   by shv_com_init().
  *
  ****************************************************************************/
 
-int cid_alloc(struct shv_con_ctx * shv_ctx)
+static int cid_alloc(struct shv_con_ctx *shv_ctx, int cnt)
 {
-  if (shv_ctx->cid_capacity < shv_ctx->cid_cnt)
+  struct shv_rpc_head *head = &shv_ctx->rpc_head;
+
+  if (cnt <= SHV_CID_INLINE_LEN)
+    {
+      return 1;
+    }
+
+  if (shv_ctx->cid_capacity < cnt)
     {
-      if (shv_ctx->cid_ptr == NULL)
+      int capacity = shv_ctx->cid_capacity ? 2 * shv_ctx->cid_capacity : 2 * SHV_CID_INLINE_LEN;
+
+      if (capacity < cnt)
         {
-          shv_ctx->cid_ptr = (int *)malloc(shv_ctx->cid_cnt * sizeof(int));
-          shv_ctx->cid_capacity = shv_ctx->cid_cnt;
+          capacity = cnt;
         }
-      else
-        {
-          int* tmp = (int*)realloc(shv_ctx->cid_ptr,
-                                   (shv_ctx->cid_cnt)*sizeof(int));
-          if (tmp == NULL)
-            {
-              fprintf(stderr, "ERROR cannot realloc\n");
-              return -1;
-            }
 
-          shv_ctx->cid_ptr = tmp;
-          shv_ctx->cid_capacity = shv_ctx->cid_cnt;
+      if (cid_reserve(shv_ctx, capacity) < 0)
+        {
+          return -1;
         }
     }
 
+  if (head->cids == head->cid_inline)
+    {
+      memcpy(shv_ctx->cid_ptr, head->cid_inline, head->cid_cnt * sizeof(int));
+      head->cids = shv_ctx->cid_ptr;
+    }
+
   return 1;
 }
 
+/****************************************************************************
+ * Name: shv_unpack_int_item
+ *
+ * Description:
+ *   Store the integer in the current item to val. Returns -1 if the item
+ *   does not fit int.
+ *
+ ****************************************************************************/
+
+static int shv_unpack_int_item(struct ccpcp_unpack_context *ctx, int *val)
+{
+  if (ctx->item.type == CCPCP_ITEM_INT)
+    {
+      if (ctx->item.as.Int < INT_MIN || ctx->item.as.Int > INT_MAX)
+        {
+          return -1;
+        }
+
+      *val = (int)ctx->item.as.Int;
+    }
+  else
+    {
+      if (ctx->item.as.UInt > INT_MAX)
+        {
+          return -1;
+        }
+
+      *val = (int)ctx->item.as.UInt;
+    }
+
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_rpc_head_add_cid
+ *
+ * Description:
+ *   Append the caller ID in the current item to the RPC head.
+ *
+ ****************************************************************************/
+
+static int shv_rpc_head_add_cid(struct shv_con_ctx *shv_ctx)
+{
+  struct shv_rpc_head *head = &shv_ctx->rpc_head;
+  struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+
+  if (cid_alloc(shv_ctx, head->cid_cnt + 1) < 0)
+    {
+      printf("ERROR: Memory allocation for CID failed\n");
+      return -1;
+    }
+
+  if (shv_unpack_int_item(ctx, &head->cids[head->cid_cnt]) < 0)
+    {
+      return -1;
+    }
+
+  head->cid_cnt++;
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_rpc_head_str
+ *
+ * Description:
+ *   Store the string in the current item to the RPC head. The string is
+ *   referenced in the receive buffer if it is there as a whole, otherwise
+ *   it is copied to buf. Returns -1 if the string does not fit buf.
+ *
+ ****************************************************************************/
+
+static int shv_rpc_head_str(struct shv_con_ctx *shv_ctx, const char **str,
+                            size_t *len, char *buf, size_t buf_len)
+{
+  struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+  ccpcp_string *it = &ctx->item.as.String;
+  const char *rx_buf = shv_ctx->rx_buf;
+  size_t copied = 0;
+
+  if (it->string_size < 0 || (size_t)it->string_size >= buf_len)
+    {
+      cchainpack_skip_string_rest(ctx);
+      return -1;
+    }
+
+  if (it->last_chunk && it->chunk_start >= rx_buf &&
+      it->chunk_start < rx_buf + shv_ctx->rx_size)
+    {
+      *str = it->chunk_start;
+      *len = it->chunk_size;
+      return 0;
+    }
+
+  for (;;)
+    {
+      memcpy(buf + copied, it->chunk_start, it->chunk_size);
+      copied += it->chunk_size;
+      if (it->last_chunk)
+        {
+          break;
+        }
+
+      cchainpack_unpack_next(ctx);
+      if (ctx->err_no != CCPCP_RC_OK)
+        {
+          return -1;
+        }
+    }
+
+  buf[copied] = '\0';
+  *str = buf;
+  *len = copied;
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_rpc_head_pin_str
+ *
+ * Description:
+ *   Copy the string out of the receive buffer before it is overwritten.
+ *
+ ****************************************************************************/
+
+static void shv_rpc_head_pin_str(const char **str, size_t len, char *buf,
+                                 const char *rd_data, size_t rd_len)
+{
+  if (*str != NULL && *str >= rd_data && *str < rd_data + rd_len)
+    {
+      memcpy(buf, *str, len);
+      buf[len] = '\0';
+      *str = buf;
+    }
+}
+
+/****************************************************************************
+ * Name: shv_rpc_head_pin
+ *
+ * Description:
+ *   Called before rx_buf is refilled, moves the strings of the RPC
+ *   head still referenced there to its own buffers.
+ *
+ ****************************************************************************/
+
+void shv_rpc_head_pin(struct shv_con_ctx *shv_ctx)
+{
+  struct shv_rpc_head *head = &shv_ctx->rpc_head;
+  const char *rd_data = shv_ctx->rx_buf;
+  size_t rd_len = shv_ctx->rx_size;
+
+  shv_rpc_head_pin_str(&head->path, head->path_len, head->path_buf, rd_data, rd_len);
+  shv_rpc_head_pin_str(&head->method, head->method_len, head->method_buf, rd_data, rd_len);
+  shv_rpc_head_pin_str(&head->access, head->access_len, head->access_buf, rd_data, rd_len);
+  shv_rpc_head_pin_str(&head->user_id, head->user_id_len, head->user_id_buf, rd_data, rd_len);
+}
+
 /****************************************************************************
  * Name: shv_pack_head_request
  *
@@ -94,24 +290,59 @@ void shv_pack_head_request(struct shv_con_ctx *shv_ctx, char *met, char *path)
 }
 
 /****************************************************************************
- * Name: shv_unpack_head
+ * Name: shv_pack_head_signal
  *
  * Description:
- *  Unpacks the head of the message.
+ *  Packs the head of a signal, a message with no request ID.
  *
  ****************************************************************************/
 
-int shv_unpack_head(struct shv_con_ctx * shv_ctx, int * rid, char * method,
-                    char * path)
+void shv_pack_head_signal(struct shv_con_ctx *shv_ctx, const char *sig, const char *path)
 {
-  int i;
-  bool ok;
+  cchainpack_pack_meta_begin(&shv_ctx->pack_ctx);
+
+  cchainpack_pack_int(&shv_ctx->pack_ctx, 1);
+  cchainpack_pack_int(&shv_ctx->pack_ctx, 1);
+
+  cchainpack_pack_int(&shv_ctx->pack_ctx, TAG_SHV_PATH);
+  cchainpack_pack_string(&shv_ctx->pack_ctx, path, strlen(path));
 
-  method[0] = '\0';
-  path[0] = '\0';
+  cchainpack_pack_int(&shv_ctx->pack_ctx, TAG_METHOD);
+  cchainpack_pack_string(&shv_ctx->pack_ctx, sig, strlen(sig));
+
+  cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+}
+
+/****************************************************************************
+ * Name: shv_unpack_rpc_head
+ *
+ * Description:
+ *  Unpacks the head of the message.
+ *
+ ****************************************************************************/
 
+int shv_unpack_rpc_head(struct shv_con_ctx *shv_ctx, struct shv_rpc_head *head)
+{
+  int tag;
+  int ret;
+  bool ok;
+  const char *too_long = NULL;
   struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
 
+  head->rid = -1;
+  head->access_level = -1;
+  head->path = NULL;
+  head->path_len = 0;
+  head->method = NULL;
+  head->method_len = 0;
+  head->access = NULL;
+  head->access_len = 0;
+  head->user_id = NULL;
+  head->user_id_len = 0;
+  head->cid_cnt = 0;
+  head->cids = head->cid_inline;
+  head->params_offset = 0;
+
   /* Unpack length */
 
   cchainpack_unpack_uint_data(ctx, &ok);
@@ -130,157 +361,145 @@ int shv_unpack_head(struct shv_con_ctx * shv_ctx, int * rid, char * method,
   if (ctx->err_no != CCPCP_RC_OK) return -1;
   if (ctx->item.type != CCPCP_ITEM_META) return -1;
 
-  do
+  for (;;)
     {
+      /* Tag */
+
       cchainpack_unpack_next(ctx);
       if (ctx->err_no != CCPCP_RC_OK) return -1;
-      if (ctx->item.type == CCPCP_ITEM_INT)
+
+      if (ctx->item.type == CCPCP_ITEM_CONTAINER_END)
+        {
+          head->params_offset = ctx->current - ctx->start;
+          if (too_long != NULL)
+            {
+              /* Refuse the request, its params are skipped as of a response */
+
+              head->method = NULL;
+              head->method_len = 0;
+              shv_send_error(shv_ctx, head->rid, SHV_RE_METHOD_CALL_EXCEPTION, too_long);
+            }
+
+          return 0;
+        }
+      else if ((ctx->item.type == CCPCP_ITEM_INT) ||
+               (ctx->item.type == CCPCP_ITEM_UINT))
         {
-          i = ctx->item.as.Int;
+          if (shv_unpack_int_item(ctx, &tag) < 0)
+            {
+              tag = -1;
+            }
         }
       else
         {
-          i = 0;
+          if (shv_unpack_discard(shv_ctx) < 0)
+            {
+              return -1;
+            }
+
+          tag = -1;
+        }
+
+      if (tag != TAG_REQUEST_ID && tag != TAG_SHV_PATH && tag != TAG_METHOD &&
+          tag != TAG_CALLER_IDS && tag != TAG_ACCESS && tag != TAG_USER_ID &&
+          tag != TAG_ACCESS_LEVEL)
+        {
+          cchainpack_skip_value(ctx);
+          if (ctx->err_no != CCPCP_RC_OK) return -1;
+          continue;
         }
-      if (ctx->item.type==CCPCP_ITEM_CONTAINER_END) return (ctx->current - ctx->start);
+
+      /* Value */
 
       cchainpack_unpack_next(ctx);
       if (ctx->err_no != CCPCP_RC_OK) return -1;
 
-      if (ctx->item.type == CCPCP_ITEM_INT)
+      if ((ctx->item.type == CCPCP_ITEM_INT) || (ctx->item.type == CCPCP_ITEM_UINT))
         {
-          if (i == TAG_REQUEST_ID)
+          if (tag == TAG_CALLER_IDS)
             {
-              *rid = ctx->item.as.Int;
+              if (shv_rpc_head_add_cid(shv_ctx) < 0)
+                {
+                  return -1;
+                }
             }
-
-          if (i == TAG_CALLER_IDS)
+          else if (tag == TAG_REQUEST_ID)
             {
-              shv_ctx->cid_cnt = 1;
-
-              /* Allocate memory for CIDs */
-
-              int ret = cid_alloc(shv_ctx);
-              if (ret < 0)
+              if (shv_unpack_int_item(ctx, &head->rid) < 0)
                 {
-                  printf("ERROR: Memory allocation for CID failed\n");
-                  exit(-1);
+                  return -1;
                 }
-
-              shv_ctx->cid_ptr[0] = ctx->item.as.Int;
             }
-        }
-      if (ctx->item.type == CCPCP_ITEM_UINT)
-        {
-          if (i == TAG_CALLER_IDS)
+          else if (tag == TAG_ACCESS_LEVEL)
             {
-              shv_ctx->cid_cnt = 1;
-
-              /* Allocate memory for CIDs */
-
-              int ret = cid_alloc(shv_ctx);
-              if (ret < 0)
+              if (shv_unpack_int_item(ctx, &head->access_level) < 0)
                 {
-                  printf("ERROR: Memory allocation for CID failed\n");
-                  exit(-1);
+                  return -1;
                 }
-
-              shv_ctx->cid_ptr[0] = ctx->item.as.UInt;
             }
         }
-      if ((ctx->item.type == CCPCP_ITEM_MAP) ||
-          (ctx->item.type == CCPCP_ITEM_IMAP))
-        {
-          if (shv_unpack_discard(shv_ctx) < 0)
-             return -1;
-        }
-      else if (ctx->item.type == CCPCP_ITEM_LIST)
+      else if (ctx->item.type == CCPCP_ITEM_LIST && tag == TAG_CALLER_IDS)
         {
-          if (i != TAG_CALLER_IDS)
+          for (;;)
             {
-              shv_ctx->cid_cnt = 0;
-              do
+              cchainpack_unpack_next(ctx);
+              if (ctx->err_no != CCPCP_RC_OK) return -1;
+              if (ctx->item.type == CCPCP_ITEM_CONTAINER_END)
+                {
+                  break;
+                }
+              else if ((ctx->item.type == CCPCP_ITEM_INT) ||
+                       (ctx->item.type == CCPCP_ITEM_UINT))
                 {
-                  cchainpack_unpack_next(ctx);
-                  if (ctx->err_no != CCPCP_RC_OK) return -1;
-                  if ((ctx->item.type == CCPCP_ITEM_INT) ||
-                      (ctx->item.type == CCPCP_ITEM_UINT))
+                  if (shv_rpc_head_add_cid(shv_ctx) < 0)
                     {
-                      int ret;
-                      shv_ctx->cid_cnt += 1;
-
-                      /* Allocate memory for CIDs */
-
-                      ret = cid_alloc(shv_ctx);
-                      if (ret < 0)
-                        {
-                          printf("ERROR: Memory allocation for CID failed\n");
-                          exit(-1);
-                        }
-
-                      if (ctx->item.type == CCPCP_ITEM_INT)
-                        {
-                          shv_ctx->cid_ptr[shv_ctx->cid_cnt - 1] = ctx->item.as.Int;
-                        }
-                      else
-                        {
-                          shv_ctx->cid_ptr[shv_ctx->cid_cnt - 1] = ctx->item.as.UInt;
-                        }
+                      return -1;
                     }
-	        }
-              while (ctx->item.type != CCPCP_ITEM_CONTAINER_END);
-            }
-          else
-            {
-              if (shv_unpack_discard(shv_ctx) < 0)
-                return -1;
+                }
+              else if (shv_unpack_discard(shv_ctx) < 0)
+                {
+                  return -1;
+                }
             }
         }
       else if (ctx->item.type == CCPCP_ITEM_STRING)
         {
-          /* If Tag is PATH (9) */
-
-          if (i == TAG_SHV_PATH)
+          if (tag == TAG_SHV_PATH)
             {
-              /* Save path to path string */
-
-              if (ctx->item.as.String.string_size < SHV_PATH_LEN)
-                {
-                  strncpy(path,ctx->item.as.String.chunk_start,
-                          ctx->item.as.String.string_size);
-                  path[ctx->item.as.String.string_size] = 0;
-                }
-              else
+              ret = shv_rpc_head_str(shv_ctx, &head->path, &head->path_len,
+                                     head->path_buf, sizeof(head->path_buf));
+              if (ret < 0)
                 {
-                  char error_msg[80];
-                  sprintf(error_msg, "Requested PATH is too long.");
-                  shv_send_error(shv_ctx, *rid, SHV_RE_METHOD_CALL_EXCEPTION, error_msg);
+                  too_long = "Requested PATH is too long.";
                 }
             }
-
-          /* If Tag is METHOD (10) */
-
-          if (i == TAG_METHOD)
+          else if (tag == TAG_METHOD)
             {
-              /* Save method name to method string */
-
-              if (ctx->item.as.String.string_size < SHV_MET_LEN)
-                {
-                  strncpy(method,ctx->item.as.String.chunk_start,
-                          ctx->item.as.String.string_size);
-                  method[ctx->item.as.String.string_size] = 0;
-                }
-              else
+              ret = shv_rpc_head_str(shv_ctx, &head->method, &head->method_len,
+                                     head->method_buf, sizeof(head->method_buf));
+              if (ret < 0)
                 {
-                  char error_msg[80];
-                  sprintf(error_msg, "Requested METHOD is too long.");
-                  shv_send_error(shv_ctx, *rid, SHV_RE_METHOD_CALL_EXCEPTION, error_msg);
+                  too_long = "Requested METHOD is too long.";
                 }
             }
-        }
-    } while (ctx->err_no == CCPCP_RC_OK);
+          else if (tag == TAG_ACCESS)
+            {
+              shv_rpc_head_str(shv_ctx, &head->access, &head->access_len,
+                               head->access_buf, sizeof(head->access_buf));
+            }
+          else
+            {
+              shv_rpc_head_str(shv_ctx, &head->user_id, &head->user_id_len,
+                               head->user_id_buf, sizeof(head->user_id_buf));
+            }
 
-  return 1;
+          if (ctx->err_no != CCPCP_RC_OK) return -1;
+        }
+      else if (shv_unpack_discard(shv_ctx) < 0)
+        {
+          return -1;
+        }
+    }
 }
 
 /****************************************************************************
@@ -311,8 +530,27 @@ int shv_unpack_data(ccpcp_unpack_context * ctx, int * v, double * d)
                    (ctx->item.type == CCPCP_ITEM_META) ||
                    (ctx->item.type == CCPCP_ITEM_MAP)  ||
                    (ctx->item.type == CCPCP_ITEM_IMAP)) {
-            l++;
+            if (l >= 1)
+              {
+                /* Only the values directly in the top level containers
+                 * are of interest, jump over the nested ones.
+                 */
+
+                cchainpack_skip_container_levels(ctx, 1);
+                if (ctx->err_no != CCPCP_RC_OK) {
+                    return -1;
+                }
+              }
+            else
+              {
+                l++;
+              }
         }
+        else if ((ctx->item.type == CCPCP_ITEM_STRING) ||
+                 (ctx->item.type == CCPCP_ITEM_BLOB))
+          {
+            cchainpack_skip_string_rest(ctx);
+          }
         else
           {
             if (l == 1)
@@ -358,335 +596,1013 @@ int shv_unpack_data(ccpcp_unpack_context * ctx, int * v, double * d)
 }
 
 /****************************************************************************
- * Name: shv_process_input
+ * Name: shv_com_set_rx_buf_size
  *
  * Description:
- *   Read the message from the broker.
+ *   Allocate the receive ring buffer.
  *
  ****************************************************************************/
 
-int shv_process_input(struct shv_con_ctx * shv_ctx)
+int shv_com_set_rx_buf_size(struct shv_con_ctx *shv_ctx, size_t size)
 {
-  int i;
-  int j;
-  char met[SHV_MET_LEN];
-  char path[SHV_PATH_LEN];
-
-  struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+  char *buf;
 
-  i = shv_ctx->connection->tops.read(shv_ctx->connection,
-                                     shv_ctx->shv_rd_data, sizeof(shv_ctx->shv_rd_data));
-
-  if (i > 0)
+  if (shv_ctx->rx_len != 0 || shv_ctx->rx_discard != 0)
     {
-      ccpcp_unpack_context_init(ctx, shv_ctx->shv_rd_data, i,
-                                shv_underrflow_handler, 0);
-
-      while (ctx->current < ctx->end)
-        {
-          /* Get method and path */
-
-          shv_unpack_head(shv_ctx, &j, met, path);
+      return -1;
+    }
 
-          if (met[0] != '\0')
-            {
-              shv_node_process(shv_ctx, j, met, path);
-            }
-          else
-            {
-              /* We received message without specified method -> reply from
-               * server.
-               */
+  if (size < SHV_BUF_LEN)
+    {
+      size = SHV_BUF_LEN;
+    }
 
-              shv_unpack_data(ctx, 0, 0);
-            }
-        }
+  buf = (char *)realloc(shv_ctx->rx_buf, size);
+  if (buf == NULL)
+    {
+      printf("ERROR: Failed to allocate memory for the receive buffer\n");
+      return -1;
     }
 
-  return i;
+  shv_ctx->rx_buf = buf;
+  shv_ctx->rx_size = size;
+  shv_ctx->rx_rd = 0;
+  return 0;
 }
 
-
 /****************************************************************************
- * Name: shv_send_ping
+ * Name: shv_com_set_buf_pool
  *
  * Description:
- *   Send integer to the broker.
+ *   Replace the message buffer pool.
  *
  ****************************************************************************/
 
-void shv_send_ping(struct shv_con_ctx *shv_ctx)
+int shv_com_set_buf_pool(struct shv_con_ctx *shv_ctx, size_t size, int count,
+                         size_t max_size)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx, shv_ctx->shv_data, SHV_BUF_LEN,
-                          shv_overflow_handler);
+  struct shv_buf_pool pool;
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  if (size < SHV_BUF_POOL_MIN_SIZE)
     {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
-
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+      size = SHV_BUF_POOL_MIN_SIZE;
+    }
 
-      shv_pack_head_request(shv_ctx, "ping", ".broker/app");
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
+  if (shv_buf_pool_init(&pool, size, count, max_size) < 0)
+    {
+      printf("ERROR: Failed to allocate memory for the message buffers\n");
+      return -1;
     }
 
-  shv_ctx->rid += 1;
+  shv_buf_pool_put(&shv_ctx->buf_pool, shv_ctx->shv_data, shv_ctx->shv_data_len);
+  shv_buf_pool_put(&shv_ctx->buf_pool, shv_ctx->tx_buf, shv_ctx->tx_size);
+  shv_buf_pool_destroy(&shv_ctx->buf_pool);
+  shv_ctx->buf_pool = pool;
+
+  /* Both buffers are kept until the next change, the transmit queue
+   * only if the pool has one more.
+   */
+
+  shv_ctx->shv_data = (char *)shv_buf_pool_get(&shv_ctx->buf_pool);
+  shv_ctx->shv_data_len = size;
+  shv_ctx->tx_buf = pool.count > 1 ? (char *)shv_buf_pool_get(&shv_ctx->buf_pool) : NULL;
+  shv_ctx->tx_size = shv_ctx->tx_buf != NULL ? size : 0;
+  shv_ctx->tx_len = 0;
+  shv_ctx->tx_iovcnt = 0;
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_com_set_path_index
+ *
+ * Description:
+ *   Replace the path index by the one of the root.
+ *
+ ****************************************************************************/
+
+int shv_com_set_path_index(struct shv_con_ctx *shv_ctx, size_t capacity)
+{
+  struct shv_path_index *index = NULL;
+
+  if (capacity > 0 && shv_ctx->root != NULL)
+    {
+      index = shv_path_index_get(shv_ctx->root, capacity);
+      if (index == NULL)
+        {
+          printf("ERROR: Failed to allocate memory for the path index\n");
+          return -1;
+        }
+    }
+
+  shv_path_index_put(shv_ctx->path_index);
+  shv_ctx->path_index = index;
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_com_set_vnode_scratch
+ *
+ * Description:
+ *   Replace the memory virtual nodes are resolved to.
+ *
+ ****************************************************************************/
+
+int shv_com_set_vnode_scratch(struct shv_con_ctx *shv_ctx, size_t size)
+{
+  char *buf = NULL;
+
+  if (size > 0)
+    {
+      buf = (char *)malloc(size);
+      if (buf == NULL)
+        {
+          printf("ERROR: Failed to allocate memory for the virtual nodes\n");
+          return -1;
+        }
+    }
+
+  free(shv_ctx->vnode_scratch.buf);
+  shv_ctx->vnode_scratch.buf = buf;
+  shv_ctx->vnode_scratch.size = size;
+  shv_ctx->vnode_scratch.used = 0;
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_com_tx_congested
+ *
+ * Description:
+ *   Check the room the transport has for the data to be sent. The frames
+ *   queued in tx_buf are handed to the transport first.
+ *
+ ****************************************************************************/
+
+bool shv_com_tx_congested(struct shv_con_ctx *shv_ctx, size_t len)
+{
+  struct shv_connection *connection = shv_ctx->connection;
+
+  if (connection->tops.txroom == NULL)
+    {
+      return false;
+    }
+
+  return connection->tops.txroom(connection) < shv_ctx->tx_len + len;
+}
+
+/****************************************************************************
+ * Name: shv_rx_drop
+ *
+ * Description:
+ *   Remove len bytes from the start of the receive ring buffer.
+ *
+ ****************************************************************************/
+
+static void shv_rx_drop(struct shv_con_ctx *shv_ctx, size_t len)
+{
+  shv_ctx->rx_rd = (shv_ctx->rx_rd + len) % shv_ctx->rx_size;
+  shv_ctx->rx_len -= len;
+  if (shv_ctx->rx_len == 0)
+    {
+      /* Let the next read use the whole buffer */
+
+      shv_ctx->rx_rd = 0;
+    }
+}
+
+/****************************************************************************
+ * Name: shv_rx_frame_len
+ *
+ * Description:
+ *   Decode the length prefix of the frame at the receive buffer start.
+ *   Returns the length of the prefix, 0 if it is not received whole yet
+ *   and -1 if it is malformed.
+ *
+ ****************************************************************************/
+
+static int shv_rx_frame_len(struct shv_con_ctx *shv_ctx, size_t *frame_len)
+{
+  struct ccpcp_unpack_context ctx;
+  char prefix[9];
+  size_t len = shv_ctx->rx_len < sizeof(prefix) ? shv_ctx->rx_len : sizeof(prefix);
+  uint64_t n;
+
+  for (size_t k = 0; k < len; k++)
+    {
+      prefix[k] = shv_ctx->rx_buf[(shv_ctx->rx_rd + k) % shv_ctx->rx_size];
+    }
+
+  ccpcp_unpack_context_init(&ctx, prefix, len, NULL, NULL);
+  n = cchainpack_unpack_uint_data2(&ctx, NULL);
+  if (ctx.err_no == CCPCP_RC_BUFFER_UNDERFLOW && len < sizeof(prefix))
+    {
+      return 0;
+    }
+  else if (ctx.err_no != CCPCP_RC_OK || n > SIZE_MAX / 2)
+    {
+      return -1;
+    }
+
+  *frame_len = n;
+  return ctx.current - ctx.start;
+}
+
+/****************************************************************************
+ * Name: shv_rx_unpack_begin
+ *
+ * Description:
+ *   Start unpacking len bytes at the start of the receive buffer. The part
+ *   wrapped around the buffer end is provided by shv_underrflow_handler().
+ *
+ ****************************************************************************/
+
+static void shv_rx_unpack_begin(struct shv_con_ctx *shv_ctx, size_t len)
+{
+  struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+  size_t first = shv_ctx->rx_size - shv_ctx->rx_rd;
+
+  if (first > len)
+    {
+      first = len;
+    }
+
+  shv_ctx->rx_wrap_len = len - first;
+  ccpcp_unpack_context_init(ctx, shv_ctx->rx_buf + shv_ctx->rx_rd, first,
+                            shv_underrflow_handler, 0);
+
+  /* Strings and blobs (file node writes) are referenced directly
+   * in rx_buf, they are consumed before the frame is dropped.
+   */
+
+  ctx->zero_copy_strings = true;
+}
+
+/****************************************************************************
+ * Name: shv_rx_refuse_frame
+ *
+ * Description:
+ *   Reply with an error to the request in the frame of len bytes, which
+ *   does not fit the receive buffer. The head is decoded from the part
+ *   of the frame that fills the buffer.
+ *
+ ****************************************************************************/
+
+static void shv_rx_refuse_frame(struct shv_con_ctx *shv_ctx, size_t len)
+{
+  struct shv_rpc_head *head = &shv_ctx->rpc_head;
+  char msg[80];
+
+  printf("ERROR: Frame of %zu bytes does not fit the receive buffer, dropped\n",
+         len);
+
+  shv_rx_unpack_begin(shv_ctx, shv_ctx->rx_len);
+  if (shv_unpack_rpc_head(shv_ctx, head) < 0 || head->method_len == 0 ||
+      head->rid < 0)
+    {
+      return;
+    }
+
+  snprintf(msg, sizeof(msg), "Message of %zu bytes exceeds the limit of %zu bytes.",
+           len, shv_ctx->rx_size);
+  shv_send_error(shv_ctx, head->rid, SHV_RE_INVALID_PARAMS, msg);
+}
+
+/****************************************************************************
+ * Name: shv_rx_process_frame
+ *
+ * Description:
+ *   Process the frame of len bytes, length prefix included, at the start
+ *   of the receive buffer.
+ *
+ ****************************************************************************/
+
+static void shv_rx_process_frame(struct shv_con_ctx *shv_ctx, size_t len)
+{
+  struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+  struct shv_rpc_head *head = &shv_ctx->rpc_head;
+
+  shv_rx_unpack_begin(shv_ctx, len);
+
+  /* Get method and path */
+
+  if (shv_unpack_rpc_head(shv_ctx, head) < 0)
+    {
+      return;
+    }
+
+  if (head->method_len != 0)
+    {
+      shv_node_process_head(shv_ctx, head);
+    }
+  else
+    {
+      /* We received message without specified method -> reply from
+       * server.
+       */
+
+      shv_unpack_data(ctx, 0, 0);
+    }
+}
+
+/****************************************************************************
+ * Name: shv_process_input
+ *
+ * Description:
+ *   Read the data from the broker and process all complete messages.
+ *   Incomplete message is kept in the receive buffer until the rest
+ *   of it is read. Replies are sent together after the last message.
+ *
+ ****************************************************************************/
+
+int shv_process_input(struct shv_con_ctx * shv_ctx)
+{
+  int i;
+  int prefix_len;
+  size_t frame_len;
+  size_t wr;
+  size_t room;
+
+  if (shv_ctx->rx_buf == NULL && shv_com_set_rx_buf_size(shv_ctx, SHV_RX_BUF_LEN) < 0)
+    {
+      return -1;
+    }
+
+  /* Read as much as fits the contiguous free space */
+
+  shv_rpc_head_pin(shv_ctx);
+  wr = (shv_ctx->rx_rd + shv_ctx->rx_len) % shv_ctx->rx_size;
+  room = shv_ctx->rx_size - shv_ctx->rx_len;
+  if (room > shv_ctx->rx_size - wr)
+    {
+      room = shv_ctx->rx_size - wr;
+    }
+
+  i = shv_ctx->connection->tops.read(shv_ctx->connection, shv_ctx->rx_buf + wr, room);
+  if (i <= 0)
+    {
+      return i;
+    }
+
+  shv_ctx->rx_len += i;
+
+  /* Queue the replies and send them together once the batch is done */
+
+  shv_ctx->tx_batch = shv_ctx->tx_buf != NULL;
+
+  while (shv_ctx->rx_len > 0)
+    {
+      if (shv_ctx->rx_discard > 0)
+        {
+          size_t len = shv_ctx->rx_discard < shv_ctx->rx_len ?
+                       shv_ctx->rx_discard : shv_ctx->rx_len;
+          shv_ctx->rx_discard -= len;
+          shv_rx_drop(shv_ctx, len);
+          continue;
+        }
+
+      prefix_len = shv_rx_frame_len(shv_ctx, &frame_len);
+      if (prefix_len == 0)
+        {
+          break;
+        }
+      else if (prefix_len < 0)
+        {
+          /* The framing is lost, nothing received can be trusted */
+
+          printf("ERROR: Malformed frame length, received data dropped\n");
+          shv_rx_drop(shv_ctx, shv_ctx->rx_len);
+          break;
+        }
+
+      frame_len += prefix_len;
+      if (frame_len > shv_ctx->rx_size)
+        {
+          if (shv_ctx->rx_len < shv_ctx->rx_size)
+            {
+              /* Fill the buffer to have the head of the frame refused */
+
+              break;
+            }
+
+          shv_rx_refuse_frame(shv_ctx, frame_len);
+          shv_ctx->rx_discard = frame_len;
+          continue;
+        }
+      else if (frame_len > shv_ctx->rx_len)
+        {
+          /* Wait for the rest of the frame */
+
+          break;
+        }
+
+      shv_rx_process_frame(shv_ctx, frame_len);
+      shv_rx_drop(shv_ctx, frame_len);
+    }
+
+  /* The messages submitted and changes marked meanwhile go out
+   * with the replies
+   */
+
+  shv_com_send_submitted(shv_ctx);
+  shv_chng_flush(shv_ctx);
+
+  shv_ctx->tx_batch = false;
+  shv_com_flush(shv_ctx);
+  return i;
+}
+
+/****************************************************************************
+ * Name: shv_com_submit
+ *
+ * Description:
+ *   Queue the message for the communication thread and wake it.
+ *
+ ****************************************************************************/
+
+void shv_com_submit(struct shv_con_ctx *shv_ctx, struct shv_txq_msg *msg)
+{
+  if (shv_txq_push(&shv_ctx->txq, msg))
+    {
+      shv_process_wake(shv_ctx);
+    }
+}
+
+/****************************************************************************
+ * Name: shv_com_send_submitted
+ *
+ * Description:
+ *   Send the submitted messages together.
+ *
+ ****************************************************************************/
+
+int shv_com_send_submitted(struct shv_con_ctx *shv_ctx)
+{
+  struct shv_txq_msg *msg;
+  bool batch;
+  int cnt = 0;
+
+  shv_txq_pop_begin(&shv_ctx->txq);
+
+  batch = shv_ctx->tx_batch;
+  shv_ctx->tx_batch = shv_ctx->tx_buf != NULL;
+
+  while ((msg = shv_txq_pop(&shv_ctx->txq)) != NULL)
+    {
+      /* Keep the rest queued until the transport sends what it has */
+
+      if (shv_com_tx_congested(shv_ctx, msg->send != NULL ? SHV_BUF_LEN :
+                               cchainpack_packed_size_uint_data(msg->len) + msg->len))
+        {
+          shv_txq_unpop(&shv_ctx->txq, msg);
+          break;
+        }
+
+      if (msg->send != NULL)
+        {
+          msg->send(shv_ctx, msg);
+        }
+      else
+        {
+          shv_pack_frame_begin_sized(shv_ctx, msg->len);
+          do
+            {
+              ccpcp_pack_copy_bytes(&shv_ctx->pack_ctx, msg->data, msg->len);
+            }
+          while (shv_pack_frame_end(shv_ctx));
+        }
+
+      if (msg->release != NULL)
+        {
+          msg->release(msg);
+        }
+
+      cnt++;
+    }
+
+  shv_ctx->tx_batch = batch;
+  if (!batch)
+    {
+      shv_com_flush(shv_ctx);
+    }
+
+  return cnt;
+}
+
+/****************************************************************************
+ * Name: shv_send_ping
+ *
+ * Description:
+ *   Send integer to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_ping(struct shv_con_ctx *shv_ctx)
+{
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+      shv_pack_head_request(shv_ctx, "ping", ".broker/app");
+      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+
+  shv_ctx->rid += 1;
+}
+
+/****************************************************************************
+ * Name: shv_send_int
+ *
+ * Description:
+ *   Send integer to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_int(struct shv_con_ctx *shv_ctx, int rid, int num)
+{
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+      shv_pack_head_reply(shv_ctx, rid);
+
+      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, num);
+      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+}
+
+void shv_send_uint(struct shv_con_ctx *shv_ctx, int rid, unsigned int num)
+{
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+      shv_pack_head_reply(shv_ctx, rid);
+
+      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+      cchainpack_pack_uint(&shv_ctx->pack_ctx, num);
+      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+}
+
+/****************************************************************************
+ * Name: shv_send_int64
+ *
+ * Description:
+ *   Send 64 bit integer to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_int64(struct shv_con_ctx *shv_ctx, int rid, int64_t num)
+{
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+      shv_pack_head_reply(shv_ctx, rid);
+
+      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, num);
+      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+}
+
+/****************************************************************************
+ * Name: shv_send_bool
+ *
+ * Description:
+ *   Send boolean to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_bool(struct shv_con_ctx *shv_ctx, int rid, bool val)
+{
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+      shv_pack_head_reply(shv_ctx, rid);
+
+      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+      cchainpack_pack_boolean(&shv_ctx->pack_ctx, val);
+      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+}
+
+/****************************************************************************
+ * Name: shv_send_double
+ *
+ * Description:
+ *   Send double to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_double(struct shv_con_ctx *shv_ctx, int rid, double num)
+{
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+      shv_pack_head_reply(shv_ctx, rid);
+
+      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+      cchainpack_pack_double(&shv_ctx->pack_ctx, num);
+      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+}
+
+/****************************************************************************
+ * Name: shv_send_str
+ *
+ * Description:
+ *   Send string to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_str(struct shv_con_ctx *shv_ctx, int rid, const char *str)
+{
+  shv_pack_frame_begin(shv_ctx);
+
+  do
+    {
+      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+      shv_pack_head_reply(shv_ctx, rid);
+
+      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+      cchainpack_pack_string(&shv_ctx->pack_ctx, str, strlen(str));
+      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    }
+  while (shv_pack_frame_end(shv_ctx));
+}
+
+void shv_send_empty_response(struct shv_con_ctx *shv_ctx, int rid)
+{
+    shv_pack_frame_begin(shv_ctx);
+
+    do {
+        cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+        shv_pack_head_reply(shv_ctx, rid);
+
+        /* Empty IMap */
+        cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+        cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+    } while (shv_pack_frame_end(shv_ctx));
+}
+
+/****************************************************************************
+ * Name: shv_send_str_list
+ *
+ * Description:
+ *   Send list of strings to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_str_list(struct shv_con_ctx *shv_ctx, int rid, int num_str,
+                       const char **str)
+{
+  cchainpack_size_builder b;
+
+  cchainpack_size_builder_init(&b);
+  cchainpack_size_add_uint_data(&b, 1);
+  b.size += shv_head_reply_packed_size(shv_ctx, rid);
+  cchainpack_size_add_imap_begin(&b);
+  cchainpack_size_add_int(&b, 2);
+  cchainpack_size_add_list_begin(&b);
+  for (int i = 0; i < num_str; i++)
+    {
+      cchainpack_size_add_string(&b, strlen(str[i]));
+    }
+
+  cchainpack_size_add_container_end(&b);
+  cchainpack_size_add_container_end(&b);
+
+  shv_pack_frame_begin_sized(shv_ctx, b.size);
+
+  cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+  shv_pack_head_reply(shv_ctx, rid);
+
+  cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+  cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+  cchainpack_pack_list_begin(&shv_ctx->pack_ctx);
+  for (int i = 0; i < num_str; i++)
+    {
+      cchainpack_pack_string(&shv_ctx->pack_ctx,str[i], strlen(str[i]));
+    }
+
+  cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+  cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+
+  shv_pack_frame_end(shv_ctx);
 }
 
 /****************************************************************************
- * Name: shv_send_int
+ * Name: shv_str_list_it_get
  *
  * Description:
- *   Send integer to the broker.
+ *   Get the next string from the iterator, the empty string once
+ *   the iterator runs out of them.
  *
  ****************************************************************************/
 
-void shv_send_int(struct shv_con_ctx *shv_ctx, int rid, int num)
+static const char *shv_str_list_it_get(struct shv_str_list_it *str_it,
+                                       int *first_next_over)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx, shv_ctx->shv_data, SHV_BUF_LEN,
-                          shv_overflow_handler);
+  const char *str = NULL;
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  if (*first_next_over >= 0)
     {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
+      str = str_it->get_next_entry(str_it, *first_next_over);
+      *first_next_over = str != NULL ? 0 : -1;
+    }
 
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+  return str != NULL ? str : "";
+}
 
-      shv_pack_head_reply(shv_ctx, rid);
+/****************************************************************************
+ * Name: shv_str_list_it_size_add
+ *
+ * Description:
+ *   Add the packed size of the list of strings provided by the iterator.
+ *
+ ****************************************************************************/
 
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, num);
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
+static void shv_str_list_it_size_add(cchainpack_size_builder *b, int num_str,
+                                     struct shv_str_list_it *str_it)
+{
+  int first_next_over = 1;
+
+  cchainpack_size_add_list_begin(b);
+  for (int i = 0; i < num_str; i++)
+    {
+      cchainpack_size_add_string(b, strlen(shv_str_list_it_get(str_it, &first_next_over)));
     }
+
+  cchainpack_size_add_container_end(b);
 }
 
-void shv_send_uint(struct shv_con_ctx *shv_ctx, int rid, unsigned int num)
+/****************************************************************************
+ * Name: shv_str_list_it_pack
+ *
+ * Description:
+ *   Pack the list of strings provided by the iterator.
+ *
+ ****************************************************************************/
+
+static void shv_str_list_it_pack(ccpcp_pack_context *pack_ctx, int num_str,
+                                 struct shv_str_list_it *str_it)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx, shv_ctx->shv_data, SHV_BUF_LEN,
-                          shv_overflow_handler);
+  int first_next_over = 1;
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  cchainpack_pack_list_begin(pack_ctx);
+  for (int i = 0; i < num_str; i++)
     {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
-
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
-
-      shv_pack_head_reply(shv_ctx, rid);
+      const char *str = shv_str_list_it_get(str_it, &first_next_over);
 
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-      cchainpack_pack_uint(&shv_ctx->pack_ctx, num);
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
+      cchainpack_pack_string(pack_ctx, str, strlen(str));
     }
+
+  cchainpack_pack_container_end(pack_ctx);
 }
 
 /****************************************************************************
- * Name: shv_send_double
+ * Name: shv_send_str_list_it
  *
  * Description:
- *   Send double to the broker.
+ *   Send list of strings to the broker.
+ *   This variant uses iterator to access strigs provided by other source.
  *
  ****************************************************************************/
 
-void shv_send_double(struct shv_con_ctx *shv_ctx, int rid, double num)
+void shv_send_str_list_it(struct shv_con_ctx *shv_ctx, int rid, int num_str,
+                          struct shv_str_list_it *str_it)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data,
-                          SHV_BUF_LEN,shv_overflow_handler);
+  cchainpack_size_builder b;
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
-    {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
+  /* The first pass only sums the string lengths, the second packs them */
 
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+  cchainpack_size_builder_init(&b);
+  cchainpack_size_add_uint_data(&b, 1);
+  b.size += shv_head_reply_packed_size(shv_ctx, rid);
+  cchainpack_size_add_imap_begin(&b);
+  cchainpack_size_add_int(&b, 2);
+  shv_str_list_it_size_add(&b, num_str, str_it);
+  cchainpack_size_add_container_end(&b);
 
-      shv_pack_head_reply(shv_ctx, rid);
+  shv_pack_frame_begin_sized(shv_ctx, b.size);
 
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-      cchainpack_pack_double(&shv_ctx->pack_ctx, num);
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
-    }
+  cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+  shv_pack_head_reply(shv_ctx, rid);
+
+  cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+  cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+  shv_str_list_it_pack(&shv_ctx->pack_ctx, num_str, str_it);
+  cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+
+  shv_pack_frame_end(shv_ctx);
 }
 
 /****************************************************************************
- * Name: shv_send_str
+ * Name: shv_dir_res_array_get
  *
  * Description:
- *   Send string to the broker.
+ *   Get the i-th dir result from an array of them.
  *
  ****************************************************************************/
 
-void shv_send_str(struct shv_con_ctx *shv_ctx, int rid, const char *str)
+static void shv_dir_res_array_get(const void *src, int i, struct shv_dir_res *res)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data, SHV_BUF_LEN,
-                          shv_overflow_handler);
-
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
-    {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
+  *res = ((const struct shv_dir_res *)src)[i];
+}
 
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+/****************************************************************************
+ * Name: shv_dir_res_dmap_get
+ *
+ * Description:
+ *   Get the dir result describing the i-th method of a node.
+ *
+ ****************************************************************************/
 
-      shv_pack_head_reply(shv_ctx, rid);
+static void shv_dir_res_dmap_get(const void *src, int i, struct shv_dir_res *res)
+{
+  const struct shv_method_des *met = shv_dmap_at((struct shv_dmap *)src, i);
 
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-      cchainpack_pack_string(&shv_ctx->pack_ctx, str, strlen(str));
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
-    }
+  res->name = met->name;
+  res->flags = met->flags;
+  res->param = met->param;
+  res->result = met->result;
+  res->access = met->access;
 }
 
-void shv_send_empty_response(struct shv_con_ctx *shv_ctx, int rid)
+/****************************************************************************
+ * Name: shv_dir_list_size_add
+ *
+ * Description:
+ *   Add the packed size of the dir results provided one by one by get.
+ *
+ ****************************************************************************/
+
+static void shv_dir_list_size_add(cchainpack_size_builder *b,
+                                  void (*get)(const void *src, int i, struct shv_dir_res *res),
+                                  const void *src, int cnt)
 {
-    ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data, SHV_BUF_LEN,
-                            shv_overflow_handler);
+  struct shv_dir_res res;
 
-    for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++) {
-        if (shv_ctx->shv_send) {
-            cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
+  cchainpack_size_add_list_begin(b);
+  for (int i = 0; i < cnt; i++)
+    {
+      const struct shv_dir_res *result = &res;
+      get(src, i, &res);
+      cchainpack_size_add_imap_begin(b);
+      cchainpack_size_add_int(b, 1);
+      cchainpack_size_add_string(b, strlen(result->name));
+      if (result->flags != 0)
+        {
+          cchainpack_size_add_int(b, 2);
+          cchainpack_size_add_int(b, result->flags);
         }
 
-        shv_ctx->shv_len = 0;
-        cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+      if (result->param)
+        {
+          cchainpack_size_add_int(b, 3);
+          cchainpack_size_add_string(b, strlen(result->param));
+        }
 
-        shv_pack_head_reply(shv_ctx, rid);
+      if (result->result)
+        {
+          cchainpack_size_add_int(b, 4);
+          cchainpack_size_add_string(b, strlen(result->result));
+        }
 
-        /* Empty IMap */
-        cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-        cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+      if (result->access != 0)
+        {
+          cchainpack_size_add_int(b, 5);
+          cchainpack_size_add_int(b, result->access);
+        }
 
-        shv_overflow_handler(&shv_ctx->pack_ctx, 0);
+      cchainpack_size_add_container_end(b);
     }
+
+  cchainpack_size_add_container_end(b);
 }
 
 /****************************************************************************
- * Name: shv_send_str_list
+ * Name: shv_dir_list_pack
  *
  * Description:
- *   Send list of strings to the broker.
+ *   Pack the dir results provided one by one by get.
  *
  ****************************************************************************/
 
-void shv_send_str_list(struct shv_con_ctx *shv_ctx, int rid, int num_str,
-                       const char **str)
+static void shv_dir_list_pack(ccpcp_pack_context *pack_ctx,
+                              void (*get)(const void *src, int i, struct shv_dir_res *res),
+                              const void *src, int cnt)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data, SHV_BUF_LEN,
-                          shv_overflow_handler);
+  struct shv_dir_res res;
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  cchainpack_pack_list_begin(pack_ctx);
+  for (int i = 0; i < cnt; i++)
     {
-      if (shv_ctx->shv_send)
+      const struct shv_dir_res *result = &res;
+      get(src, i, &res);
+      cchainpack_pack_imap_begin(pack_ctx);
+      cchainpack_pack_int(pack_ctx, 1);
+      cchainpack_pack_string(pack_ctx, result->name,
+        strlen(result->name));
+      if (result->flags != 0)
         {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
+          cchainpack_pack_int(pack_ctx, 2);
+          cchainpack_pack_int(pack_ctx, result->flags);
         }
 
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+      if (result->param)
+        {
+          cchainpack_pack_int(pack_ctx, 3);
+          cchainpack_pack_string(pack_ctx, result->param,
+            strlen(result->param));
+        }
 
-      shv_pack_head_reply(shv_ctx, rid);
+      if (result->result)
+        {
+          cchainpack_pack_int(pack_ctx, 4);
+          cchainpack_pack_string(pack_ctx, result->result,
+            strlen(result->result));
+        }
 
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-      cchainpack_pack_list_begin(&shv_ctx->pack_ctx);
-      for (int i = 0; i < num_str; i++)
+      if (result->access != 0)
         {
-          cchainpack_pack_string(&shv_ctx->pack_ctx,str[i], strlen(str[i]));
+          cchainpack_pack_int(pack_ctx, 5);
+          cchainpack_pack_int(pack_ctx, result->access);
         }
 
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
+      cchainpack_pack_container_end(pack_ctx);
     }
+
+  cchainpack_pack_container_end(pack_ctx);
 }
 
 /****************************************************************************
- * Name: shv_send_str_list_it
+ * Name: shv_send_dir_src
  *
  * Description:
- *   Send list of strings to the broker.
- *   This variant uses iterator to access strigs provided by other source.
+ *   Send response to dir call to the broker, the results are provided
+ *   one by one by get.
  *
  ****************************************************************************/
 
-void shv_send_str_list_it(struct shv_con_ctx *shv_ctx, int rid, int num_str,
-                          struct shv_str_list_it *str_it)
+static void shv_send_dir_src(struct shv_con_ctx *shv_ctx,
+                             void (*get)(const void *src, int i, struct shv_dir_res *res),
+                             const void *src, int cnt, int rid)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data, SHV_BUF_LEN,
-                          shv_overflow_handler);
+  cchainpack_size_builder b;
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
-    {
-      int first_next_over;
-
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
+  cchainpack_size_builder_init(&b);
+  cchainpack_size_add_uint_data(&b, 1);
+  b.size += shv_head_reply_packed_size(shv_ctx, rid);
+  cchainpack_size_add_imap_begin(&b);
+  cchainpack_size_add_int(&b, 2);
+  shv_dir_list_size_add(&b, get, src, cnt);
+  cchainpack_size_add_container_end(&b);
 
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+  shv_pack_frame_begin_sized(shv_ctx, b.size);
 
-      shv_pack_head_reply(shv_ctx, rid);
+  cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
 
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-      cchainpack_pack_list_begin(&shv_ctx->pack_ctx);
+  shv_pack_head_reply(shv_ctx, rid);
 
-      first_next_over = 1;
-      for (int i = 0; i < num_str; i++)
-        {
-	  const char *str = NULL;
-
-	  if (first_next_over >= 0)
-	    {
-	      str = str_it->get_next_entry(str_it, first_next_over);
-	      if (str != NULL)
-	        {
-                  first_next_over = 0;
-		}
-	      else
-	        {
-                  first_next_over = -1;
-		}
-	    }
-	  if (str == NULL)
-	    {
-	      str = "";
-	    }
-          cchainpack_pack_string(&shv_ctx->pack_ctx, str, strlen(str));
-        }
+  cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+  cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+  shv_dir_list_pack(&shv_ctx->pack_ctx, get, src, cnt);
+  cchainpack_pack_container_end(&shv_ctx->pack_ctx);
 
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
-    }
+  shv_pack_frame_end(shv_ctx);
 }
 
 /****************************************************************************
@@ -700,64 +1616,173 @@ void shv_send_str_list_it(struct shv_con_ctx *shv_ctx, int rid, int num_str,
 void shv_send_dir(struct shv_con_ctx *shv_ctx, const struct shv_dir_res *results,
                   int cnt, int rid)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data, SHV_BUF_LEN,
-                          shv_overflow_handler);
+  shv_send_dir_src(shv_ctx, shv_dir_res_array_get, results, cnt, rid);
+}
+
+/****************************************************************************
+ * Name: shv_send_dir_dmap
+ *
+ * Description:
+ *   Send response to dir call listing the methods of dmap.
+ *
+ ****************************************************************************/
+
+void shv_send_dir_dmap(struct shv_con_ctx *shv_ctx, const struct shv_dmap *dmap, int rid)
+{
+  shv_send_dir_src(shv_ctx, shv_dir_res_dmap_get, dmap, dmap->methods.count, rid);
+}
+
+/****************************************************************************
+ * Name: shv_send_packed_result
+ *
+ * Description:
+ *   Send reply with the result packed in advance to the broker.
+ *
+ ****************************************************************************/
+
+void shv_send_packed_result(struct shv_con_ctx *shv_ctx, int rid,
+                            const struct shv_packed_result *res)
+{
+  cchainpack_size_builder b;
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  cchainpack_size_builder_init(&b);
+  cchainpack_size_add_uint_data(&b, 1);
+  b.size += shv_head_reply_packed_size(shv_ctx, rid);
+  cchainpack_size_add_imap_begin(&b);
+  cchainpack_size_add_int(&b, 2);
+  b.size += res->len;
+  cchainpack_size_add_container_end(&b);
+
+  shv_pack_frame_begin_sized(shv_ctx, b.size);
+
+  cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+
+  shv_pack_head_reply(shv_ctx, rid);
+
+  cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
+  cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
+  ccpcp_pack_copy_bytes(&shv_ctx->pack_ctx, res->data, res->len);
+  cchainpack_pack_container_end(&shv_ctx->pack_ctx);
+
+  shv_pack_frame_end(shv_ctx);
+}
+
+/****************************************************************************
+ * Name: shv_packed_result_alloc
+ *
+ * Description:
+ *   Allocate the result of given length and a pack context filling it.
+ *
+ ****************************************************************************/
+
+static struct shv_packed_result *shv_packed_result_alloc(size_t len,
+                                                         ccpcp_pack_context *pack_ctx)
+{
+  struct shv_packed_result *res = malloc(sizeof(struct shv_packed_result) + len);
+
+  if (res == NULL)
     {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
+      printf("ERROR: Failed to allocate memory for the packed result\n");
+      return NULL;
+    }
 
-      shv_ctx->shv_len = 0;
-      cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
+  atomic_init(&res->refs, 1);
+  res->len = len;
+  ccpcp_pack_context_init(pack_ctx, res->data, len, NULL);
+  return res;
+}
 
-      shv_pack_head_reply(shv_ctx, rid);
+/****************************************************************************
+ * Name: shv_packed_result_put
+ *
+ * Description:
+ *   Drop a reference to the result, free it with the last one.
+ *
+ ****************************************************************************/
 
-      cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-      cchainpack_pack_list_begin(&shv_ctx->pack_ctx);
-      for (int i = 0; i < cnt; i++)
-        {
-          const struct shv_dir_res *result = results + i;
-          cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
-          cchainpack_pack_int(&shv_ctx->pack_ctx, 1);
-          cchainpack_pack_string(&shv_ctx->pack_ctx, result->name,
-            strlen(result->name));
-          if (result->flags != 0)
-            {
-              cchainpack_pack_int(&shv_ctx->pack_ctx, 2);
-              cchainpack_pack_int(&shv_ctx->pack_ctx, result->flags);
-            }
+void shv_packed_result_put(struct shv_packed_result *res)
+{
+  if (res != NULL && atomic_fetch_sub(&res->refs, 1) == 1)
+    {
+      free(res);
+    }
+}
 
-          if (result->param)
-            {
-              cchainpack_pack_int(&shv_ctx->pack_ctx, 3);
-              cchainpack_pack_string(&shv_ctx->pack_ctx, result->param,
-                strlen(result->param));
-            }
+/****************************************************************************
+ * Name: shv_packed_result_check
+ *
+ * Description:
+ *   Check the result was packed as long as expected, free it otherwise.
+ *
+ ****************************************************************************/
 
-          if (result->result)
-            {
-              cchainpack_pack_int(&shv_ctx->pack_ctx, 4);
-              cchainpack_pack_string(&shv_ctx->pack_ctx, result->result,
-                strlen(result->result));
-            }
+static struct shv_packed_result *shv_packed_result_check(struct shv_packed_result *res,
+                                                         ccpcp_pack_context *pack_ctx)
+{
+  if (pack_ctx->err_no != CCPCP_RC_OK ||
+      (size_t)(pack_ctx->current - pack_ctx->start) != res->len)
+    {
+      printf("ERROR: Packed result size mismatch\n");
+      free(res);
+      return NULL;
+    }
 
-          if (result->access != 0)
-            {
-              cchainpack_pack_int(&shv_ctx->pack_ctx, 5);
-              cchainpack_pack_int(&shv_ctx->pack_ctx, result->access);
-            }
+  return res;
+}
 
-          cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-        }
+/****************************************************************************
+ * Name: shv_pack_result_str_list_it
+ *
+ * Description:
+ *   Pack list of strings provided by the iterator as a reply result.
+ *
+ ****************************************************************************/
 
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
+struct shv_packed_result *shv_pack_result_str_list_it(int num_str,
+                                                      struct shv_str_list_it *str_it)
+{
+  struct shv_packed_result *res;
+  ccpcp_pack_context pack_ctx;
+  cchainpack_size_builder b;
+
+  cchainpack_size_builder_init(&b);
+  shv_str_list_it_size_add(&b, num_str, str_it);
+
+  res = shv_packed_result_alloc(b.size, &pack_ctx);
+  if (res == NULL)
+    {
+      return NULL;
+    }
+
+  shv_str_list_it_pack(&pack_ctx, num_str, str_it);
+  return shv_packed_result_check(res, &pack_ctx);
+}
+
+/****************************************************************************
+ * Name: shv_pack_result_dir_dmap
+ *
+ * Description:
+ *   Pack the result of dir call listing the methods of dmap.
+ *
+ ****************************************************************************/
+
+struct shv_packed_result *shv_pack_result_dir_dmap(const struct shv_dmap *dmap)
+{
+  struct shv_packed_result *res;
+  ccpcp_pack_context pack_ctx;
+  cchainpack_size_builder b;
+
+  cchainpack_size_builder_init(&b);
+  shv_dir_list_size_add(&b, shv_dir_res_dmap_get, dmap, dmap->methods.count);
+
+  res = shv_packed_result_alloc(b.size, &pack_ctx);
+  if (res == NULL)
+    {
+      return NULL;
     }
+
+  shv_dir_list_pack(&pack_ctx, shv_dir_res_dmap_get, dmap, dmap->methods.count);
+  return shv_packed_result_check(res, &pack_ctx);
 }
 
 /****************************************************************************
@@ -771,17 +1796,10 @@ void shv_send_dir(struct shv_con_ctx *shv_ctx, const struct shv_dir_res *results
 void shv_send_error(struct shv_con_ctx *shv_ctx, int rid, enum shv_response_error_code code,
                     const char *msg)
 {
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data,
-                          SHV_BUF_LEN, shv_overflow_handler);
+  shv_pack_frame_begin(shv_ctx);
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  do
     {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
-
-      shv_ctx->shv_len = 0;
       cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
       shv_pack_head_reply(shv_ctx, rid);
 
@@ -792,7 +1810,7 @@ void shv_send_error(struct shv_con_ctx *shv_ctx, int rid, enum shv_response_erro
       /* Pack the error number */
       cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
       cchainpack_pack_int(&shv_ctx->pack_ctx, 1);
-      cchainpack_pack_int(&shv_ctx->pack_ctx, TAG_ERROR);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, code);
 
       /* Pack the error message (voluntary) */
       if (msg != NULL) {
@@ -801,67 +1819,38 @@ void shv_send_error(struct shv_con_ctx *shv_ctx, int rid, enum shv_response_erro
       }
       cchainpack_pack_container_end(&shv_ctx->pack_ctx);
       cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
     }
+  while (shv_pack_frame_end(shv_ctx));
 }
 
 /****************************************************************************
- * Name: shv_login
+ * Name: shv_login_hello
  *
  * Description:
- *   Login to SHV broker.
+ *   Check the login credentials are given and send the hello request.
  *
  ****************************************************************************/
 
-int shv_login(struct shv_con_ctx *shv_ctx)
+static int shv_login_hello(struct shv_con_ctx *shv_ctx)
 {
-  int i;
-  int id = 0;
-  const char* shv_broker_user;
-  const char* shv_broker_passw;
-  const char* shv_broker_devid;
-  const char* shv_broker_mount;
   struct shv_connection *connection = shv_ctx->connection;
 
-  shv_broker_user = connection->broker_user;
-  if (CHECK_STR(shv_broker_user))
+  if (CHECK_STR(connection->broker_user))
     {
       printf("Unable to get SHV_BROKER_USER env variable.");
       return -1;
     }
 
-  shv_broker_passw = connection->broker_password;
-  if (CHECK_STR(shv_broker_passw))
+  if (CHECK_STR(connection->broker_password))
     {
       printf("Unable to get SHV_BROKER_PASSWORD env variable.");
       return -1;
     }
 
-  shv_broker_devid = connection->device_id;
-  if (CHECK_STR(shv_broker_devid))
-    {
-      shv_broker_devid = "host";
-    }
-
-  shv_broker_mount = connection->broker_mount;
-  if (CHECK_STR(shv_broker_mount))
-    {
-      shv_broker_mount = "test/host";
-    }
-
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx, shv_ctx->shv_data,
-                          SHV_BUF_LEN, shv_overflow_handler);
+  shv_pack_frame_begin(shv_ctx);
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  do
     {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
-
-      shv_ctx->shv_len = 0;
-
       /* Chainpack */
 
       cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
@@ -891,33 +1880,49 @@ int shv_login(struct shv_con_ctx *shv_ctx)
 
       cchainpack_pack_imap_begin(&shv_ctx->pack_ctx);
       cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
     }
+  while (shv_pack_frame_end(shv_ctx));
 
-  /* Now init message <1:1,8:1,10:"hello">i{} was sent,
-   * wait for reply from server
-   */
+  return 0;
+}
 
-  i = connection->tops.read(connection, shv_ctx->shv_data, sizeof(shv_ctx->shv_data));
-  if (i <= 0)
+/****************************************************************************
+ * Name: shv_login_request
+ *
+ * Description:
+ *   Send the login request, once the hello request is replied.
+ *
+ ****************************************************************************/
+
+static void shv_login_request(struct shv_con_ctx *shv_ctx)
+{
+  const char* shv_broker_user;
+  const char* shv_broker_passw;
+  const char* shv_broker_devid;
+  const char* shv_broker_mount;
+  struct shv_connection *connection = shv_ctx->connection;
+
+  shv_broker_user = connection->broker_user;
+  shv_broker_passw = connection->broker_password;
+
+  shv_broker_devid = connection->device_id;
+  if (CHECK_STR(shv_broker_devid))
     {
-      return i;
+      shv_broker_devid = "host";
+    }
+
+  shv_broker_mount = connection->broker_mount;
+  if (CHECK_STR(shv_broker_mount))
+    {
+      shv_broker_mount = "test/host";
     }
 
   /* Start method "login" */
 
-  ccpcp_pack_context_init(&shv_ctx->pack_ctx, shv_ctx->shv_data,
-                          SHV_BUF_LEN, shv_overflow_handler);
+  shv_pack_frame_begin(shv_ctx);
 
-  for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++)
+  do
     {
-      if (shv_ctx->shv_send)
-        {
-          cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
-
-      shv_ctx->shv_len = 0;
-
       /* Chainpack: 1 */
 
       cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
@@ -989,10 +1994,66 @@ int shv_login(struct shv_con_ctx *shv_ctx)
       cchainpack_pack_container_end(&shv_ctx->pack_ctx);
       cchainpack_pack_container_end(&shv_ctx->pack_ctx);
       cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-      shv_overflow_handler(&shv_ctx->pack_ctx, 0);
-  }
+    }
+  while (shv_pack_frame_end(shv_ctx));
+}
+
+/****************************************************************************
+ * Name: shv_login_read
+ *
+ * Description:
+ *   Read the reply of the broker, wait for it if the transport has none.
+ *
+ ****************************************************************************/
+
+static int shv_login_read(struct shv_con_ctx *shv_ctx)
+{
+  struct shv_connection *connection = shv_ctx->connection;
+  int i;
+
+  while ((i = connection->tops.read(connection, shv_ctx->shv_data,
+                                    shv_ctx->shv_data_len)) < 0 && errno == EAGAIN)
+    {
+      if (connection->tops.dataready(connection, -1) < 0)
+        {
+          return -1;
+        }
+    }
+
+  return i;
+}
+
+/****************************************************************************
+ * Name: shv_login
+ *
+ * Description:
+ *   Login to SHV broker.
+ *
+ ****************************************************************************/
+
+int shv_login(struct shv_con_ctx *shv_ctx)
+{
+  int i;
+  int id = 0;
+
+  if (shv_login_hello(shv_ctx) < 0)
+    {
+      return -1;
+    }
+
+  /* Now init message <1:1,8:1,10:"hello">i{} was sent,
+   * wait for reply from server
+   */
 
-  i = connection->tops.read(connection, shv_ctx->shv_data, sizeof(shv_ctx->shv_data));
+  i = shv_login_read(shv_ctx);
+  if (i <= 0)
+    {
+      return i;
+    }
+
+  shv_login_request(shv_ctx);
+
+  i = shv_login_read(shv_ctx);
   if (i <= 0)
     {
       return i;
@@ -1019,160 +2080,396 @@ void shv_con_ctx_init(struct shv_con_ctx *shv_ctx, struct shv_node *root,
   shv_ctx->rid = 3;
   shv_ctx->connection = connection;
   shv_ctx->at_signlr = at_signlr;
+  shv_txq_init(&shv_ctx->txq);
+}
+
+/**
+ * @brief The wait for the next event of a connection, one half of shv_ctx->timeout (in ms)
+ */
+static inline int shv_process_wait(struct shv_con_ctx *shv_ctx)
+{
+    return (shv_ctx->timeout * 1000) / 2;
+}
+
+/**
+ * @brief Wait to connect again, unless there's a request to end or no reconnects remain
+ *
+ * @param shv_ctx
+ * @param wait
+ * @return 1 to wait, 0 on the request to end, -1 on failure
+ */
+static int shv_process_no_conn(struct shv_con_ctx *shv_ctx, int *wait)
+{
+    shv_ctx->con_state = SHV_CON_NO_CONN;
+    if (!atomic_load(&shv_ctx->running)) {
+        fprintf(stderr, "ERROR: not connected and request to finish\n");
+        return 0;
+    }
+    if ((shv_ctx->connection->reconnect_retries > 0) &&
+        (shv_ctx->reconnects >= shv_ctx->connection->reconnect_retries)) {
+        shv_ctx->err_no = SHV_RECONNECTS;
+        fprintf(stderr, "ERROR: maximum number of reconnects reached!\n");
+        return -1;
+    }
+
+    fprintf(stderr, "ERROR: can't connect to the server! "
+                    "Trying again in %d seconds.\n",
+                    shv_ctx->connection->reconnect_period);
+    *wait = shv_ctx->connection->reconnect_period * 1000;
+    return 1;
+}
+
+/**
+ * @brief Start the login over the connected transport layer
+ *
+ * @param shv_ctx
+ * @param wait
+ * @return 1 to wait for the reply, -1 on failure
+ */
+static int shv_process_login(struct shv_con_ctx *shv_ctx, int *wait)
+{
+    /* Nothing received over the previous connection is valid anymore */
+    shv_ctx->rx_len = 0;
+    shv_ctx->rx_rd = 0;
+    shv_ctx->rx_discard = 0;
+    shv_ctx->tx_len = 0;
+    shv_ctx->tx_iovcnt = 0;
+    shv_ctx->write_err = 0;
+
+    if (shv_login_hello(shv_ctx) < 0) {
+        fprintf(stderr, "ERROR: shv_login() failed, ret = %d\n", -1);
+        shv_ctx->err_no = SHV_LOGIN;
+        shv_ctx->connection->tops.close(shv_ctx->connection);
+        return -1;
+    }
+
+    shv_ctx->con_state = SHV_CON_HELLO;
+    *wait = shv_process_wait(shv_ctx);
+    return 1;
+}
+
+/**
+ * @brief Wait for the transport layer to connect
+ *
+ * @param shv_ctx
+ * @param wait
+ * @return 1 to wait for the transport layer
+ */
+static int shv_process_connecting(struct shv_con_ctx *shv_ctx, int *wait)
+{
+    shv_ctx->con_state = SHV_CON_CONNECTING;
+    *wait = shv_process_wait(shv_ctx);
+    return 1;
+}
+
+/**
+ * @brief Initialize the transport layer and login if connected
+ *
+ * @param shv_ctx
+ * @param wait
+ * @return 1 to wait for the next event, 0 on the request to end, -1 on failure
+ */
+static int shv_process_connect(struct shv_con_ctx *shv_ctx, int *wait)
+{
+    int ret;
+
+    shv_ctx->con_state = SHV_CON_NOT_INIT;
+    ret = shv_ctx->connection->tops.init(shv_ctx->connection);
+    if (ret == -2) {
+        fprintf(stderr, "ERROR: failed to initialize the lowlevel transport layer!\n");
+        shv_ctx->err_no = SHV_TLAYER_INIT;
+        return -1;
+    } else if (ret == -1) {
+        return shv_process_no_conn(shv_ctx, wait);
+    }
+
+    shv_ctx->connects++;
+    if (ret == 1) {
+        return shv_process_connecting(shv_ctx, wait);
+    }
+    return shv_process_login(shv_ctx, wait);
 }
 
 /**
- * @brief Process communication after succesful steps in shv_process
+ * @brief The connection has been terminated, close it and connect again
+ *        if we have enough remaining retries
  *
  * @param shv_ctx
- * @return int
+ * @param wait
+ * @return 1 to wait for the next event, 0 on the request to end, -1 on failure
+ */
+static int shv_process_disconnect(struct shv_con_ctx *shv_ctx, int *wait)
+{
+    if (shv_ctx->con_state == SHV_CON_CONN) {
+        shv_ctx->at_signlr(shv_ctx, SHV_ATTENTION_DISCONNECTED);
+    }
+    shv_ctx->connection->tops.close(shv_ctx->connection);
+    shv_ctx->con_state = SHV_CON_NOT_INIT;
+
+    if (!atomic_load(&shv_ctx->running)) {
+        /* The disconnect actually comes from the user side, no error occured */
+        return 0;
+    }
+
+    fprintf(stderr, "WARNING: we have been disconnected!\n");
+    if ((shv_ctx->connection->reconnect_retries > 0) &&
+        (shv_ctx->reconnects >= shv_ctx->connection->reconnect_retries)) {
+        /* We have no remaining reconnects */
+        shv_ctx->err_no = SHV_RECONNECTS;
+        fprintf(stderr, "ERROR: maximum number of reconnects reached!\n");
+        return -1;
+    }
+
+    return shv_process_connect(shv_ctx, wait);
+}
+
+/**
+ * @brief Process the event while not connected
+ */
+static int shv_process_reconnect(struct shv_con_ctx *shv_ctx, int event, int *wait)
+{
+    int ret;
+
+    if (event != SHV_CON_EV_TIMEOUT) {
+        /* Woken before the reconnect period elapsed */
+        return shv_process_no_conn(shv_ctx, wait);
+    }
+
+    ret = shv_ctx->connection->tops.init(shv_ctx->connection);
+    if (ret == 0) {
+        /* Succesfull connect, go to login */
+        shv_ctx->connects++;
+        return shv_process_login(shv_ctx, wait);
+    } else if (ret == 1) {
+        shv_ctx->connects++;
+        return shv_process_connecting(shv_ctx, wait);
+    } else if (ret == -2) {
+        /* Something bad happened */
+        fprintf(stderr,
+                "ERROR: failed to initialize the lowlevel transport layer!\n");
+        shv_ctx->err_no = SHV_TLAYER_INIT;
+        return -1;
+    }
+
+    /* Another unsuccesful connect */
+    shv_ctx->reconnects += 1;
+    return shv_process_no_conn(shv_ctx, wait);
+}
+
+/**
+ * @brief Process the event while the transport layer connects
  */
-static inline int shv_process_communication(struct shv_con_ctx *shv_ctx)
+static int shv_process_connect_reply(struct shv_con_ctx *shv_ctx, int event, int *wait)
 {
+    struct shv_connection *connection = shv_ctx->connection;
     int ret;
 
-    ret = shv_login(shv_ctx);
-    if (ret < 0) {
+    if (!atomic_load(&shv_ctx->running)) {
+        connection->tops.close(connection);
+        shv_ctx->con_state = SHV_CON_NOT_INIT;
+        return 0;
+    }
+
+    if (event == SHV_CON_EV_TIMEOUT) {
+        /* The server does not answer at all */
+        connection->tops.close(connection);
+        ret = -1;
+    } else {
+        ret = connection->tops.init(connection);
+    }
+
+    if (ret == 0) {
+        return shv_process_login(shv_ctx, wait);
+    } else if (ret == 1) {
+        /* Woken before the connect finished */
+        return shv_process_connecting(shv_ctx, wait);
+    } else if (ret == -2) {
+        fprintf(stderr,
+                "ERROR: failed to initialize the lowlevel transport layer!\n");
+        shv_ctx->err_no = SHV_TLAYER_INIT;
+        return -1;
+    }
+
+    shv_ctx->reconnects += 1;
+    return shv_process_no_conn(shv_ctx, wait);
+}
+
+/**
+ * @brief Process the event while logging in
+ */
+static int shv_process_login_reply(struct shv_con_ctx *shv_ctx, int event, int *wait)
+{
+    struct shv_connection *connection = shv_ctx->connection;
+    int ret = -1;
+
+    if (event == SHV_CON_EV_READ) {
+        ret = connection->tops.read(connection, shv_ctx->shv_data, shv_ctx->shv_data_len);
+        if (ret == 0) {
+            return shv_process_disconnect(shv_ctx, wait);
+        }
+    }
+
+    if (ret < 0 && (event == SHV_CON_EV_ERROR ||
+                    (event == SHV_CON_EV_READ && errno != EAGAIN))) {
         fprintf(stderr, "ERROR: shv_login() failed, ret = %d\n", ret);
         shv_ctx->err_no = SHV_LOGIN;
+        connection->tops.close(connection);
         return -1;
+    } else if (ret < 0) {
+        /* Keep waiting for the reply unless there's a request to end */
+        if (!atomic_load(&shv_ctx->running)) {
+            return shv_process_disconnect(shv_ctx, wait);
+        }
+        *wait = shv_process_wait(shv_ctx);
+        return 1;
     }
-    /* Signal succesful connection */
-    shv_ctx->at_signlr(shv_ctx, SHV_ATTENTION_CONNECTED);
 
-    while (atomic_load(&shv_ctx->running)) {
-        /* Set timemout to one half of shv_ctx->timeout (in ms) */
-        ret = shv_ctx->connection->tops.dataready(shv_ctx->connection,
-                                                  (shv_ctx->timeout * 1000) / 2);
+    if (shv_ctx->con_state == SHV_CON_HELLO) {
+        shv_login_request(shv_ctx);
+        shv_ctx->con_state = SHV_CON_LOGIN;
+    } else {
+        shv_ctx->con_state = SHV_CON_CONN;
 
-        if (ret == 0) {
-            /* Timeout, send ping or if there's request to end, break.
-             * Zero (as a merciful quit) should be returned.
-             */
-            if (!atomic_load(&shv_ctx->running)) {
-                break;
-            }
-            shv_send_ping(shv_ctx);
-        } else if (ret == 1) {
-            /* Data is ready, try to read it from the transport layer.
-             * If zero is returned, it signals no data to be read from the transport
-             * layer, indicating merciful quit. If -1 is returned, it signals
-             * that something bad has happened.
-             */
-            ret = shv_process_input(shv_ctx);
-            if (ret <= 0) {
-                break;
-            }
-        } else {
-            /* Something bad happened during the dataready stage. */
-            break;
+        /* Signal succesful connection */
+        shv_ctx->at_signlr(shv_ctx, SHV_ATTENTION_CONNECTED);
+
+        /* Send what was submitted while disconnected */
+        shv_com_send_submitted(shv_ctx);
+        shv_chng_flush(shv_ctx);
+    }
+
+    *wait = shv_process_wait(shv_ctx);
+    return 1;
+}
+
+/**
+ * @brief Process the event of the logged in connection
+ */
+static int shv_process_communication(struct shv_con_ctx *shv_ctx, int event, int *wait)
+{
+    int ret;
+
+    switch (event) {
+    case SHV_CON_EV_TIMEOUT:
+        /* Timeout, send ping or if there's request to end, disconnect */
+        if (!atomic_load(&shv_ctx->running)) {
+            return shv_process_disconnect(shv_ctx, wait);
+        }
+        shv_send_ping(shv_ctx);
+        break;
+    case SHV_CON_EV_WAKE:
+        /* Woken by shv_process_wake(), to stop or to send the changes */
+        if (!atomic_load(&shv_ctx->running)) {
+            return shv_process_disconnect(shv_ctx, wait);
+        }
+        shv_com_send_submitted(shv_ctx);
+        shv_chng_flush(shv_ctx);
+        break;
+    case SHV_CON_EV_READ:
+        /* Data is ready, try to read it from the transport layer.
+         * If zero is returned, it signals no data to be read from the transport
+         * layer, indicating merciful quit. If -1 is returned, it signals
+         * that something bad has happened.
+         */
+        ret = shv_process_input(shv_ctx);
+        if (ret == 0 || !atomic_load(&shv_ctx->running)) {
+            return shv_process_disconnect(shv_ctx, wait);
+        } else if (ret < 0 && errno != EAGAIN) {
+            /* The error should be already set in err_no. */
+            shv_ctx->connection->tops.close(shv_ctx->connection);
+            return -1;
         }
+        break;
+    default:
+        /* Something bad happened during the dataready stage. */
+        shv_ctx->connection->tops.close(shv_ctx->connection);
+        return -1;
     }
 
-    return ret;
+    if (shv_ctx->write_err) {
+        /* The peer lost a frame, most likely it does not read the sent data */
+        return shv_process_disconnect(shv_ctx, wait);
+    }
+
+    *wait = shv_process_wait(shv_ctx);
+    return 1;
+}
+
+int shv_process_step(struct shv_con_ctx *shv_ctx, int event, int *wait)
+{
+    switch (shv_ctx->con_state) {
+    case SHV_CON_NOT_INIT:
+        return shv_process_connect(shv_ctx, wait);
+    case SHV_CON_NO_CONN:
+        return shv_process_reconnect(shv_ctx, event, wait);
+    case SHV_CON_CONNECTING:
+        return shv_process_connect_reply(shv_ctx, event, wait);
+    case SHV_CON_HELLO:
+    case SHV_CON_LOGIN:
+        return shv_process_login_reply(shv_ctx, event, wait);
+    case SHV_CON_CONN:
+        return shv_process_communication(shv_ctx, event, wait);
+    default:
+        /* A glitch in the matrix */
+        return -1;
+    }
 }
 
 int shv_process(struct shv_con_ctx *shv_ctx)
 {
+    int event = SHV_CON_EV_TIMEOUT;
+    int wait;
     int ret;
-    /* A local enum to keep track of the connection */
-    enum {NOT_INIT = 0, INIT_BUT_NO_CONN, CONN} conn_state = NOT_INIT;
 
     /* Signal we are running */
     atomic_store(&shv_ctx->running, true);
+    shv_ctx->con_state = SHV_CON_NOT_INIT;
 
-    while (true) {
-        switch (conn_state) {
-        case NOT_INIT:
-            ret = shv_ctx->connection->tops.init(shv_ctx->connection);
-            if (ret == -2) {
-                fprintf(stderr, "ERROR: failed to initialize the lowlevel transport layer!\n");
-                shv_ctx->err_no = SHV_TLAYER_INIT;
-                return -1;
-            } else if (ret == -1) {
-                /* I put no break; here so it can instantly go through the INIT_BUT_NO_CONN phase */
-                conn_state = INIT_BUT_NO_CONN;
-            } else {
-                conn_state = CONN;
-                break;
-            }
-        case INIT_BUT_NO_CONN:
-            if (!atomic_load(&shv_ctx->running)) {
-                fprintf(stderr, "ERROR: not connected and request to finish\n");
-                return 0;
-            }
-            if ((shv_ctx->connection->reconnect_retries > 0) &&
-                (shv_ctx->reconnects >= shv_ctx->connection->reconnect_retries)) {
-                shv_ctx->err_no = SHV_RECONNECTS;
-                fprintf(stderr, "ERROR: maximum number of reconnects reached!\n");
-                return -1;
-            }
-
-            fprintf(stderr, "ERROR: can't connect to the server! "
-                            "Trying again in %d seconds.\n",
-                            shv_ctx->connection->reconnect_period);
-            usleep(shv_ctx->connection->reconnect_period * 1000000);
-            ret = shv_ctx->connection->tops.init(shv_ctx->connection);
-            if (ret == 0) {
-                /* Succesfull connect, go to login */
-                conn_state = CONN;
-            } else if (ret == -2) {
-                /* Something bad happened */
-                fprintf(stderr,
-                        "ERROR: failed to initialize the lowlevel transport layer!\n");
-                shv_ctx->err_no = SHV_TLAYER_INIT;
-                return -1;
-            } else if (ret == -1) {
-                /* Another unsuccesful connect */
-                shv_ctx->reconnects += 1;
-                if ((shv_ctx->connection->reconnect_retries > 0) &&
-                    (shv_ctx->reconnects >= shv_ctx->connection->reconnect_retries)) {
-                    fprintf(stderr, "ERROR: maximum number of reconnects reached!\n");
-                    shv_ctx->err_no = SHV_RECONNECTS;
-                    return -1;
-                }
-            }
-            break;
-        case CONN:
-            ret = shv_process_communication(shv_ctx);
-            if (ret < 0) {
-                /* Something bad happened. The error should be already set in err_no. */
-                /* Close the connection mercifully. */
-                shv_ctx->connection->tops.close(shv_ctx->connection);
-                return ret;
-            } else if (ret == 0) {
-                /* Unable to process any further bytes. It's not an error, but it indicated
-                 * that the SHV connection has been terminated. Still, retry the connection
-                 * (if we have enough remaining retries).
-                 */
-                shv_ctx->at_signlr(shv_ctx, SHV_ATTENTION_DISCONNECTED);
-                shv_ctx->connection->tops.close(shv_ctx->connection);
-                if (atomic_load(&shv_ctx->running)) {
-                    fprintf(stderr, "WARNING: we have been disconnected!\n");
-                    /* Close the connection mercifully. */
-                    if ((shv_ctx->connection->reconnect_retries > 0) &&
-                       (shv_ctx->reconnects >= shv_ctx->connection->reconnect_retries)) {
-                        /* We have no remaining reconnects */
-                        shv_ctx->err_no = SHV_RECONNECTS;
-                        fprintf(stderr, "ERROR: maximum number of reconnects reached!\n");
-                        return -1;
-                    }
-                    conn_state = NOT_INIT;
-                } else {
-                    /* The disconnect actually comes from the user side, no error occured */
-                    return 0;
-                }
-            }
-            break;
-        default:
-            /* A glitch in the matrix */
-            return -1;
+    while ((ret = shv_process_step(shv_ctx, event, &wait)) > 0) {
+        if (shv_ctx->con_state == SHV_CON_NO_CONN) {
+            usleep(wait * 1000);
+            event = SHV_CON_EV_TIMEOUT;
+        } else {
+            event = shv_ctx->connection->tops.dataready(shv_ctx->connection, wait);
         }
     }
 
     return ret;
 }
 
+/****************************************************************************
+ * Name: shv_con_ctx_free
+ *
+ * Description:
+ *   Free the struct shv_con_ctx and the buffers it holds.
+ *
+ ****************************************************************************/
+
+static void shv_con_ctx_free(struct shv_con_ctx *shv_ctx)
+{
+  struct shv_txq_msg *msg;
+
+  /* Drop the messages not sent */
+
+  shv_txq_pop_begin(&shv_ctx->txq);
+  while ((msg = shv_txq_pop(&shv_ctx->txq)) != NULL)
+    {
+      if (msg->release != NULL)
+        {
+          msg->release(msg);
+        }
+    }
+
+  free(shv_ctx->rx_buf);
+  shv_buf_pool_put(&shv_ctx->buf_pool, shv_ctx->shv_data, shv_ctx->shv_data_len);
+  shv_buf_pool_put(&shv_ctx->buf_pool, shv_ctx->tx_buf, shv_ctx->tx_size);
+  shv_buf_pool_destroy(&shv_ctx->buf_pool);
+  shv_path_index_put(shv_ctx->path_index);
+  free(shv_ctx->vnode_scratch.buf);
+  free(shv_ctx->cid_ptr);
+  free(shv_ctx);
+}
+
 /****************************************************************************
  * Name: shv_com_init
  *
@@ -1193,6 +2490,17 @@ struct shv_con_ctx *shv_com_init(struct shv_node *root, struct shv_connection *c
     }
 
   shv_con_ctx_init(shv_ctx, root, connection, at_signlr);
+  if (shv_com_set_buf_pool(shv_ctx, SHV_BUF_POOL_SIZE, SHV_BUF_POOL_COUNT,
+                           SHV_BUF_POOL_MAX) < 0 ||
+      shv_com_set_path_index(shv_ctx, SHV_PATH_INDEX_LEN) < 0 ||
+      shv_com_set_vnode_scratch(shv_ctx, SHV_VNODE_SCRATCH_LEN) < 0 ||
+      shv_com_set_rx_buf_size(shv_ctx, SHV_RX_BUF_LEN) < 0 ||
+      cid_reserve(shv_ctx, SHV_CID_PREALLOC_LEN) < 0)
+    {
+      shv_con_ctx_free(shv_ctx);
+      return NULL;
+    }
+
   return shv_ctx;
 }
 
@@ -1200,7 +2508,7 @@ void shv_com_destroy(struct shv_con_ctx *shv_ctx)
 {
     atomic_store(&shv_ctx->running, false);
     shv_stop_process_thread(shv_ctx);
-    free(shv_ctx);
+    shv_con_ctx_free(shv_ctx);
 }
 
 void shv_com_connection_close(struct shv_con_ctx *shv_ctx)
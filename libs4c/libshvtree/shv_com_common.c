@@ -12,64 +12,344 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 
+#include <shv/chainpack/cchainpack.h>
 #include <shv/tree/shv_tree.h>
 #include <shv/tree/shv_com.h>
 #include <shv/tree/shv_com_common.h>
 #include <shv/tree/shv_connection.h>
 #include <ulut/ul_utdefs.h>
 
-void shv_overflow_handler(struct ccpcp_pack_context *ctx, size_t size_hint)
+/* Room kept in front of a buffered message body for its length prefix.
+ * Four bytes of chainpack uint data hold lengths up to 2^28 - 1.
+ */
+
+#define SHV_FRAME_PREFIX_LEN 4
+
+static void shv_write_raw(struct shv_con_ctx *shv_ctx, const char *ptr_data, size_t to_send)
 {
+  int ret = 0;
 
-  struct shv_con_ctx *shv_ctx = UL_CONTAINEROF(ctx, struct shv_con_ctx, pack_ctx);
-  size_t to_send = ctx->current - ctx->start;
-  char * ptr_data = shv_ctx->shv_data;
+  while ((shv_ctx->write_err == 0) && (to_send > 0))
+    {
+      ret = shv_ctx->connection->tops.write(shv_ctx->connection, (void *)ptr_data, to_send);
+      if (ret <= 0)
+        {
+          printf("ERROR: Write error, ret = %d\n", ret);
+          if (ret == -1)
+            {
+              shv_ctx->write_err = 1;
+              printf("ERROR: Write error, errno = %d\n", errno);
+            }
+          break;
+        }
+
+      to_send -= ret;
+      ptr_data += ret;
+    }
+}
+
+static void shv_writev_raw(struct shv_con_ctx *shv_ctx, struct iovec *iov, int iovcnt)
+{
   int ret = 0;
 
-  if (shv_ctx->shv_send)
+  while ((shv_ctx->write_err == 0) && (iovcnt > 0))
     {
-      while ((shv_ctx->write_err == 0) && (to_send > 0))
+      ret = shv_ctx->connection->tops.writev(shv_ctx->connection, iov, iovcnt);
+      if (ret <= 0)
         {
-          ret = shv_ctx->connection->tops.write(shv_ctx->connection, ptr_data, to_send);
-          if (ret <= 0)
+          printf("ERROR: Write error, ret = %d\n", ret);
+          if (ret == -1)
             {
-              printf("ERROR: Write error, ret = %d\n", ret);
-              if (ret == -1)
-                {
-                  shv_ctx->write_err = 1;
-                  printf("ERROR: Write error, errno = %d\n", errno);
-                }
-              break;
+              shv_ctx->write_err = 1;
+              printf("ERROR: Write error, errno = %d\n", errno);
             }
+          break;
+        }
+
+      /* Skip what was written, the rest goes in the next call */
 
-          to_send -= ret;
-          ptr_data += ret;
+      while (iovcnt > 0 && (size_t)ret >= iov->iov_len)
+        {
+          ret -= iov->iov_len;
+          iov++;
+          iovcnt--;
+        }
+
+      if (iovcnt > 0)
+        {
+          iov->iov_base = (char *)iov->iov_base + ret;
+          iov->iov_len -= ret;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: shv_com_flush
+ *
+ * Description:
+ *   Send the frames queued in tx_buf. With no vectored write available,
+ *   the frames are moved together over the gaps left by their length
+ *   prefixes and sent by a single write.
+ *
+ ****************************************************************************/
+
+int shv_com_flush(struct shv_con_ctx *shv_ctx)
+{
+  char *dst;
+
+  if (shv_ctx->tx_iovcnt == 0)
+    {
+      return shv_ctx->write_err ? -1 : 0;
+    }
+
+  if (shv_ctx->connection->tops.writev != NULL)
+    {
+      shv_writev_raw(shv_ctx, shv_ctx->tx_iov, shv_ctx->tx_iovcnt);
+    }
+  else
+    {
+      dst = shv_ctx->tx_buf;
+      for (int i = 0; i < shv_ctx->tx_iovcnt; i++)
+        {
+          memmove(dst, shv_ctx->tx_iov[i].iov_base, shv_ctx->tx_iov[i].iov_len);
+          dst += shv_ctx->tx_iov[i].iov_len;
         }
+
+      shv_write_raw(shv_ctx, shv_ctx->tx_buf, dst - shv_ctx->tx_buf);
+    }
+
+  shv_ctx->tx_iovcnt = 0;
+  shv_ctx->tx_len = 0;
+  return shv_ctx->write_err ? -1 : 0;
+}
+
+static void shv_write_data(struct shv_con_ctx *shv_ctx, const char *ptr_data, size_t to_send)
+{
+  /* Keep the order, the queued frames go first */
+
+  shv_com_flush(shv_ctx);
+  shv_write_raw(shv_ctx, ptr_data, to_send);
+}
+
+/* Buffer the next frame is packed to. In a batch the frame is packed
+ * directly to the transmit queue, otherwise to shv_data and sent right away.
+ */
+
+static char *shv_frame_buf(struct shv_con_ctx *shv_ctx, size_t *size)
+{
+  if (!shv_ctx->tx_batch)
+    {
+      *size = shv_ctx->shv_data_len;
+      return shv_ctx->shv_data;
+    }
+
+  /* Rather send the queue than pack to its small rest */
+
+  if (shv_ctx->tx_size - shv_ctx->tx_len < shv_ctx->tx_size / 4 ||
+      shv_ctx->tx_iovcnt == SHV_TX_IOV_MAX)
+    {
+      shv_com_flush(shv_ctx);
+    }
+
+  *size = shv_ctx->tx_size - shv_ctx->tx_len;
+  return shv_ctx->tx_buf + shv_ctx->tx_len;
+}
+
+/* Grow the buffer the frame is packed to so that the frame of shv_len
+ * bytes fits it. Returns the grown buffer or NULL if it cannot grow.
+ */
+
+static char *shv_frame_buf_grow(struct shv_con_ctx *shv_ctx, size_t *size)
+{
+  size_t need = shv_ctx->shv_len + SHV_FRAME_PREFIX_LEN;
+  char *buf;
+
+  if (shv_ctx->tx_batch)
+    {
+      shv_com_flush(shv_ctx);
+      buf = shv_buf_pool_grow(&shv_ctx->buf_pool, shv_ctx->tx_buf, &shv_ctx->tx_size, need);
+      if (buf != NULL)
+        {
+          shv_ctx->tx_buf = buf;
+          *size = shv_ctx->tx_size;
+        }
+    }
+  else
+    {
+      buf = shv_buf_pool_grow(&shv_ctx->buf_pool, shv_ctx->shv_data, &shv_ctx->shv_data_len,
+                              need);
+      if (buf != NULL)
+        {
+          shv_ctx->shv_data = buf;
+          *size = shv_ctx->shv_data_len;
+        }
+    }
+
+  return buf;
+}
+
+void shv_overflow_handler(struct ccpcp_pack_context *ctx, size_t size_hint)
+{
+
+  struct shv_con_ctx *shv_ctx = UL_CONTAINEROF(ctx, struct shv_con_ctx, pack_ctx);
+
+  switch (shv_ctx->frame_mode)
+    {
+      case SHV_FRAME_BUFFERED:
+        /* The body does not fit the buffer. Count the rest of it,
+         * shv_pack_frame_end() then requests a second, streamed pass.
+         */
+
+        shv_ctx->frame_mode = SHV_FRAME_MEASURE;
+        shv_ctx->shv_len += ctx->current - ctx->start;
+        break;
+      case SHV_FRAME_MEASURE:
+        shv_ctx->shv_len += ctx->current - ctx->start;
+        break;
+      case SHV_FRAME_STREAM:
+        shv_write_data(shv_ctx, ctx->start, ctx->current - ctx->start);
+        break;
     }
 
-  shv_ctx->shv_len += ctx->current-ctx->start;
   ctx->current = ctx->start;
-  ctx->end = ctx->start + SHV_BUF_LEN;
 }
 
-size_t shv_underrflow_handler(struct ccpcp_unpack_context * ctx)
+void shv_pack_frame_begin(struct shv_con_ctx *shv_ctx)
+{
+  size_t size;
+  char *buf = shv_frame_buf(shv_ctx, &size);
+
+  ccpcp_pack_context_init(&shv_ctx->pack_ctx, buf + SHV_FRAME_PREFIX_LEN,
+                          size - SHV_FRAME_PREFIX_LEN, shv_overflow_handler);
+  shv_ctx->frame_mode = SHV_FRAME_BUFFERED;
+  shv_ctx->shv_len = 0;
+}
+
+void shv_pack_frame_begin_sized(struct shv_con_ctx *shv_ctx, size_t len)
 {
-  int i;
+  struct ccpcp_pack_context *ctx = &shv_ctx->pack_ctx;
+  size_t size;
+  char *buf;
+
+  /* Pack it as any other message if it fits the buffer, grown if needed */
+
+  shv_ctx->shv_len = len;
+  buf = shv_frame_buf(shv_ctx, &size);
+  if (len + SHV_FRAME_PREFIX_LEN > size)
+    {
+      buf = shv_frame_buf_grow(shv_ctx, &size);
+    }
+
+  if (buf != NULL)
+    {
+      ccpcp_pack_context_init(ctx, buf + SHV_FRAME_PREFIX_LEN, size - SHV_FRAME_PREFIX_LEN,
+                              shv_overflow_handler);
+      shv_ctx->frame_mode = SHV_FRAME_BUFFERED;
+      shv_ctx->shv_len = 0;
+      return;
+    }
+
+  ccpcp_pack_context_init(ctx, shv_ctx->shv_data, shv_ctx->shv_data_len, shv_overflow_handler);
+  shv_ctx->frame_mode = SHV_FRAME_STREAM;
+  shv_ctx->shv_len = len;
+  cchainpack_pack_uint_data(ctx, len);
+}
+
+int shv_pack_frame_end(struct shv_con_ctx *shv_ctx)
+{
+  struct ccpcp_pack_context *ctx = &shv_ctx->pack_ctx;
+  struct ccpcp_pack_context prefix_ctx;
+  char prefix[SHV_FRAME_PREFIX_LEN];
+  size_t prefix_len;
+  struct iovec *iov;
+  size_t size;
+  char *buf;
+
+  switch (shv_ctx->frame_mode)
+    {
+      case SHV_FRAME_BUFFERED:
+        /* The whole body is in the buffer, put the length in front of it
+         * and send it at once or queue it.
+         */
+
+        shv_ctx->shv_len = ctx->current - ctx->start;
+        ccpcp_pack_context_init(&prefix_ctx, prefix, sizeof(prefix), NULL);
+        cchainpack_pack_uint_data(&prefix_ctx, shv_ctx->shv_len);
+        prefix_len = prefix_ctx.current - prefix_ctx.start;
+        memcpy(ctx->start - prefix_len, prefix, prefix_len);
+        if (ctx->start == shv_ctx->shv_data + SHV_FRAME_PREFIX_LEN)
+          {
+            shv_write_data(shv_ctx, ctx->start - prefix_len, prefix_len + shv_ctx->shv_len);
+          }
+        else
+          {
+            iov = &shv_ctx->tx_iov[shv_ctx->tx_iovcnt++];
+            iov->iov_base = ctx->start - prefix_len;
+            iov->iov_len = prefix_len + shv_ctx->shv_len;
+            shv_ctx->tx_len = ctx->current - shv_ctx->tx_buf;
+          }
+
+        return 0;
+      case SHV_FRAME_MEASURE:
+        /* Length is known now, pack the body again to a buffer grown
+         * to fit it or, if it cannot grow, stream it.
+         */
+
+        shv_ctx->shv_len += ctx->current - ctx->start;
+        buf = shv_frame_buf_grow(shv_ctx, &size);
+        if (buf != NULL)
+          {
+            ccpcp_pack_context_init(ctx, buf + SHV_FRAME_PREFIX_LEN,
+                                    size - SHV_FRAME_PREFIX_LEN, shv_overflow_handler);
+            shv_ctx->frame_mode = SHV_FRAME_BUFFERED;
+            shv_ctx->shv_len = 0;
+            return 1;
+          }
+
+        ccpcp_pack_context_init(ctx, shv_ctx->shv_data, shv_ctx->shv_data_len,
+                                shv_overflow_handler);
+        shv_ctx->frame_mode = SHV_FRAME_STREAM;
+        cchainpack_pack_uint_data(ctx, shv_ctx->shv_len);
+        return 1;
+      case SHV_FRAME_STREAM:
+      default:
+        if (ctx->bytes_written != cchainpack_packed_size_uint_data(shv_ctx->shv_len) +
+                                 (size_t)shv_ctx->shv_len)
+          {
+            /* The peer would lose the framing, nothing sane can be sent */
 
+            printf("ERROR: Packed %zu bytes, frame length is %d\n",
+                   ctx->bytes_written, shv_ctx->shv_len);
+            shv_ctx->write_err = 1;
+          }
+
+        shv_overflow_handler(ctx, 0);
+        shv_ctx->frame_mode = SHV_FRAME_BUFFERED;
+        return 0;
+    }
+}
+
+size_t shv_underrflow_handler(struct ccpcp_unpack_context * ctx)
+{
   struct shv_con_ctx *shv_ctx = UL_CONTAINEROF(ctx, struct shv_con_ctx, unpack_ctx);
+  size_t len = shv_ctx->rx_wrap_len;
+
+  /* The frame is in the receive buffer as a whole, only its part wrapped
+   * to the buffer start is served here. Nothing is read from the transport.
+   */
 
-  i = shv_ctx->connection->tops.read(shv_ctx->connection,
-                                     shv_ctx->shv_rd_data, sizeof(shv_ctx->shv_rd_data));
-  if (i > 0)
+  if (len > 0)
     {
-      ctx->start = shv_ctx->shv_rd_data;
+      shv_ctx->rx_wrap_len = 0;
+      ctx->start = shv_ctx->rx_buf;
       ctx->current = ctx->start;
-      ctx->end = ctx->start + i;
+      ctx->end = ctx->start + len;
     }
 
-  return i;
+  return len;
 }
 
 void shv_pack_head_reply(struct shv_con_ctx *shv_ctx, int rid)
@@ -83,16 +363,16 @@ void shv_pack_head_reply(struct shv_con_ctx *shv_ctx, int rid)
   cchainpack_pack_int(&shv_ctx->pack_ctx, rid);
 
   cchainpack_pack_int(&shv_ctx->pack_ctx, TAG_CALLER_IDS);
-  if (shv_ctx->cid_cnt == 1)
+  if (shv_ctx->rpc_head.cid_cnt == 1)
     {
-      cchainpack_pack_int(&shv_ctx->pack_ctx, shv_ctx->cid_ptr[0]);
+      cchainpack_pack_int(&shv_ctx->pack_ctx, shv_ctx->rpc_head.cids[0]);
     }
   else
     {
       cchainpack_pack_list_begin(&shv_ctx->pack_ctx);
-      for (int i = 0; i < shv_ctx->cid_cnt; i++)
+      for (int i = 0; i < shv_ctx->rpc_head.cid_cnt; i++)
         {
-          cchainpack_pack_int(&shv_ctx->pack_ctx, shv_ctx->cid_ptr[i]);
+          cchainpack_pack_int(&shv_ctx->pack_ctx, shv_ctx->rpc_head.cids[i]);
         }
 
       cchainpack_pack_container_end(&shv_ctx->pack_ctx);
@@ -101,25 +381,47 @@ void shv_pack_head_reply(struct shv_con_ctx *shv_ctx, int rid)
   cchainpack_pack_container_end(&shv_ctx->pack_ctx);
 }
 
-int shv_unpack_cont_discard_levels(struct shv_con_ctx *shv_ctx, int levels)
+size_t shv_head_reply_packed_size(struct shv_con_ctx *shv_ctx, int rid)
 {
-    struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+  cchainpack_size_builder b;
 
-    do {
-        cchainpack_unpack_next(ctx);
-        if (ctx->err_no != CCPCP_RC_OK) {
-            return -1;
-        }
+  cchainpack_size_builder_init(&b);
+  cchainpack_size_add_meta_begin(&b);
+
+  cchainpack_size_add_int(&b, 1);
+  cchainpack_size_add_int(&b, 1);
 
-        if ((ctx->item.type == CCPCP_ITEM_META) ||
-            (ctx->item.type == CCPCP_ITEM_LIST) ||
-            (ctx->item.type == CCPCP_ITEM_MAP) ||
-            (ctx->item.type == CCPCP_ITEM_IMAP)) {
-            levels++;
-        } else if (ctx->item.type == CCPCP_ITEM_CONTAINER_END) {
-            levels--;
+  cchainpack_size_add_int(&b, TAG_REQUEST_ID);
+  cchainpack_size_add_int(&b, rid);
+
+  cchainpack_size_add_int(&b, TAG_CALLER_IDS);
+  if (shv_ctx->rpc_head.cid_cnt == 1)
+    {
+      cchainpack_size_add_int(&b, shv_ctx->rpc_head.cids[0]);
+    }
+  else
+    {
+      cchainpack_size_add_list_begin(&b);
+      for (int i = 0; i < shv_ctx->rpc_head.cid_cnt; i++)
+        {
+          cchainpack_size_add_int(&b, shv_ctx->rpc_head.cids[i]);
         }
-    } while (levels);
+
+      cchainpack_size_add_container_end(&b);
+    }
+
+  cchainpack_size_add_container_end(&b);
+  return b.size;
+}
+
+int shv_unpack_cont_discard_levels(struct shv_con_ctx *shv_ctx, int levels)
+{
+    struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+
+    cchainpack_skip_container_levels(ctx, levels);
+    if (ctx->err_no != CCPCP_RC_OK) {
+        return -1;
+    }
 
     return 0;
 }
@@ -134,14 +436,9 @@ int shv_unpack_discard(struct shv_con_ctx *shv_ctx)
         (ctx->item.type == CCPCP_ITEM_IMAP)) {
         return shv_unpack_cont_discard_levels(shv_ctx, 1);
     } else {
-        if ((ctx->item.type == CCPCP_ITEM_BLOB) ||
-            (ctx->item.type == CCPCP_ITEM_STRING)) {
-            while (ctx->item.as.String.last_chunk != 0) {
-                cchainpack_unpack_next(ctx);
-                if (ctx->err_no != CCPCP_RC_OK) {
-                    return -1;
-                }
-            }
+        cchainpack_skip_string_rest(ctx);
+        if (ctx->err_no != CCPCP_RC_OK) {
+            return -1;
         }
     }
 
@@ -152,10 +449,9 @@ int shv_unpack_skip(struct shv_con_ctx *shv_ctx)
 {
     struct ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
 
-    cchainpack_unpack_next(ctx);
+    cchainpack_skip_value(ctx);
     if (ctx->err_no != CCPCP_RC_OK) {
         return -1;
     }
-    shv_unpack_discard(shv_ctx);
     return 0;
 }
@@ -38,6 +38,8 @@ int shv_connection_tcpip_init(struct shv_connection *connection,
     connection->tops.init =      shv_tcpip_posix_init;
     connection->tops.read =      shv_tcpip_posix_read;
     connection->tops.write =     shv_tcpip_posix_write;
+    connection->tops.writev =    shv_tcpip_posix_writev;
+    connection->tops.txroom =    shv_tcpip_posix_txroom;
     connection->tops.close =     shv_tcpip_posix_close;
     connection->tops.dataready = shv_tcpip_posix_dataready;
     return 0;
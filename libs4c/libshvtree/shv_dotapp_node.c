@@ -18,6 +18,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+static void shv_dotapp_node_destructor(struct shv_node *node)
+{
+    struct shv_dotapp_node *appnode = UL_CONTAINEROF(node, struct shv_dotapp_node, shv_node);
+    free(appnode);
+}
+
 int shv_dotapp_node_method_shvversionmajor(struct shv_con_ctx *shv_ctx, struct shv_node *item, int rid)
 {
     shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
@@ -133,7 +139,13 @@ const struct shv_dmap shv_dotapp_dmap =
 
 struct shv_dotapp_node *shv_tree_dotapp_node_new(const struct shv_dmap *dir, int mode)
 {
-    struct shv_dotapp_node *item = calloc(1, sizeof(struct shv_dotapp_node));
+    return shv_tree_arena_dotapp_node_new(NULL, dir, mode);
+}
+
+struct shv_dotapp_node *shv_tree_arena_dotapp_node_new(struct shv_arena *arena,
+                                                       const struct shv_dmap *dir, int mode)
+{
+    struct shv_dotapp_node *item = shv_tree_node_alloc(arena, sizeof(struct shv_dotapp_node));
     if (item == NULL) {
         perror(".app calloc");
         return NULL;
@@ -141,5 +153,6 @@ struct shv_dotapp_node *shv_tree_dotapp_node_new(const struct shv_dmap *dir, int
     shv_tree_node_init(&item->shv_node, ".app", dir, mode);
     item->name = "";
     item->version = "";
+    item->shv_node.vtable.destructor = arena == NULL ? shv_dotapp_node_destructor : NULL;
     return item;
 }
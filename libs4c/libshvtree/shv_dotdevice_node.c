@@ -139,7 +139,15 @@ const struct shv_dmap shv_dotdevice_dmap =
 
 struct shv_dotdevice_node *shv_tree_dotdevice_node_new(const struct shv_dmap *dir, int mode)
 {
-    struct shv_dotdevice_node *item = calloc(1, sizeof(struct shv_dotdevice_node));
+    return shv_tree_arena_dotdevice_node_new(NULL, dir, mode);
+}
+
+struct shv_dotdevice_node *shv_tree_arena_dotdevice_node_new(struct shv_arena *arena,
+                                                             const struct shv_dmap *dir,
+                                                             int mode)
+{
+    struct shv_dotdevice_node *item = shv_tree_node_alloc(arena,
+                                                          sizeof(struct shv_dotdevice_node));
     if (item == NULL) {
         perror(".device calloc");
         return NULL;
@@ -157,6 +165,6 @@ struct shv_dotdevice_node *shv_tree_dotdevice_node_new(const struct shv_dmap *di
     item->devops.reset = shv_dotdevice_node_posix_reset;
 #endif
 #endif
-    item->shv_node.vtable.destructor = shv_dotdevice_node_destructor;
+    item->shv_node.vtable.destructor = arena == NULL ? shv_dotdevice_node_destructor : NULL;
     return item;
 }
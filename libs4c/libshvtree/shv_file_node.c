@@ -21,6 +21,7 @@
 #include <shv/tree/shv_com_common.h>
 #include <shv/tree/shv_tree.h>
 #include <shv/tree/shv_methods.h>
+#include <shv/tree/shv_async.h>
 #include <ulut/ul_utdefs.h>
 
 /* The Write method unpack state */
@@ -84,15 +85,22 @@ static void shv_file_node_destructor(struct shv_node *node)
 
 void shv_file_send_stat(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_node *item)
 {
-    ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data, SHV_BUF_LEN,
-                            shv_overflow_handler);
+    /* 4 * PG_SIZE is reasonable, unless the write request does not fit
+     * the receive buffer along with its head
+     */
+    int maxwrite = 4 * item->file_pagesize;
+    size_t limit = shv_ctx->rx_size > SHV_BUF_LEN ? shv_ctx->rx_size - SHV_BUF_LEN : 0;
 
-    for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++) {
-        if (shv_ctx->shv_send) {
-            cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
+    if (limit > 0 && (size_t)maxwrite > limit) {
+        maxwrite = limit;
+        if (item->file_pagesize > 0 && maxwrite >= item->file_pagesize) {
+            maxwrite -= maxwrite % item->file_pagesize;
         }
+    }
+
+    shv_pack_frame_begin(shv_ctx);
 
-        shv_ctx->shv_len = 0;
+    do {
         cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
         shv_pack_head_reply(shv_ctx, rid);
 
@@ -115,8 +123,7 @@ void shv_file_send_stat(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_no
 
         /* The sixth key (max send size), limit this by the pagesize multiples */
         cchainpack_pack_int(&shv_ctx->pack_ctx, FN_MAXWRITE);
-        /* 4 * PG_SIZE is reasonable */
-        cchainpack_pack_int(&shv_ctx->pack_ctx, 4 * item->file_pagesize);
+        cchainpack_pack_int(&shv_ctx->pack_ctx, maxwrite);
 
         /* MaxRead key: read currently not implemented, send 0 */
         cchainpack_pack_int(&shv_ctx->pack_ctx, FN_MAXREAD);
@@ -129,21 +136,14 @@ void shv_file_send_stat(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_no
 
         cchainpack_pack_container_end(&shv_ctx->pack_ctx);
         cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-        shv_overflow_handler(&shv_ctx->pack_ctx, 0); 
-    }
+    } while (shv_pack_frame_end(shv_ctx));
 }
 
 void shv_file_send_size(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_node *item)
 {
-    ccpcp_pack_context_init(&shv_ctx->pack_ctx,shv_ctx->shv_data, SHV_BUF_LEN,
-                            shv_overflow_handler);
+    shv_pack_frame_begin(shv_ctx);
 
-    for (shv_ctx->shv_send = 0; shv_ctx->shv_send < 2; shv_ctx->shv_send++) {
-        if (shv_ctx->shv_send) {
-            cchainpack_pack_uint_data(&shv_ctx->pack_ctx, shv_ctx->shv_len);
-        }
-
-        shv_ctx->shv_len = 0;
+    do {
         cchainpack_pack_uint_data(&shv_ctx->pack_ctx, 1);
         shv_pack_head_reply(shv_ctx, rid);
 
@@ -153,8 +153,7 @@ void shv_file_send_size(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_no
         cchainpack_pack_int(&shv_ctx->pack_ctx, item->file_maxsize);
 
         cchainpack_pack_container_end(&shv_ctx->pack_ctx);
-        shv_overflow_handler(&shv_ctx->pack_ctx, 0); 
-    }
+    } while (shv_pack_frame_end(shv_ctx));
 }
 
 int shv_file_process_write(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_node *item)
@@ -303,11 +302,10 @@ int shv_file_process_write(struct shv_con_ctx *shv_ctx, int rid, struct shv_file
  * If only the first number is passed (offset), CRC is calculated until the end of the file.
  * If both numbers are passed (offset and size), CRC is calcaulted over size bytes.
  */
-int shv_file_process_crc(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_node *item)
+static int shv_file_parse_crc(struct shv_con_ctx *shv_ctx, struct shv_file_node *item,
+                              int *start, size_t *size)
 {
     int parse_result = PARSE_ERROR;
-    size_t size;
-    int start;
     ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
     item->ignored = false;
 
@@ -426,35 +424,122 @@ int shv_file_process_crc(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_n
      */
     switch (parse_result) {
     case WHOLE_FILE:
-        start = 0;
-        size = item->file_maxsize;
+        *start = 0;
+        *size = item->file_maxsize;
         break;
     case OFFSET_ONLY:
-        start = item->crc_offset;
-        size = item->file_maxsize - item->crc_offset;
+        *start = item->crc_offset;
+        *size = item->file_maxsize - item->crc_offset;
         break;
     case OFFSET_AND_SIZE:
-        start = item->crc_offset;
-        size = item->crc_size;
+        *start = item->crc_offset;
+        *size = item->crc_size;
         break;
     default:
         return -1;
     }
-    if (parse_result >= WHOLE_FILE) {
+    return 0;
+}
+
+int shv_file_process_crc(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_node *item)
+{
+    size_t size;
+    int start;
+
+    if (shv_file_parse_crc(shv_ctx, item, &start, &size) < 0) {
+        return -1;
+    }
+    if (!item->ignored) {
         if (item->fops.crc32(item, start, size, &item->crc) < 0) {
             item->platform_error = true;
         } else {
             item->platform_error = false;
         }
-        return 0;
     }
-    return -1;
+    return 0;
+}
+
+/* The CRC computed by the worker pool */
+struct shv_file_crc_work
+{
+    struct shv_work work;
+    struct shv_file_node *item;
+    int start;
+    size_t size;
+    uint32_t crc;
+    int ret;
+};
+
+static void shv_file_crc_work_fnc(struct shv_work *work)
+{
+    struct shv_file_crc_work *crc_work = UL_CONTAINEROF(work, struct shv_file_crc_work, work);
+    struct shv_file_node *item = crc_work->item;
+
+    crc_work->ret = item->fops.crc32(item, crc_work->start, crc_work->size, &crc_work->crc);
+}
+
+static void shv_file_crc_work_reply(struct shv_con_ctx *shv_ctx, struct shv_work *work, int rid)
+{
+    struct shv_file_crc_work *crc_work = UL_CONTAINEROF(work, struct shv_file_crc_work, work);
+
+    if (crc_work->ret < 0) {
+        shv_send_error(shv_ctx, rid, SHV_RE_PLATFORM_ERROR, "I/O Error");
+    } else {
+        shv_send_uint(shv_ctx, rid, crc_work->crc);
+    }
+}
+
+static void shv_file_crc_work_release(struct shv_work *work)
+{
+    struct shv_file_crc_work *crc_work = UL_CONTAINEROF(work, struct shv_file_crc_work, work);
+
+    atomic_store(&crc_work->item->busy, false);
+    free(crc_work);
+}
+
+/*
+ * Hand the CRC over to the worker pool, the reply is sent once it is computed.
+ * The node is busy until then, so the file is not written meanwhile.
+ * Returns -1 if the CRC is to be computed by the caller.
+ */
+static int shv_file_submit_crc(struct shv_con_ctx *shv_ctx, int rid, struct shv_file_node *item,
+                               int start, size_t size)
+{
+    struct shv_file_crc_work *crc_work;
+
+    if (shv_ctx->work_pool == NULL) {
+        return -1;
+    }
+
+    crc_work = malloc(sizeof(struct shv_file_crc_work));
+    if (crc_work == NULL) {
+        return -1;
+    }
+    crc_work->work.fnc = shv_file_crc_work_fnc;
+    crc_work->work.reply = shv_file_crc_work_reply;
+    crc_work->work.release = shv_file_crc_work_release;
+    crc_work->item = item;
+    crc_work->start = start;
+    crc_work->size = size;
+
+    atomic_store(&item->busy, true);
+    if (shv_work_submit(shv_ctx, &crc_work->work, rid) < 0) {
+        atomic_store(&item->busy, false);
+        free(crc_work);
+        return -1;
+    }
+    return 0;
 }
 
 int shv_file_node_write(struct shv_con_ctx *shv_ctx, struct shv_node *item, int rid)
 {
     int ret = 0;
     struct shv_file_node *file_node = UL_CONTAINEROF(item, struct shv_file_node, shv_node);
+    if (atomic_load(&file_node->busy)) {
+        shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
+        shv_send_error(shv_ctx, rid, SHV_RE_TRY_AGAIN_LATER, "CRC is being computed");
+        return 0;
+    }
     ret = shv_file_process_write(shv_ctx, rid, file_node);
     if (ret < WHOLE_FILE) {
         shv_send_error(shv_ctx, rid, SHV_RE_INVALID_PARAMS, "Garbled data");
@@ -472,8 +557,22 @@ int shv_file_node_write(struct shv_con_ctx *shv_ctx, struct shv_node *item, int
 int shv_file_node_crc(struct shv_con_ctx *shv_ctx, struct shv_node *item, int rid)
 {
     int ret;
+    size_t size;
+    int start;
     struct shv_file_node *file_node = UL_CONTAINEROF(item, struct shv_file_node, shv_node);
-    ret = shv_file_process_crc(shv_ctx, rid, file_node);
+    if (atomic_load(&file_node->busy)) {
+        shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
+        shv_send_error(shv_ctx, rid, SHV_RE_TRY_AGAIN_LATER, "CRC is being computed");
+        return 0;
+    }
+    ret = shv_file_parse_crc(shv_ctx, file_node, &start, &size);
+    if (ret == 0 && !file_node->ignored) {
+        if (shv_file_submit_crc(shv_ctx, rid, file_node, start, size) == 0) {
+            return 0;
+        }
+        file_node->platform_error = file_node->fops.crc32(file_node, start, size,
+                                                          &file_node->crc) < 0;
+    }
     if (ret < WHOLE_FILE) {
         shv_send_error(shv_ctx, rid, SHV_RE_INVALID_PARAMS, "Garbled data");
     } else if (file_node->platform_error) {
@@ -506,15 +605,25 @@ int shv_file_node_stat(struct shv_con_ctx *shv_ctx, struct shv_node *item, int r
 struct shv_file_node *shv_tree_file_node_new(const char *child_name, const struct shv_dmap *dir,
                                              int mode)
 {
-    struct shv_file_node *item = calloc(1, sizeof(struct shv_file_node));
+    return shv_tree_arena_file_node_new(NULL, child_name, dir, mode);
+}
+
+struct shv_file_node *shv_tree_arena_file_node_new(struct shv_arena *arena,
+                                                   const char *child_name,
+                                                   const struct shv_dmap *dir, int mode)
+{
+    struct shv_file_node *item = shv_tree_node_alloc(arena, sizeof(struct shv_file_node));
     if (item == NULL) {
         perror("file node calloc");
         return NULL;
     }
     /* Allocate default file context */
-    item->fctx = calloc(1, sizeof(struct shv_file_node_fctx));
+    item->fctx = shv_tree_node_alloc(arena, sizeof(struct shv_file_node_fctx));
     if (item->fctx == NULL) {
         perror("file node ctx calloc");
+        if (arena == NULL) {
+            free(item);
+        }
         return NULL;
     }
     /* Initialize with default ops */
@@ -526,7 +635,7 @@ struct shv_file_node *shv_tree_file_node_new(const char *child_name, const struc
     item->fops.crc32   = shv_file_node_posix_crc32;
 #endif
     shv_tree_node_init(&item->shv_node, child_name, dir, mode);
-    item->shv_node.vtable.destructor = shv_file_node_destructor;
+    item->shv_node.vtable.destructor = arena == NULL ? shv_file_node_destructor : NULL;
     return item;
 }
 
@@ -0,0 +1,470 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_loop_epoll.c
+ * @brief Event loop serving many connections by a few threads
+ *
+ * Each thread waits for the sockets of its connections by one epoll
+ * instance, the wait ends at the nearest deadline of the connections
+ * (ping, reconnect). All connections of a thread share one pipe woken
+ * by shv_process_wake(), the connections with something to send are
+ * found by checking their queues.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <shv/tree/shv_loop.h>
+#include <shv/tree/shv_connection.h>
+#include <shv/tree/shv_clayer_posix.h>
+#include <shv/tree/shv_txq.h>
+
+#define SHV_LOOP_EVENTS 64              /* Events taken by one epoll_wait() */
+
+/* A connection served by the loop */
+struct shv_loop_con
+{
+    struct shv_con_ctx *shv_ctx;
+    struct shv_loop_con *next;
+    struct timespec deadline;           /* End of the wait for the next event */
+    int fd;                             /* Registered to epoll, -1 if none */
+    unsigned int connects;              /* shv_ctx->connects when fd was registered */
+    uint32_t events;                    /* Events fd is registered for */
+    bool done;                          /* Finished, to be dropped */
+};
+
+static int shv_loop_con_fd(struct shv_connection *connection)
+{
+    switch (connection->tlayer_type) {
+    case SHV_TLAYER_TCPIP:
+        return connection->tlayer.tcpip.ctx.sockfd;
+    case SHV_TLAYER_SERIAL:
+        return connection->tlayer.serial.ctx.fd;
+    default:
+        return -1;
+    }
+}
+
+static bool shv_loop_con_txpending(struct shv_connection *connection)
+{
+    return connection->tlayer_type == SHV_TLAYER_TCPIP &&
+           connection->tlayer.tcpip.ctx.txq_len > 0;
+}
+
+static void shv_loop_wake(struct shv_loop_thread *thrd)
+{
+    /* The write is enclosed in {} to suppress warn_unused_result warning,
+     * a full pipe wakes the thread anyway.
+     */
+    { write(thrd->fildes[1], "w", 1); }
+}
+
+/****************************************************************************
+ * Name: shv_loop_con_update
+ *
+ * Description:
+ *   Register the socket of the connection to epoll, for the writability
+ *   too if there are queued data or only for it while the connect is
+ *   in progress. A socket closed by the state machine
+ *   is forgotten by epoll, so a new one is registered again even if its
+ *   descriptor is the same.
+ *
+ ****************************************************************************/
+
+static void shv_loop_con_update(struct shv_loop_thread *thrd, struct shv_loop_con *con)
+{
+    struct shv_con_ctx *shv_ctx = con->shv_ctx;
+    struct epoll_event ev;
+    int fd = -1;
+    int op;
+
+    if (shv_ctx->con_state >= SHV_CON_CONNECTING) {
+        fd = shv_loop_con_fd(shv_ctx->connection);
+    }
+    if (fd < 0) {
+        con->fd = -1;
+        return;
+    }
+
+    if (shv_ctx->con_state == SHV_CON_CONNECTING) {
+        /* The socket is writable once connected or failed */
+        ev.events = EPOLLOUT;
+    } else {
+        ev.events = EPOLLIN;
+        if (shv_loop_con_txpending(shv_ctx->connection)) {
+            ev.events |= EPOLLOUT;
+        }
+    }
+    ev.data.ptr = con;
+
+    if (con->fd != fd || con->connects != shv_ctx->connects) {
+        op = EPOLL_CTL_ADD;
+    } else if (con->events != ev.events) {
+        op = EPOLL_CTL_MOD;
+    } else {
+        return;
+    }
+
+    if (epoll_ctl(thrd->epfd, op, fd, &ev) < 0) {
+        fprintf(stderr, "ERROR: cannot register the connection to epoll, errno = %d\n", errno);
+        return;
+    }
+    con->fd = fd;
+    con->connects = shv_ctx->connects;
+    con->events = ev.events;
+}
+
+static void shv_loop_con_finish(struct shv_loop_thread *thrd, struct shv_loop_con *con, int ret)
+{
+    struct shv_con_ctx *shv_ctx = con->shv_ctx;
+
+    /* The pipe stays open until the loop is destroyed, a racing
+     * shv_process_wake() does no harm.
+     */
+    atomic_store(&shv_ctx->thrd_ctx.wake_ready, false);
+    shv_ctx->thrd_ctx.thrd_ret = ret;
+    con->done = true;
+    atomic_fetch_sub(&thrd->count, 1);
+
+    /* Report a hard error */
+    if (ret == -1 && shv_ctx->at_signlr != NULL) {
+        shv_ctx->at_signlr(shv_ctx, SHV_ATTENTION_ERROR);
+    }
+
+    /* The last access, shv_stop_process_thread() may free shv_ctx now */
+    atomic_store(&shv_ctx->thrd_ctx.loop_served, false);
+}
+
+static void shv_loop_con_step(struct shv_loop_thread *thrd, struct shv_loop_con *con,
+                              int event, const struct timespec *now)
+{
+    int wait;
+    int ret;
+
+    ret = shv_process_step(con->shv_ctx, event, &wait);
+    if (ret <= 0) {
+        shv_loop_con_finish(thrd, con, ret);
+        return;
+    }
+
+    con->deadline.tv_sec = now->tv_sec + wait / 1000;
+    con->deadline.tv_nsec = now->tv_nsec + (wait % 1000) * 1000000;
+    if (con->deadline.tv_nsec >= 1000000000) {
+        con->deadline.tv_sec++;
+        con->deadline.tv_nsec -= 1000000000;
+    }
+    shv_loop_con_update(thrd, con);
+}
+
+/* Process the epoll event of the connection socket */
+
+static void shv_loop_con_event(struct shv_loop_thread *thrd, struct shv_loop_con *con,
+                               uint32_t events, const struct timespec *now)
+{
+    struct shv_connection *connection = con->shv_ctx->connection;
+    int queued = -1;
+
+    if (events & EPOLLOUT) {
+        queued = shv_tcpip_posix_txflush(connection);
+        if (queued < 0) {
+            shv_loop_con_step(thrd, con, SHV_CON_EV_ERROR, now);
+            return;
+        }
+    }
+
+    if (events & EPOLLIN) {
+        shv_loop_con_step(thrd, con, SHV_CON_EV_READ, now);
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        shv_loop_con_step(thrd, con, SHV_CON_EV_ERROR, now);
+    } else if (queued == 0 && (con->shv_ctx->con_state == SHV_CON_CONN ||
+                               con->shv_ctx->con_state == SHV_CON_CONNECTING)) {
+        /* Connected, or all sent and the messages held back by the congestion go out */
+        shv_loop_con_step(thrd, con, SHV_CON_EV_WAKE, now);
+    } else {
+        /* Only written, the wait for the next event goes on */
+        shv_loop_con_update(thrd, con);
+    }
+}
+
+/* Tell whether the connection was woken by shv_process_wake(). The pipe
+ * is shared, so only a logged in connection is woken to send. Any other
+ * would just restart its wait (reconnect, login) on each wake of the thread.
+ */
+
+static bool shv_loop_con_woken(struct shv_con_ctx *shv_ctx)
+{
+    if (!atomic_load(&shv_ctx->running)) {
+        return true;
+    }
+    return shv_ctx->con_state == SHV_CON_CONN &&
+           (atomic_load(&shv_ctx->chng_dirty) != NULL || shv_txq_pushed(&shv_ctx->txq));
+}
+
+static int shv_loop_timeout(struct shv_loop_thread *thrd, const struct timespec *now)
+{
+    struct shv_loop_con *con;
+    long long ms;
+    long long timeout = -1;
+
+    for (con = thrd->cons; con != NULL; con = con->next) {
+        ms = (con->deadline.tv_sec - now->tv_sec) * 1000LL +
+             (con->deadline.tv_nsec - now->tv_nsec + 999999) / 1000000;
+        if (ms < 0) {
+            ms = 0;
+        }
+        if (timeout < 0 || ms < timeout) {
+            timeout = ms;
+        }
+    }
+
+    return timeout > 1000000 ? 1000000 : (int)timeout;
+}
+
+static bool shv_loop_expired(const struct timespec *deadline, const struct timespec *now)
+{
+    return deadline->tv_sec < now->tv_sec ||
+           (deadline->tv_sec == now->tv_sec && deadline->tv_nsec <= now->tv_nsec);
+}
+
+static void *shv_loop_thread_run(void *arg)
+{
+    struct shv_loop_thread *thrd = (struct shv_loop_thread *)arg;
+    struct epoll_event events[SHV_LOOP_EVENTS];
+    struct shv_loop_con *added;
+    struct shv_loop_con *con;
+    struct shv_loop_con **pcon;
+    struct timespec now;
+    bool woken;
+    bool stop;
+    char buf[16];
+    int n;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&thrd->lock);
+        added = thrd->added;
+        thrd->added = NULL;
+        stop = thrd->stop;
+        pthread_mutex_unlock(&thrd->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        /* Connect the added connections */
+        while (added != NULL) {
+            con = added;
+            added = con->next;
+            con->next = thrd->cons;
+            thrd->cons = con;
+            if (stop) {
+                shv_loop_con_finish(thrd, con, 0);
+            } else {
+                shv_loop_con_step(thrd, con, SHV_CON_EV_TIMEOUT, &now);
+            }
+        }
+
+        /* Close the connections, the state machine finds it is not running anymore */
+        if (stop) {
+            for (con = thrd->cons; con != NULL; con = con->next) {
+                if (!con->done) {
+                    atomic_store(&con->shv_ctx->running, false);
+                    shv_loop_con_step(thrd, con, SHV_CON_EV_WAKE, &now);
+                }
+            }
+        }
+
+        /* Drop the finished connections */
+        pcon = &thrd->cons;
+        while ((con = *pcon) != NULL) {
+            if (con->done) {
+                *pcon = con->next;
+                free(con);
+            } else {
+                pcon = &con->next;
+            }
+        }
+
+        if (stop && thrd->cons == NULL) {
+            break;
+        }
+
+        n = epoll_wait(thrd->epfd, events, SHV_LOOP_EVENTS, shv_loop_timeout(thrd, &now));
+        if (n < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "ERROR: epoll_wait() failed, errno = %d\n", errno);
+                usleep(100000);
+            }
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        woken = false;
+        for (i = 0; i < n; i++) {
+            con = (struct shv_loop_con *)events[i].data.ptr;
+            if (con == NULL) {
+                while (read(thrd->fildes[0], buf, sizeof(buf)) > 0);
+                woken = true;
+            } else if (!con->done) {
+                shv_loop_con_event(thrd, con, events[i].events, &now);
+            }
+        }
+
+        for (con = thrd->cons; con != NULL; con = con->next) {
+            if (con->done) {
+                continue;
+            }
+            if (woken && shv_loop_con_woken(con->shv_ctx)) {
+                shv_loop_con_step(thrd, con, SHV_CON_EV_WAKE, &now);
+            } else if (shv_loop_expired(&con->deadline, &now)) {
+                shv_loop_con_step(thrd, con, SHV_CON_EV_TIMEOUT, &now);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static int shv_loop_thread_init(struct shv_loop_thread *thrd)
+{
+    struct epoll_event ev;
+
+    thrd->added = NULL;
+    thrd->cons = NULL;
+    thrd->stop = false;
+    atomic_init(&thrd->count, 0);
+
+    thrd->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (thrd->epfd < 0) {
+        return -1;
+    }
+    if (pipe(thrd->fildes) < 0) {
+        close(thrd->epfd);
+        return -1;
+    }
+
+    /* Neither the waking threads nor the woken one may block on the pipe */
+    fcntl(thrd->fildes[0], F_SETFL, O_NONBLOCK);
+    fcntl(thrd->fildes[1], F_SETFL, O_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(thrd->epfd, EPOLL_CTL_ADD, thrd->fildes[0], &ev) < 0) {
+        goto error;
+    }
+
+    pthread_mutex_init(&thrd->lock, NULL);
+    if (pthread_create(&thrd->id, NULL, shv_loop_thread_run, thrd) != 0) {
+        pthread_mutex_destroy(&thrd->lock);
+        goto error;
+    }
+    return 0;
+
+error:
+    close(thrd->fildes[0]);
+    close(thrd->fildes[1]);
+    close(thrd->epfd);
+    return -1;
+}
+
+int shv_loop_init(struct shv_loop *loop, int nthreads)
+{
+    loop->nthreads = 0;
+    loop->threads = malloc(nthreads * sizeof(struct shv_loop_thread));
+    if (loop->threads == NULL) {
+        printf("ERROR: Failed to allocate memory for the loop threads\n");
+        return -1;
+    }
+
+    while (loop->nthreads < nthreads) {
+        if (shv_loop_thread_init(&loop->threads[loop->nthreads]) < 0) {
+            printf("ERROR: Failed to create a loop thread\n");
+            shv_loop_destroy(loop);
+            return -1;
+        }
+        loop->nthreads++;
+    }
+
+    return 0;
+}
+
+int shv_loop_add(struct shv_loop *loop, struct shv_con_ctx *shv_ctx)
+{
+    struct shv_loop_thread *thrd = &loop->threads[0];
+    struct shv_loop_con *con;
+    int i;
+
+    if (shv_ctx->connection->tlayer_type != SHV_TLAYER_TCPIP &&
+        shv_ctx->connection->tlayer_type != SHV_TLAYER_SERIAL) {
+        fprintf(stderr, "ERROR: the transport layer cannot be served by the loop\n");
+        return -1;
+    }
+
+    /* Spread the connections over the threads */
+    for (i = 1; i < loop->nthreads; i++) {
+        if (atomic_load(&loop->threads[i].count) < atomic_load(&thrd->count)) {
+            thrd = &loop->threads[i];
+        }
+    }
+
+    con = malloc(sizeof(struct shv_loop_con));
+    if (con == NULL) {
+        printf("ERROR: Failed to allocate memory for the loop connection\n");
+        return -1;
+    }
+    con->shv_ctx = shv_ctx;
+    con->fd = -1;
+    con->connects = 0;
+    con->events = 0;
+    con->done = false;
+
+    atomic_store(&shv_ctx->running, true);
+    shv_ctx->con_state = SHV_CON_NOT_INIT;
+    shv_ctx->thrd_ctx.fildes[0] = thrd->fildes[0];
+    shv_ctx->thrd_ctx.fildes[1] = thrd->fildes[1];
+    atomic_store(&shv_ctx->thrd_ctx.wake_ready, true);
+    atomic_store(&shv_ctx->thrd_ctx.loop_served, true);
+
+    atomic_fetch_add(&thrd->count, 1);
+    pthread_mutex_lock(&thrd->lock);
+    con->next = thrd->added;
+    thrd->added = con;
+    pthread_mutex_unlock(&thrd->lock);
+    shv_loop_wake(thrd);
+
+    return 0;
+}
+
+void shv_loop_destroy(struct shv_loop *loop)
+{
+    struct shv_loop_thread *thrd;
+    int i;
+
+    for (i = 0; i < loop->nthreads; i++) {
+        thrd = &loop->threads[i];
+        pthread_mutex_lock(&thrd->lock);
+        thrd->stop = true;
+        pthread_mutex_unlock(&thrd->lock);
+        shv_loop_wake(thrd);
+    }
+
+    for (i = 0; i < loop->nthreads; i++) {
+        thrd = &loop->threads[i];
+        pthread_join(thrd->id, NULL);
+        pthread_mutex_destroy(&thrd->lock);
+        close(thrd->fildes[0]);
+        close(thrd->fildes[1]);
+        close(thrd->epfd);
+    }
+
+    free(loop->threads);
+    loop->threads = NULL;
+    loop->nthreads = 0;
+}
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 
 #include <shv/tree/shv_methods.h>
 #include <ulut/ul_utdefs.h>
@@ -82,23 +83,38 @@ const struct shv_method_des * const shv_root_dmap_items[] = {
   &shv_dmap_item_ls,
 };
 
-const struct shv_dmap shv_double_dmap = {.methods = {.items = (void **)shv_double_dmap_items,
-                                                .count = sizeof(shv_double_dmap_items)/sizeof(shv_double_dmap_items[0]),
-                                                .alloc_count = 0,
-                                               }};
-const struct shv_dmap shv_double_read_only_dmap = {.methods = {.items = (void **)shv_double_read_only_dmap_items,
-                                              .count = sizeof(shv_double_read_only_dmap_items)/sizeof(shv_double_read_only_dmap_items[0]),
-                                              .alloc_count = 0,
-                                              }};
-const struct shv_dmap shv_dir_ls_dmap = {.methods = {.items = (void **)shv_dir_ls_dmap_items,
-                                                .count = sizeof(shv_dir_ls_dmap_items)/sizeof(shv_dir_ls_dmap_items[0]),
-                                                .alloc_count = 0,
-                                               }};
-
-const struct shv_dmap shv_root_dmap = {.methods = {.items = (void **)shv_root_dmap_items,
-                                              .count = sizeof(shv_root_dmap_items)/sizeof(shv_root_dmap_items[0]),
-                                              .alloc_count = 0,
-                                             }};
+const struct shv_dmap shv_double_dmap =
+  SHV_CREATE_NODE_DMAP(double, shv_double_dmap_items);
+const struct shv_dmap shv_double_read_only_dmap =
+  SHV_CREATE_NODE_DMAP(double_read_only, shv_double_read_only_dmap_items);
+const struct shv_dmap shv_dir_ls_dmap =
+  SHV_CREATE_NODE_DMAP(dir_ls, shv_dir_ls_dmap_items);
+const struct shv_dmap shv_root_dmap =
+  SHV_CREATE_NODE_DMAP(root, shv_root_dmap_items);
+
+/****************************************************************************
+ * Name: shv_packed_result_publish
+ *
+ * Description:
+ *   Store the result to an empty cache. If another thread was faster,
+ *   its result is returned instead.
+ *
+ ****************************************************************************/
+
+static const struct shv_packed_result *
+shv_packed_result_publish(_Atomic(struct shv_packed_result *) *cache,
+                          struct shv_packed_result *res)
+{
+  struct shv_packed_result *cached = NULL;
+
+  if (res != NULL && !atomic_compare_exchange_strong(cache, &cached, res))
+    {
+      free(res);
+      return cached;
+    }
+
+  return res;
+}
 
 /****************************************************************************
  * Name: shv_ls
@@ -111,21 +127,56 @@ const struct shv_dmap shv_root_dmap = {.methods = {.items = (void **)shv_root_dm
 int shv_ls(struct shv_con_ctx * shv_ctx, struct shv_node* item, int rid)
 {
   int count;
+  unsigned int gen;
   struct shv_node_list_names_it names_it;
+  struct shv_node_provider_names_it provider_it;
+  struct shv_packed_result *res = NULL;
 
   shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
 
-  /* Get item's children count */
+  /* Virtual children are generated on each request */
 
+  if (item->provider != NULL)
+    {
+      shv_node_provider_names_it_init(item, &provider_it);
+      shv_send_str_list_it(shv_ctx, rid, item->provider->child_count(item),
+                           &provider_it.str_it);
+      return 0;
+    }
+
+  /* Get item's children count, the list is cached for this generation */
+
+  gen = shv_tree_generation();
   count = shv_node_list_count(&item->children);
 
   /* Find each child */
 
   shv_node_list_names_it_init(&item->children, &names_it);
 
-  /* And send it */
+  /* And send it, the list is packed once until a child is added.
+   * Static nodes may be placed in read-only memory, nothing is cached there.
+   * The reference keeps the list while sent, even if a child is added.
+   */
+
+  if ((item->children.mode & SHV_NLIST_MODE_STATIC) == 0)
+    {
+      res = shv_node_ls_cache_get(item);
+      if (res == NULL)
+        {
+          res = shv_node_ls_cache_publish(item,
+            shv_pack_result_str_list_it(count, &names_it.str_it), gen);
+        }
+    }
 
-  shv_send_str_list_it(shv_ctx, rid, count, &names_it.str_it);
+  if (res != NULL)
+    {
+      shv_send_packed_result(shv_ctx, rid, res);
+      shv_packed_result_put(res);
+    }
+  else
+    {
+      shv_send_str_list_it(shv_ctx, rid, count, &names_it.str_it);
+    }
 
   return 0;
 }
@@ -140,27 +191,31 @@ int shv_ls(struct shv_con_ctx * shv_ctx, struct shv_node* item, int rid)
 
 int shv_dir(struct shv_con_ctx * shv_ctx, struct shv_node* item, int rid)
 {
-  int met_num;
-  int i;
+  const struct shv_packed_result *res;
 
   shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
 
-  /* Is the node a parameter? */
-
-  met_num = item->dir->methods.count;
-  struct shv_dir_res responses[met_num];
-  memset(responses, 0, sizeof *responses * met_num);
+  /* The methods are described straight from the node's dmap,
+   * packed once if it has a cache
+   */
 
-  for (i = 0; i < met_num; i++)
+  if (item->dir->cache != NULL)
     {
-      responses[i].name = shv_dmap_at(item->dir, i)->name;
-      responses[i].flags = shv_dmap_at(item->dir, i)->flags;
-      responses[i].param = shv_dmap_at(item->dir, i)->param;
-      responses[i].result = shv_dmap_at(item->dir, i)->result;
-      responses[i].access = shv_dmap_at(item->dir, i)->access;
+      res = atomic_load(&item->dir->cache->dir);
+      if (res == NULL)
+        {
+          res = shv_packed_result_publish(&item->dir->cache->dir,
+                                          shv_pack_result_dir_dmap(item->dir));
+        }
+
+      if (res != NULL)
+        {
+          shv_send_packed_result(shv_ctx, rid, res);
+          return 0;
+        }
     }
 
-  shv_send_dir(shv_ctx, responses, met_num, rid);
+  shv_send_dir_dmap(shv_ctx, item->dir, rid);
 
   return 0;
 }
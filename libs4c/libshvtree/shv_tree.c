@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 
 #include <shv/tree/shv_tree.h>
 #include <shv/tree/shv_com.h>
@@ -35,6 +36,14 @@ GSA_CUST_IMP(shv_node_list_gsa, struct shv_node_list, struct shv_node,
 GSA_CUST_IMP(shv_dmap, struct shv_dmap, struct shv_method_des, shv_method_des_key_t,
 	           methods, name, shv_method_des_comp_func, 0)
 
+/* Tree generation, changed by every change of the tree structure */
+
+static atomic_uint shv_tree_gen;
+
+/* Guards ls_cache of the nodes, a result is referenced under it */
+
+static pthread_mutex_t shv_ls_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * @brief Basic SHV node destructor
  *
@@ -48,60 +57,855 @@ static void shv_node_destructor(struct shv_node *node)
 /**
  * @brief Destructor for struct shv_node_typed_val
  *
- * @param node
- */
-static void shv_typed_val_node_destructor(struct shv_node *node)
+ * @param node
+ */
+static void shv_typed_val_node_destructor(struct shv_node *node)
+{
+  struct shv_node_typed_val *typed_node = UL_CONTAINEROF(node, struct shv_node_typed_val, shv_node);
+  free(typed_node);
+}
+
+/****************************************************************************
+ * Name: shv_node_find_path
+ *
+ * Description:
+ *   Find node based on a path of given length, the path does not have
+ *   to be NUL terminated. Children of nodes with a provider are resolved
+ *   by it to the scratch, their number is added to vnodes.
+ *
+ ****************************************************************************/
+
+static struct shv_node *shv_node_find_path(struct shv_node *node, const char *path,
+                                           size_t path_len,
+                                           struct shv_vnode_scratch *scratch,
+                                           unsigned int *vnodes)
+{
+  char path_buf[SHV_PATH_LEN];
+  char *p;
+  char *r;
+  char *s;
+  char sentinel = 0;
+
+  if (path_len == 0)
+    {
+      return node;
+    }
+
+  /* Split the path to NUL terminated names in a copy, usually on stack */
+
+  if (path_len < sizeof(path_buf))
+    {
+      p = path_buf;
+    }
+  else
+    {
+      p = malloc(path_len + 1);
+      if (p == NULL)
+        {
+          return NULL;
+        }
+    }
+
+  memcpy(p, path, path_len);
+  p[path_len] = '\0';
+  r = p;
+
+  do
+    {
+      s = strchr(r, '/');
+      const char *t = r;
+      if (s == NULL)
+        {
+          r = &sentinel;
+        }
+      else
+        {
+          *s = '\0';
+          r = s + 1;
+        }
+      if (node->provider != NULL)
+        {
+          node = node->provider->find_child(node, t, scratch);
+          (*vnodes)++;
+        }
+      else if (node->children.mode & SHV_NLIST_MODE_GSA)
+        {
+          node = shv_node_list_gsa_find(&node->children, &t);
+        }
+      else
+        {
+          node = shv_node_list_gavl_find(&node->children, &t);
+        }
+    } while ((node != NULL) && (*r));
+
+  if (p != path_buf)
+    {
+      free(p);
+    }
+
+  return node;
+}
+
+/****************************************************************************
+ * Name: shv_node_find_vn
+ *
+ * Description:
+ *   Find node based on a path of given length, the path does not have
+ *   to be NUL terminated. Children of nodes with a provider are resolved
+ *   by it to the scratch.
+ *
+ ****************************************************************************/
+
+struct shv_node *shv_node_find_vn(struct shv_node *node, const char *path,
+                                  size_t path_len, struct shv_vnode_scratch *scratch)
+{
+  unsigned int vnodes = 0;
+
+  return shv_node_find_path(node, path, path_len, scratch, &vnodes);
+}
+
+/****************************************************************************
+ * Name: shv_node_find_n
+ *
+ * Description:
+ *   Find node based on a path of given length, the path does not have
+ *   to be NUL terminated.
+ *
+ ****************************************************************************/
+
+struct shv_node *shv_node_find_n(struct shv_node *node, const char *path,
+                                 size_t path_len)
+{
+  return shv_node_find_vn(node, path, path_len, NULL);
+}
+
+/****************************************************************************
+ * Name: shv_vnode_alloc
+ *
+ * Description:
+ *   Allocate zeroed memory of a virtual node from the scratch.
+ *
+ ****************************************************************************/
+
+void *shv_vnode_alloc(struct shv_vnode_scratch *scratch, size_t size)
+{
+  const size_t align = _Alignof(max_align_t);
+  size_t offs;
+
+  if (scratch == NULL)
+    {
+      return NULL;
+    }
+
+  offs = (scratch->used + align - 1) & ~(align - 1);
+  if (offs > scratch->size || scratch->size - offs < size)
+    {
+      return NULL;
+    }
+
+  scratch->used = offs + size;
+  memset(scratch->buf + offs, 0, size);
+  return scratch->buf + offs;
+}
+
+/****************************************************************************
+ * Name: shv_vnode_strdup
+ *
+ * Description:
+ *   Copy a virtual node name to the scratch.
+ *
+ ****************************************************************************/
+
+char *shv_vnode_strdup(struct shv_vnode_scratch *scratch, const char *name)
+{
+  size_t len = strlen(name) + 1;
+  char *copy;
+
+  if (scratch == NULL || scratch->size - scratch->used < len)
+    {
+      return NULL;
+    }
+
+  copy = scratch->buf + scratch->used;
+  scratch->used += len;
+  memcpy(copy, name, len);
+  return copy;
+}
+
+/****************************************************************************
+ * Name: shv_tree_vnode_init
+ *
+ * Description:
+ *   Initialize a virtual node. It is never freed and caches nothing,
+ *   so it is static.
+ *
+ ****************************************************************************/
+
+void shv_tree_vnode_init(struct shv_node *item, const char *name,
+                         const struct shv_dmap *dir,
+                         const struct shv_node_provider *provider)
+{
+  shv_tree_node_init(item, name, dir, SHV_NLIST_MODE_GSA | SHV_NLIST_MODE_STATIC);
+  item->vtable.destructor = NULL;
+  item->provider = provider;
+}
+
+/****************************************************************************
+ * Name: shv_node_find
+ *
+ * Description:
+ *   Find node based on a path.
+ *
+ ****************************************************************************/
+
+struct shv_node *shv_node_find(struct shv_node *node, const char * path)
+{
+  return shv_node_find_n(node, path, strlen(path));
+}
+
+/****************************************************************************
+ * Name: shv_tree_generation
+ *
+ * Description:
+ *   Get the tree generation number.
+ *
+ ****************************************************************************/
+
+unsigned int shv_tree_generation(void)
+{
+  return atomic_load(&shv_tree_gen);
+}
+
+/****************************************************************************
+ * Name: shv_node_ls_cache_get
+ *
+ * Description:
+ *   Get a reference to the cached result of ls of the node.
+ *
+ ****************************************************************************/
+
+struct shv_packed_result *shv_node_ls_cache_get(struct shv_node *node)
+{
+  struct shv_packed_result *res;
+
+  pthread_mutex_lock(&shv_ls_cache_lock);
+  res = node->ls_cache;
+  if (res != NULL)
+    {
+      atomic_fetch_add(&res->refs, 1);
+    }
+  pthread_mutex_unlock(&shv_ls_cache_lock);
+
+  return res;
+}
+
+/****************************************************************************
+ * Name: shv_node_ls_cache_publish
+ *
+ * Description:
+ *   Cache the result of ls unless the tree changed or another thread
+ *   was faster, its result is returned instead then.
+ *
+ ****************************************************************************/
+
+struct shv_packed_result *shv_node_ls_cache_publish(struct shv_node *node,
+                                                    struct shv_packed_result *res,
+                                                    unsigned int gen)
+{
+  struct shv_packed_result *cached;
+
+  if (res == NULL)
+    {
+      return NULL;
+    }
+
+  pthread_mutex_lock(&shv_ls_cache_lock);
+  cached = node->ls_cache;
+  if (cached != NULL)
+    {
+      atomic_fetch_add(&cached->refs, 1);
+    }
+  else if (gen == shv_tree_generation())
+    {
+      /* The children were not changed while packed */
+
+      atomic_fetch_add(&res->refs, 1);
+      node->ls_cache = res;
+    }
+  pthread_mutex_unlock(&shv_ls_cache_lock);
+
+  if (cached != NULL)
+    {
+      shv_packed_result_put(res);
+      return cached;
+    }
+
+  return res;
+}
+
+/****************************************************************************
+ * Name: shv_node_ls_cache_drop
+ *
+ * Description:
+ *   Drop the cached result of ls, it is freed once not sent anymore.
+ *   Bump the tree generation first, a result being packed is not cached.
+ *
+ ****************************************************************************/
+
+static void shv_node_ls_cache_drop(struct shv_node *node)
+{
+  struct shv_packed_result *res;
+
+  pthread_mutex_lock(&shv_ls_cache_lock);
+  res = node->ls_cache;
+  node->ls_cache = NULL;
+  pthread_mutex_unlock(&shv_ls_cache_lock);
+
+  shv_packed_result_put(res);
+}
+
+/****************************************************************************
+ * Name: shv_tree_count_nodes
+ *
+ * Description:
+ *   Count the nodes of the tree, virtual nodes are not counted.
+ *
+ ****************************************************************************/
+
+static size_t shv_tree_count_nodes(struct shv_node *node)
+{
+  struct shv_node_list_it it;
+  size_t count = 1;
+  int n;
+  int i;
+
+  if (node->provider != NULL)
+    {
+      return count;
+    }
+
+  n = shv_node_list_count(&node->children);
+  shv_node_list_it_init(&node->children, &it);
+  for (i = 0; i < n; i++)
+    {
+      count += shv_tree_count_nodes(shv_node_list_it_next(&it));
+    }
+
+  return count;
+}
+
+/****************************************************************************
+ * Name: shv_path_index_rebuild
+ *
+ * Description:
+ *   Drop all entries of the index and size it for the current tree.
+ *
+ ****************************************************************************/
+
+static void shv_path_index_rebuild(struct shv_path_index *index, unsigned int gen)
+{
+  struct shv_path_index_entry *entries;
+  size_t count = shv_tree_count_nodes(index->root);
+  size_t size = 16;
+
+  if (count > index->max_count)
+    {
+      count = index->max_count;
+    }
+
+  while (size < count + count / 2)
+    {
+      size *= 2;
+    }
+
+  if (size != index->capacity)
+    {
+      entries = calloc(size, sizeof(struct shv_path_index_entry));
+      if (entries != NULL)
+        {
+          free(index->entries);
+          index->entries = entries;
+          index->capacity = size;
+        }
+    }
+
+  memset(index->entries, 0, index->capacity * sizeof(struct shv_path_index_entry));
+  index->count = 0;
+  index->paths_len = 0;
+  index->paths_live = 0;
+  index->gen = gen;
+}
+
+/* The indexes of the roots, shared by the connections */
+
+static pthread_mutex_t shv_path_indexes_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shv_path_index *shv_path_indexes;
+
+/****************************************************************************
+ * Name: shv_path_index_free
+ *
+ * Description:
+ *   Free the path index.
+ *
+ ****************************************************************************/
+
+static void shv_path_index_free(struct shv_path_index *index)
+{
+  pthread_mutex_destroy(&index->lock);
+  free(index->entries);
+  free(index->paths);
+  free(index);
+}
+
+/****************************************************************************
+ * Name: shv_path_index_get
+ *
+ * Description:
+ *   Get the index of the root, allocate it if there is none yet.
+ *
+ ****************************************************************************/
+
+struct shv_path_index *shv_path_index_get(struct shv_node *root, size_t max_count)
+{
+  struct shv_path_index *index;
+
+  pthread_mutex_lock(&shv_path_indexes_lock);
+  for (index = shv_path_indexes; index != NULL; index = index->next)
+    {
+      if (index->root == root)
+        {
+          index->refs++;
+          pthread_mutex_unlock(&shv_path_indexes_lock);
+          return index;
+        }
+    }
+
+  index = calloc(1, sizeof(struct shv_path_index));
+  if (index == NULL)
+    {
+      pthread_mutex_unlock(&shv_path_indexes_lock);
+      return NULL;
+    }
+
+  pthread_mutex_init(&index->lock, NULL);
+  index->root = root;
+  index->max_count = max_count;
+  shv_path_index_rebuild(index, shv_tree_generation());
+  if (index->entries == NULL)
+    {
+      shv_path_index_free(index);
+      pthread_mutex_unlock(&shv_path_indexes_lock);
+      return NULL;
+    }
+
+  index->refs = 1;
+  index->next = shv_path_indexes;
+  shv_path_indexes = index;
+  pthread_mutex_unlock(&shv_path_indexes_lock);
+  return index;
+}
+
+/****************************************************************************
+ * Name: shv_path_index_put
+ *
+ * Description:
+ *   Release the index, free it once no connection uses it.
+ *
+ ****************************************************************************/
+
+void shv_path_index_put(struct shv_path_index *index)
+{
+  struct shv_path_index **prev;
+
+  if (index == NULL)
+    {
+      return;
+    }
+
+  pthread_mutex_lock(&shv_path_indexes_lock);
+  if (--index->refs > 0)
+    {
+      pthread_mutex_unlock(&shv_path_indexes_lock);
+      return;
+    }
+
+  for (prev = &shv_path_indexes; *prev != index; prev = &(*prev)->next);
+  *prev = index->next;
+  pthread_mutex_unlock(&shv_path_indexes_lock);
+
+  shv_path_index_free(index);
+}
+
+/****************************************************************************
+ * Name: shv_name_hash
+ *
+ * Description:
+ *   FNV-1a hash of a path or a name of given length.
+ *
+ ****************************************************************************/
+
+static inline uint32_t shv_name_hash(const char *name, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    {
+      hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+
+  return hash;
+}
+
+/****************************************************************************
+ * Name: shv_path_index_lookup
+ *
+ * Description:
+ *   Find the entry of the path. Returns NULL if it is not indexed, slot
+ *   is the first free entry then.
+ *
+ ****************************************************************************/
+
+static struct shv_path_index_entry *
+shv_path_index_lookup(struct shv_path_index *index, const char *path,
+                      size_t path_len, uint32_t hash, size_t *slot)
+{
+  struct shv_path_index_entry *entry;
+  size_t mask = index->capacity - 1;
+  size_t i;
+
+  for (i = hash & mask; index->entries[i].node != NULL; i = (i + 1) & mask)
+    {
+      entry = &index->entries[i];
+      if (entry->hash == hash && entry->path_len == path_len &&
+          memcmp(index->paths + entry->path_offs, path, path_len) == 0)
+        {
+          return entry;
+        }
+    }
+
+  *slot = i;
+  return NULL;
+}
+
+/****************************************************************************
+ * Name: shv_path_index_store
+ *
+ * Description:
+ *   Store the path to the paths of the index. The unused paths are dropped
+ *   before the buffer grows, unless they take less than half of it.
+ *   Returns the offset of the path, -1 if memory cannot be allocated.
+ *
+ ****************************************************************************/
+
+static ssize_t shv_path_index_store(struct shv_path_index *index, const char *path,
+                                    size_t path_len)
+{
+  size_t offs;
+  size_t i;
+  char *paths;
+
+  if (index->paths_size - index->paths_len < path_len &&
+      (index->paths_live + path_len) * 2 <= index->paths_size)
+    {
+      paths = malloc(index->paths_size);
+      if (paths == NULL)
+        {
+          return -1;
+        }
+
+      offs = 0;
+      for (i = 0; i < index->capacity; i++)
+        {
+          struct shv_path_index_entry *entry = &index->entries[i];
+
+          if (entry->node != NULL)
+            {
+              memcpy(paths + offs, index->paths + entry->path_offs, entry->path_len);
+              entry->path_offs = offs;
+              offs += entry->path_len;
+            }
+        }
+
+      free(index->paths);
+      index->paths = paths;
+      index->paths_len = offs;
+    }
+
+  if (index->paths_size - index->paths_len < path_len)
+    {
+      size_t size = index->paths_size ? index->paths_size : 1024;
+
+      while (size - index->paths_len < path_len)
+        {
+          size *= 2;
+        }
+
+      paths = realloc(index->paths, size);
+      if (paths == NULL)
+        {
+          return -1;
+        }
+
+      index->paths = paths;
+      index->paths_size = size;
+    }
+
+  offs = index->paths_len;
+  memcpy(index->paths + offs, path, path_len);
+  index->paths_len += path_len;
+  return offs;
+}
+
+/****************************************************************************
+ * Name: shv_path_index_add
+ *
+ * Description:
+ *   Index the node of the path. The table is kept at most 2/3 full,
+ *   a full one replaces the entry the path hashes to.
+ *
+ ****************************************************************************/
+
+static void shv_path_index_add(struct shv_path_index *index, const char *path,
+                               size_t path_len, uint32_t hash, struct shv_node *node)
 {
-  struct shv_node_typed_val *typed_node = UL_CONTAINEROF(node, struct shv_node_typed_val, shv_node);
-  free(typed_node);
+  struct shv_path_index_entry *entry;
+  ssize_t offs;
+  size_t i;
+
+  if (shv_path_index_lookup(index, path, path_len, hash, &i) != NULL)
+    {
+      /* Indexed by another connection meanwhile */
+
+      return;
+    }
+
+  entry = &index->entries[i];
+  if ((index->count + 1) * 3 > index->capacity * 2)
+    {
+      /* Replace the entry the path hashes to, the probe sequences going
+       * through stay intact. It is free only if the path is the first
+       * one there, which is not indexed then to keep some entries free.
+       */
+
+      entry = &index->entries[hash & (index->capacity - 1)];
+      if (entry->node == NULL)
+        {
+          return;
+        }
+    }
+
+  offs = shv_path_index_store(index, path, path_len);
+  if (offs < 0)
+    {
+      return;
+    }
+
+  if (entry->node != NULL)
+    {
+      index->paths_live -= entry->path_len;
+    }
+  else
+    {
+      index->count++;
+    }
+
+  entry->hash = hash;
+  entry->path_len = path_len;
+  entry->path_offs = offs;
+  entry->node = node;
+  index->paths_live += path_len;
 }
 
 /****************************************************************************
- * Name: shv_node_find
+ * Name: shv_path_index_find
  *
  * Description:
- *   Find node based on a path.
+ *   Find node based on a path, using and updating the index.
  *
  ****************************************************************************/
 
-struct shv_node *shv_node_find(struct shv_node *node, const char * path)
+struct shv_node *shv_path_index_find(struct shv_path_index *index, struct shv_node *root,
+                                     const char *path, size_t path_len,
+                                     struct shv_vnode_scratch *scratch)
 {
-  if (strlen(path) == 0)
+  struct shv_path_index_entry *entry;
+  struct shv_node *node;
+  unsigned int vnodes = 0;
+  unsigned int gen;
+  uint32_t hash;
+  size_t i;
+
+  if (index == NULL || index->root != root || path_len == 0 || path_len > UINT32_MAX)
+    {
+      return shv_node_find_vn(root, path, path_len, scratch);
+    }
+
+  hash = shv_name_hash(path, path_len);
+
+  pthread_mutex_lock(&index->lock);
+  gen = shv_tree_generation();
+  if (index->gen != gen)
+    {
+      shv_path_index_rebuild(index, gen);
+    }
+
+  entry = shv_path_index_lookup(index, path, path_len, hash, &i);
+  node = entry != NULL ? entry->node : NULL;
+  pthread_mutex_unlock(&index->lock);
+  if (node != NULL)
     {
       return node;
     }
 
-  char *p = strdup(path);
-  char *r = p;
-  char *s;
-  char sentinel = 0;
+  node = shv_node_find_path(root, path, path_len, scratch, &vnodes);
+  if (node == NULL || vnodes > 0)
+    {
+      /* Virtual nodes do not outlive the scratch */
 
-  do
+      return node;
+    }
+
+  pthread_mutex_lock(&index->lock);
+  if (index->gen == gen)
     {
-      s = strchr(r, '/');
-      const char *t = r;
-      if (s == NULL)
+      shv_path_index_add(index, path, path_len, hash, node);
+    }
+
+  pthread_mutex_unlock(&index->lock);
+  return node;
+}
+
+/****************************************************************************
+ * Name: shv_dmap_bsearch_n
+ *
+ * Description:
+ *   Find method by a name of given length, the name does not have to be
+ *   NUL terminated. Same binary search as shv_dmap_find() performs.
+ *
+ ****************************************************************************/
+
+static const struct shv_method_des *shv_dmap_bsearch_n(const struct shv_dmap *dmap,
+                                                       const char *name, size_t len)
+{
+  int lo = 0;
+  int hi = dmap->methods.count;
+
+  while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      const struct shv_method_des *met = dmap->methods.items[mid];
+      int cmp = strncmp(met->name, name, len);
+
+      if (cmp == 0 && met->name[len] != '\0')
         {
-          r = &sentinel;
+          cmp = 1;
         }
-      else
+
+      if (cmp == 0)
         {
-          *s = '\0';
-          r = s + 1;
+          return met;
         }
-      if (node->children.mode & SHV_NLIST_MODE_GSA)
+      else if (cmp < 0)
         {
-          node = shv_node_list_gsa_find(&node->children, &t);
+          lo = mid + 1;
         }
       else
         {
-          node = shv_node_list_gavl_find(&node->children, &t);
+          hi = mid;
         }
-    } while ((node != NULL) && (*r));
+    }
 
-  free(p);
+  return NULL;
+}
 
-  return node;
+/****************************************************************************
+ * Name: shv_dmap_index_build
+ *
+ * Description:
+ *   Fill the hashed index of the dmap methods. Only the first caller
+ *   builds it, the others keep using the binary search meanwhile.
+ *
+ ****************************************************************************/
+
+static bool shv_dmap_index_build(const struct shv_dmap *dmap)
+{
+  struct shv_dmap_index *index = dmap->index;
+  int state = 0;
+  int i;
+
+  if (!atomic_compare_exchange_strong(&index->state, &state, 1))
+    {
+      return state == 2;
+    }
+
+  if (index->size == 0 || index->size < 2 * (unsigned int)dmap->methods.count)
+    {
+      /* Too small to be of use, stay in the building state for good */
+
+      return false;
+    }
+
+  for (i = 0; i < dmap->methods.count; i++)
+    {
+      const struct shv_method_des *met = dmap->methods.items[i];
+      uint32_t hash = shv_name_hash(met->name, strlen(met->name));
+      unsigned int j = hash % index->size;
+
+      while (index->slots[j].item != 0)
+        {
+          j = j + 1 < index->size ? j + 1 : 0;
+        }
+
+      index->slots[j].hash = hash;
+      index->slots[j].item = i + 1;
+    }
+
+  atomic_store_explicit(&index->state, 2, memory_order_release);
+  return true;
+}
+
+/****************************************************************************
+ * Name: shv_dmap_find_n
+ *
+ * Description:
+ *   Find method by a name of given length, the name does not have to be
+ *   NUL terminated. The hashed index of the dmap is used if it has one,
+ *   the binary search otherwise.
+ *
+ ****************************************************************************/
+
+const struct shv_method_des *shv_dmap_find_n(const struct shv_dmap *dmap,
+                                             const char *name, size_t len)
+{
+  struct shv_dmap_index *index = dmap->index;
+  uint32_t hash;
+  unsigned int i;
+
+  if (index == NULL ||
+      (atomic_load_explicit(&index->state, memory_order_acquire) != 2 &&
+       !shv_dmap_index_build(dmap)))
+    {
+      return shv_dmap_bsearch_n(dmap, name, len);
+    }
+
+  hash = shv_name_hash(name, len);
+  for (i = hash % index->size; index->slots[i].item != 0;
+       i = i + 1 < index->size ? i + 1 : 0)
+    {
+      if (index->slots[i].hash == hash)
+        {
+          const struct shv_method_des *met =
+            dmap->methods.items[index->slots[i].item - 1];
+
+          if (strncmp(met->name, name, len) == 0 && met->name[len] == '\0')
+            {
+              return met;
+            }
+        }
+    }
+
+  return NULL;
 }
 
 /****************************************************************************
@@ -211,6 +1015,55 @@ void shv_node_list_names_it_init(struct shv_node_list *list,
   names_it->str_it.get_next_entry = shv_node_list_names_get_next;
 }
 
+/****************************************************************************
+ * Name: shv_node_provider_names_get_next
+ *
+ * Description:
+ *   Helper function for the virtual children names as string list
+ *   iterator.
+ *
+ ****************************************************************************/
+
+static const char *shv_node_provider_names_get_next(struct shv_str_list_it *it,
+                                                    int reset_to_first)
+{
+  struct shv_node_provider_names_it *names_it;
+  struct shv_node *node;
+
+  names_it = UL_CONTAINEROF(it, struct shv_node_provider_names_it, str_it);
+  node = names_it->node;
+
+  if (reset_to_first)
+    {
+      names_it->indx = 0;
+    }
+
+  if (names_it->indx >= node->provider->child_count(node))
+    {
+      return NULL;
+    }
+
+  return node->provider->child_name(node, names_it->indx++, names_it->buf,
+                                    sizeof(names_it->buf));
+}
+
+/****************************************************************************
+ * Name: shv_node_provider_names_it_init
+ *
+ * Description:
+ *   Setup iterator for consecutive access to the names of the children
+ *   provided by the node's provider.
+ *
+ ****************************************************************************/
+
+void shv_node_provider_names_it_init(struct shv_node *node,
+                                     struct shv_node_provider_names_it *names_it)
+{
+  names_it->node = node;
+  names_it->indx = 0;
+  names_it->str_it.get_next_entry = shv_node_provider_names_get_next;
+}
+
 /****************************************************************************
  * Name: shv_tree_add_child
  *
@@ -221,6 +1074,9 @@ void shv_node_list_names_it_init(struct shv_node_list *list,
 
 void shv_tree_add_child(struct shv_node *node, struct shv_node *child)
 {
+  atomic_fetch_add(&shv_tree_gen, 1);
+  shv_node_ls_cache_drop(node);
+
   if (node->children.mode & SHV_NLIST_MODE_GSA)
     {
       shv_node_list_gsa_insert(&node->children, child);
@@ -233,6 +1089,136 @@ void shv_tree_add_child(struct shv_node *node, struct shv_node *child)
     }
 }
 
+/****************************************************************************
+ * Name: shv_tree_bulk_add_child
+ *
+ * Description:
+ *   Append an item to the children of a GSA node without sorting them,
+ *   shv_tree_bulk_finish() has to be called once all are added.
+ *
+ ****************************************************************************/
+
+int shv_tree_bulk_add_child(struct shv_node *node, struct shv_node *child)
+{
+  gsa_array_field_t *children = &node->children.list.gsa.root;
+
+  if ((node->children.mode & SHV_NLIST_MODE_GSA) == 0)
+    {
+      shv_tree_add_child(node, child);
+      return 0;
+    }
+
+  atomic_fetch_add(&shv_tree_gen, 1);
+  shv_node_ls_cache_drop(node);
+
+  if (children->count >= children->alloc_count)
+    {
+      size_t alloc_count = children->count < 8 ? 16 : 2 * children->count;
+      void **items;
+
+      if (children->alloc_count == 0)
+        {
+          /* A static array is copied to the allocated one */
+
+          items = malloc(alloc_count * sizeof(void *));
+          if (items != NULL && children->count > 0)
+            {
+              memcpy(items, children->items, children->count * sizeof(void *));
+            }
+        }
+      else
+        {
+          items = realloc(children->items, alloc_count * sizeof(void *));
+        }
+
+      if (items == NULL)
+        {
+          printf("ERROR: Failed to allocate memory for the children of '%s'\n",
+                 node->name);
+          return -1;
+        }
+
+      children->items = items;
+      children->alloc_count = alloc_count;
+    }
+
+  children->items[children->count++] = child;
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_node_name_comp
+ *
+ * Description:
+ *   Compare names of two nodes for qsort().
+ *
+ ****************************************************************************/
+
+static int shv_node_name_comp(const void *a, const void *b)
+{
+  const struct shv_node *node_a = *(const struct shv_node * const *)a;
+  const struct shv_node *node_b = *(const struct shv_node * const *)b;
+
+  return shv_node_list_comp_func(&node_a->name, &node_b->name);
+}
+
+/****************************************************************************
+ * Name: shv_tree_bulk_finish
+ *
+ * Description:
+ *   Sort the children appended by shv_tree_bulk_add_child() at once.
+ *   A child of the same name as another one is dropped and destroyed,
+ *   as shv_tree_add_child() would not add it.
+ *
+ ****************************************************************************/
+
+int shv_tree_bulk_finish(struct shv_node *node, bool shrink)
+{
+  gsa_array_field_t *children = &node->children.list.gsa.root;
+  int ret = 0;
+  int count;
+  int i;
+
+  if ((node->children.mode & SHV_NLIST_MODE_GSA) == 0 || children->count == 0)
+    {
+      return 0;
+    }
+
+  qsort(children->items, children->count, sizeof(void *), shv_node_name_comp);
+
+  count = 1;
+  for (i = 1; i < children->count; i++)
+    {
+      struct shv_node *child = children->items[i];
+
+      if (shv_node_name_comp(&children->items[count - 1], &child) == 0)
+        {
+          printf("ERROR: Duplicate node '%s' dropped from '%s'\n", child->name,
+                 node->name);
+          shv_tree_destroy(child);
+          ret = -1;
+          continue;
+        }
+
+      children->items[count++] = child;
+    }
+
+  children->count = count;
+
+  if (shrink && children->alloc_count > count)
+    {
+      void **items = realloc(children->items, count * sizeof(void *));
+
+      if (items != NULL)
+        {
+          children->items = items;
+          children->alloc_count = count;
+        }
+    }
+
+  return ret;
+}
+
 /****************************************************************************
  * Name: shv_tree_node_init
  *
@@ -246,6 +1232,8 @@ void shv_tree_node_init(struct shv_node *item, const char *child_name,
 {
   item->name = child_name;
   item->dir = UL_CAST_UNQ1(struct shv_dmap *, dir);
+  item->ls_cache = NULL;
+  item->provider = NULL;
 
   item->children.mode = mode;
 
@@ -260,16 +1248,31 @@ void shv_tree_node_init(struct shv_node *item, const char *child_name,
     }
 }
 
+void *shv_tree_node_alloc(struct shv_arena *arena, size_t size)
+{
+    if (arena != NULL) {
+        return shv_arena_alloc(arena, size);
+    }
+    return calloc(1, size);
+}
+
 struct shv_node *shv_tree_node_new(const char *child_name,
                               const struct shv_dmap *dir, int mode)
 {
-    struct shv_node *item = calloc(1, sizeof(struct shv_node));
+    return shv_tree_arena_node_new(NULL, child_name, dir, mode);
+}
+
+struct shv_node *shv_tree_arena_node_new(struct shv_arena *arena, const char *child_name,
+                                         const struct shv_dmap *dir, int mode)
+{
+    struct shv_node *item = shv_tree_node_alloc(arena, sizeof(struct shv_node));
     if (item == NULL) {
         perror("node calloc");
         return NULL;
     }
     shv_tree_node_init(item, child_name, dir, mode);
-    item->vtable.destructor = shv_node_destructor;
+    /* Arena nodes are freed with the arena */
+    item->vtable.destructor = arena == NULL ? shv_node_destructor : NULL;
     return item;
 }
 
@@ -277,13 +1280,22 @@ struct shv_node_typed_val *shv_tree_node_typed_val_new(const char *child_name,
                                                   const struct shv_dmap *dir,
                                                   int mode)
 {
-    struct shv_node_typed_val *item = calloc(1, sizeof(struct shv_node_typed_val));
+    return shv_tree_arena_node_typed_val_new(NULL, child_name, dir, mode);
+}
+
+struct shv_node_typed_val *shv_tree_arena_node_typed_val_new(struct shv_arena *arena,
+                                                             const char *child_name,
+                                                             const struct shv_dmap *dir,
+                                                             int mode)
+{
+    struct shv_node_typed_val *item = shv_tree_node_alloc(arena,
+                                                          sizeof(struct shv_node_typed_val));
     if (item == NULL) {
         printf("typed_val node calloc");
         return NULL;
     }
     shv_tree_node_init(&item->shv_node, child_name, dir, mode);
-    item->shv_node.vtable.destructor = shv_typed_val_node_destructor;
+    item->shv_node.vtable.destructor = arena == NULL ? shv_typed_val_node_destructor : NULL;
     return item;
 }
 
@@ -299,6 +1311,8 @@ void shv_tree_destroy(struct shv_node *parent)
 {
     struct shv_node *child;
 
+    atomic_fetch_add(&shv_tree_gen, 1);
+
     if (parent->children.mode & SHV_NLIST_MODE_GSA) {
         gsa_cust_for_each_cut(shv_node_list_gsa, &parent->children, child) {
             shv_tree_destroy(child);
@@ -309,44 +1323,91 @@ void shv_tree_destroy(struct shv_node *parent)
         }
     }
 
-    if ((parent->children.mode & SHV_NLIST_MODE_STATIC) == 0) {
+    shv_node_ls_cache_drop(parent);
+
+    if ((parent->children.mode & SHV_NLIST_MODE_STATIC) == 0 &&
+        parent->vtable.destructor != NULL) {
         /* The deallocation must be done according to the node's type */
         parent->vtable.destructor(parent);
     }
 }
 
 /****************************************************************************
- * Name: shv_node_process
+ * Name: shv_node_process_n
  *
  * Description:
- *   Find node based on a path.
+ *   Find the node and call its method.
  *
  ****************************************************************************/
 
-int shv_node_process(struct shv_con_ctx *shv_ctx, int rid, const char *met,
-                     const char *path)
+static int shv_node_process_n(struct shv_con_ctx *shv_ctx, int rid,
+                              const char *met, size_t met_len,
+                              const char *path, size_t path_len)
 {
     /* If the node or method names are too long, the printed lengths is limited */
     char error_msg[80];
 
+    /* The message is formatted before the params are skipped, met and path
+     * may point to the receive buffer which is refilled by skipping.
+     */
+
     /* Find the node */
-    struct shv_node *item = shv_node_find(shv_ctx->root, path);
+    shv_ctx->vnode_scratch.used = 0;
+    struct shv_node *item = shv_path_index_find(shv_ctx->path_index, shv_ctx->root,
+                                                path, path_len, &shv_ctx->vnode_scratch);
     if (item == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "Node '%.*s' does not exist.",
+                 path_len < 40 ? (int)path_len : 40, path);
         shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
-        snprintf(error_msg, sizeof(error_msg), "Node '%.40s' does not exist.", path);
         shv_send_error(shv_ctx, rid, SHV_RE_METHOD_CALL_EXCEPTION, error_msg);
         return 0;
     }
 
     /* Call coresponding method */
-    const struct shv_method_des *met_des = shv_dmap_find(item->dir, &met);
+    const struct shv_method_des *met_des = shv_dmap_find_n(item->dir, met, met_len);
     if (met_des == NULL) {
+        snprintf(error_msg, sizeof(error_msg), "Method '%.*s' does not exist.",
+                 met_len < 40 ? (int)met_len : 40, met);
         shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
-        snprintf(error_msg, sizeof(error_msg), "Method '%.40s' does not exist.", met);
         shv_send_error(shv_ctx, rid, SHV_RE_METHOD_CALL_EXCEPTION, error_msg);
         return 0;
     }
 
+    /* Do not stall the communication by replies the peer does not read */
+    if (shv_com_tx_congested(shv_ctx, SHV_BUF_LEN)) {
+        shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
+        shv_send_error(shv_ctx, rid, SHV_RE_TRY_AGAIN_LATER, "Send queue is full.");
+        return 0;
+    }
+
     met_des->method(shv_ctx, item, rid);
     return 1;
 }
+
+/****************************************************************************
+ * Name: shv_node_process_head
+ *
+ * Description:
+ *   Process request decoded by shv_unpack_rpc_head().
+ *
+ ****************************************************************************/
+
+int shv_node_process_head(struct shv_con_ctx *shv_ctx, const struct shv_rpc_head *head)
+{
+    return shv_node_process_n(shv_ctx, head->rid, head->method, head->method_len,
+                              head->path ? head->path : "", head->path_len);
+}
+
+/****************************************************************************
+ * Name: shv_node_process
+ *
+ * Description:
+ *   Find node based on a path.
+ *
+ ****************************************************************************/
+
+int shv_node_process(struct shv_con_ctx *shv_ctx, int rid, const char *met,
+                     const char *path)
+{
+    return shv_node_process_n(shv_ctx, rid, met, strlen(met), path, strlen(path));
+}
@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_txq.c
+ * @brief Queue of messages submitted to the communication thread
+ *
+ * The queue is the intrusive MPSC queue by Dmitry Vyukov. A producer
+ * exchanges the head and links the previous head to its message after,
+ * the consumer follows the links from the tail. The stub message keeps
+ * the queue never empty.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <shv/tree/shv_txq.h>
+
+void shv_txq_init(struct shv_txq *q)
+{
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+    q->held = NULL;
+    atomic_init(&q->wake, false);
+}
+
+static void shv_txq_link(struct shv_txq *q, struct shv_txq_msg *msg)
+{
+    struct shv_txq_msg *prev;
+
+    atomic_store_explicit(&msg->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange_explicit(&q->head, msg, memory_order_acq_rel);
+
+    /* The consumer stops at prev until this store */
+    atomic_store_explicit(&prev->next, msg, memory_order_release);
+}
+
+bool shv_txq_push(struct shv_txq *q, struct shv_txq_msg *msg)
+{
+    shv_txq_link(q, msg);
+
+    /* Only the first push after the consumer started popping wakes it */
+    return !atomic_exchange(&q->wake, true);
+}
+
+void shv_txq_pop_begin(struct shv_txq *q)
+{
+    atomic_store(&q->wake, false);
+}
+
+bool shv_txq_pushed(struct shv_txq *q)
+{
+    return atomic_load(&q->wake);
+}
+
+void shv_txq_unpop(struct shv_txq *q, struct shv_txq_msg *msg)
+{
+    q->held = msg;
+}
+
+struct shv_txq_msg *shv_txq_pop(struct shv_txq *q)
+{
+    struct shv_txq_msg *tail = q->tail;
+    struct shv_txq_msg *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (q->held != NULL) {
+        tail = q->held;
+        q->held = NULL;
+        return tail;
+    }
+
+    if (tail == &q->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* The tail is the last message unless a push is in progress */
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+        return NULL;
+    }
+
+    shv_txq_link(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static void shv_txq_msg_free(struct shv_txq_msg *msg)
+{
+    free(msg);
+}
+
+struct shv_txq_msg *shv_txq_msg_new(const void *data, size_t len)
+{
+    struct shv_txq_msg *msg = malloc(sizeof(struct shv_txq_msg) + len);
+
+    if (msg == NULL) {
+        return NULL;
+    }
+
+    memcpy(msg + 1, data, len);
+    msg->send = NULL;
+    msg->release = shv_txq_msg_free;
+    msg->data = msg + 1;
+    msg->len = len;
+    return msg;
+}
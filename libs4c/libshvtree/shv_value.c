@@ -0,0 +1,512 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shv_value.c
+ * @brief Value cells shared by the application and the SHV tree
+ */
+
+#include <string.h>
+
+#include <shv/tree/shv_value.h>
+#include <shv/tree/shv_methods.h>
+#include <shv/tree/shv_com_common.h>
+#include <ulut/ul_utdefs.h>
+
+#define SHV_VALUE_NWORDS(len) (((len) + sizeof(unsigned int) - 1) / sizeof(unsigned int))
+
+/* Method descriptors and dmaps of the cell types */
+
+#define SHV_VALUE_DMAPS(vtype, result_sig, param_sig)                        \
+  static const struct shv_method_des shv_value_##vtype##_dmap_item_get = {   \
+    .name = "get",                                                           \
+    .flags = SHV_METHOD_GETTER,                                              \
+    .result = result_sig,                                                    \
+    .access = SHV_ACCESS_READ,                                               \
+    .method = shv_value_get                                                  \
+  };                                                                         \
+  static const struct shv_method_des shv_value_##vtype##_dmap_item_set = {   \
+    .name = "set",                                                           \
+    .flags = SHV_METHOD_SETTER,                                              \
+    .param = param_sig,                                                      \
+    .access = SHV_ACCESS_WRITE,                                              \
+    .method = shv_value_set                                                  \
+  };                                                                         \
+  static const struct shv_method_des * const                                 \
+    shv_value_##vtype##_dmap_items[] = {                                     \
+    &shv_dmap_item_dir,                                                      \
+    &shv_value_##vtype##_dmap_item_get,                                      \
+    &shv_dmap_item_ls,                                                       \
+    &shv_value_##vtype##_dmap_item_set,                                      \
+    &shv_dmap_item_type,                                                     \
+  };                                                                         \
+  static const struct shv_method_des * const                                 \
+    shv_value_##vtype##_read_only_dmap_items[] = {                           \
+    &shv_dmap_item_dir,                                                      \
+    &shv_value_##vtype##_dmap_item_get,                                      \
+    &shv_dmap_item_ls,                                                       \
+    &shv_dmap_item_type,                                                     \
+  };                                                                         \
+  const struct shv_dmap shv_value_##vtype##_dmap =                           \
+    SHV_CREATE_NODE_DMAP(value_##vtype, shv_value_##vtype##_dmap_items);     \
+  const struct shv_dmap shv_value_##vtype##_read_only_dmap =                 \
+    SHV_CREATE_NODE_DMAP(value_##vtype##_read_only,                          \
+                         shv_value_##vtype##_read_only_dmap_items);
+
+SHV_VALUE_DMAPS(double, "d", "d|f")
+SHV_VALUE_DMAPS(int, "i", "i")
+SHV_VALUE_DMAPS(bool, "b", "b")
+SHV_VALUE_DMAPS(str, "s", "s")
+
+/****************************************************************************
+ * Name: shv_value_write
+ *
+ * Description:
+ *   Copy len bytes to the cell, readers are never waited for. Returns -1
+ *   without waiting if another write to the cell is in progress, so
+ *   a writer preempted in the middle of a copy never blocks the others.
+ *
+ ****************************************************************************/
+
+static int shv_value_write(struct shv_value_cell *cell, const void *src,
+                           size_t len)
+{
+  unsigned int words[SHV_VALUE_WORDS];
+  size_t nwords = SHV_VALUE_NWORDS(len);
+  unsigned int seq;
+  size_t i;
+
+  words[nwords - 1] = 0;
+  memcpy(words, src, len);
+
+  seq = atomic_load_explicit(&cell->seq, memory_order_relaxed);
+  if ((seq & 1) ||
+      !atomic_compare_exchange_strong_explicit(&cell->seq, &seq, seq + 1,
+                                               memory_order_relaxed,
+                                               memory_order_relaxed))
+    {
+      return -1;
+    }
+
+  /* The odd sequence number has to be seen before any of the data */
+
+  atomic_thread_fence(memory_order_release);
+
+  for (i = 0; i < nwords; i++)
+    {
+      atomic_store_explicit(&cell->data[i], words[i], memory_order_relaxed);
+    }
+
+  atomic_store_explicit(&cell->seq, seq + 2, memory_order_release);
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_value_read
+ *
+ * Description:
+ *   Copy len bytes from the cell, retry if a write was in progress.
+ *
+ ****************************************************************************/
+
+static void shv_value_read(struct shv_value_cell *cell, void *dst, size_t len)
+{
+  unsigned int words[SHV_VALUE_WORDS];
+  size_t nwords = SHV_VALUE_NWORDS(len);
+  unsigned int seq1;
+  unsigned int seq2;
+  size_t i;
+
+  do
+    {
+      seq1 = atomic_load_explicit(&cell->seq, memory_order_acquire);
+      for (i = 0; i < nwords; i++)
+        {
+          words[i] = atomic_load_explicit(&cell->data[i], memory_order_relaxed);
+        }
+
+      atomic_thread_fence(memory_order_acquire);
+      seq2 = atomic_load_explicit(&cell->seq, memory_order_relaxed);
+    }
+  while ((seq1 & 1) || seq1 != seq2);
+
+  memcpy(dst, words, len);
+}
+
+void shv_value_cell_init(struct shv_value_cell *cell, enum shv_value_type type)
+{
+  size_t i;
+
+  atomic_init(&cell->seq, 0);
+  cell->type = type;
+  for (i = 0; i < SHV_VALUE_WORDS; i++)
+    {
+      atomic_init(&cell->data[i], 0);
+    }
+}
+
+int shv_value_set_double(struct shv_value_cell *cell, double val)
+{
+  return shv_value_write(cell, &val, sizeof(val));
+}
+
+double shv_value_get_double(struct shv_value_cell *cell)
+{
+  double val;
+
+  shv_value_read(cell, &val, sizeof(val));
+  return val;
+}
+
+int shv_value_set_int(struct shv_value_cell *cell, int64_t val)
+{
+  return shv_value_write(cell, &val, sizeof(val));
+}
+
+int64_t shv_value_get_int(struct shv_value_cell *cell)
+{
+  int64_t val;
+
+  shv_value_read(cell, &val, sizeof(val));
+  return val;
+}
+
+int shv_value_set_bool(struct shv_value_cell *cell, bool val)
+{
+  unsigned int word = val;
+
+  return shv_value_write(cell, &word, sizeof(word));
+}
+
+bool shv_value_get_bool(struct shv_value_cell *cell)
+{
+  unsigned int word;
+
+  shv_value_read(cell, &word, sizeof(word));
+  return word != 0;
+}
+
+int shv_value_set_str(struct shv_value_cell *cell, const char *str)
+{
+  char buf[SHV_VALUE_STR_LEN];
+  size_t len = strlen(str);
+  int ret = 0;
+
+  if (len >= SHV_VALUE_STR_LEN)
+    {
+      len = SHV_VALUE_STR_LEN - 1;
+      ret = 1;
+    }
+
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  if (shv_value_write(cell, buf, len + 1) < 0)
+    {
+      return -1;
+    }
+
+  return ret;
+}
+
+size_t shv_value_get_str(struct shv_value_cell *cell, char *buf, size_t size)
+{
+  char str[SHV_VALUE_STR_LEN];
+  size_t len;
+
+  shv_value_read(cell, str, sizeof(str));
+  str[SHV_VALUE_STR_LEN - 1] = '\0';
+  len = strlen(str);
+
+  if (size > 0)
+    {
+      size_t n = len < size ? len : size - 1;
+      memcpy(buf, str, n);
+      buf[n] = '\0';
+    }
+
+  return len;
+}
+
+/****************************************************************************
+ * Name: shv_value_store_item
+ *
+ * Description:
+ *   Store the unpacked item to the cell if it is of the cell type.
+ *   Returns 0 if stored, 1 for a value of different type, 2 if another
+ *   write to the cell was in progress and -1 if the data are malformed.
+ *
+ ****************************************************************************/
+
+static int shv_value_store_item(struct shv_value_cell *cell,
+                                ccpcp_unpack_context *ctx)
+{
+  char buf[SHV_VALUE_STR_LEN];
+  size_t len = 0;
+  int ret = 0;
+
+  switch (cell->type)
+    {
+      case SHV_VALUE_DOUBLE:
+        if (ctx->item.type == CCPCP_ITEM_DOUBLE)
+          {
+            ret = shv_value_set_double(cell, ctx->item.as.Double);
+          }
+        else if (ctx->item.type == CCPCP_ITEM_DECIMAL)
+          {
+            ret = shv_value_set_double(cell,
+              ccpcp_decimal_to_double(ctx->item.as.Decimal.mantisa,
+                                      ctx->item.as.Decimal.exponent));
+          }
+        else if (ctx->item.type == CCPCP_ITEM_INT)
+          {
+            ret = shv_value_set_double(cell, (double)ctx->item.as.Int);
+          }
+        else if (ctx->item.type == CCPCP_ITEM_UINT)
+          {
+            ret = shv_value_set_double(cell, (double)ctx->item.as.UInt);
+          }
+        else
+          {
+            return 1;
+          }
+        break;
+
+      case SHV_VALUE_INT:
+        if (ctx->item.type == CCPCP_ITEM_INT)
+          {
+            ret = shv_value_set_int(cell, ctx->item.as.Int);
+          }
+        else if (ctx->item.type == CCPCP_ITEM_UINT &&
+                 ctx->item.as.UInt <= INT64_MAX)
+          {
+            ret = shv_value_set_int(cell, (int64_t)ctx->item.as.UInt);
+          }
+        else
+          {
+            return 1;
+          }
+        break;
+
+      case SHV_VALUE_BOOL:
+        if (ctx->item.type != CCPCP_ITEM_BOOLEAN)
+          {
+            return 1;
+          }
+        ret = shv_value_set_bool(cell, ctx->item.as.Bool);
+        break;
+
+      case SHV_VALUE_STR:
+        if (ctx->item.type != CCPCP_ITEM_STRING)
+          {
+            return 1;
+          }
+
+        /* Longer strings are read up to the end, but not stored */
+
+        for (;;)
+          {
+            const ccpcp_string *it = &ctx->item.as.String;
+
+            if (len + it->chunk_size < sizeof(buf))
+              {
+                memcpy(buf + len, it->chunk_start, it->chunk_size);
+                len += it->chunk_size;
+              }
+            else
+              {
+                ret = 1;
+              }
+
+            if (it->last_chunk)
+              {
+                break;
+              }
+
+            cchainpack_unpack_next(ctx);
+            if (ctx->err_no != CCPCP_RC_OK)
+              {
+                return -1;
+              }
+          }
+
+        if (ret != 0)
+          {
+            return 1;
+          }
+
+        buf[len] = '\0';
+        ret = shv_value_set_str(cell, buf);
+        break;
+
+      default:
+        return 1;
+    }
+
+  return ret < 0 ? 2 : 0;
+}
+
+/****************************************************************************
+ * Name: shv_value_unpack_param
+ *
+ * Description:
+ *   Unpack the request parameter to the cell. Returns 0 if stored,
+ *   1 if the parameter is missing or of different type, 2 if another
+ *   write to the cell was in progress and -1 if the data are malformed.
+ *
+ ****************************************************************************/
+
+static int shv_value_unpack_param(struct shv_con_ctx *shv_ctx,
+                                  struct shv_value_cell *cell)
+{
+  ccpcp_unpack_context *ctx = &shv_ctx->unpack_ctx;
+  int ret = 1;
+  int64_t key;
+
+  cchainpack_unpack_next(ctx);
+  if (ctx->err_no != CCPCP_RC_OK || ctx->item.type != CCPCP_ITEM_IMAP)
+    {
+      return -1;
+    }
+
+  for (;;)
+    {
+      cchainpack_unpack_next(ctx);
+      if (ctx->err_no != CCPCP_RC_OK)
+        {
+          return -1;
+        }
+
+      if (ctx->item.type == CCPCP_ITEM_CONTAINER_END)
+        {
+          return ret;
+        }
+
+      if (ctx->item.type == CCPCP_ITEM_INT)
+        {
+          key = ctx->item.as.Int;
+        }
+      else if (ctx->item.type == CCPCP_ITEM_UINT)
+        {
+          key = (int64_t)ctx->item.as.UInt;
+        }
+      else if (shv_unpack_discard(shv_ctx) < 0)
+        {
+          return -1;
+        }
+      else
+        {
+          key = -1;
+        }
+
+      /* Value */
+
+      cchainpack_unpack_next(ctx);
+      if (ctx->err_no != CCPCP_RC_OK)
+        {
+          return -1;
+        }
+
+      if (key == 1)
+        {
+          ret = shv_value_store_item(cell, ctx);
+          if (ret < 0)
+            {
+              return -1;
+            }
+        }
+
+      if (shv_unpack_discard(shv_ctx) < 0)
+        {
+          return -1;
+        }
+    }
+}
+
+/****************************************************************************
+ * Name: shv_value_send
+ *
+ * Description:
+ *   Send the value of the cell.
+ *
+ ****************************************************************************/
+
+static void shv_value_send(struct shv_con_ctx *shv_ctx, int rid,
+                           struct shv_value_cell *cell)
+{
+  char str[SHV_VALUE_STR_LEN];
+
+  switch (cell->type)
+    {
+      case SHV_VALUE_DOUBLE:
+        shv_send_double(shv_ctx, rid, shv_value_get_double(cell));
+        break;
+      case SHV_VALUE_INT:
+        shv_send_int64(shv_ctx, rid, shv_value_get_int(cell));
+        break;
+      case SHV_VALUE_BOOL:
+        shv_send_bool(shv_ctx, rid, shv_value_get_bool(cell));
+        break;
+      case SHV_VALUE_STR:
+        shv_value_get_str(cell, str, sizeof(str));
+        shv_send_str(shv_ctx, rid, str);
+        break;
+    }
+}
+
+/****************************************************************************
+ * Name: shv_value_get
+ *
+ * Description:
+ *   Method "get" of a node holding a value cell.
+ *
+ ****************************************************************************/
+
+int shv_value_get(struct shv_con_ctx *shv_ctx, struct shv_node *item, int rid)
+{
+  struct shv_node_typed_val *item_node = UL_CONTAINEROF(item, struct shv_node_typed_val,
+                                                        shv_node);
+
+  shv_unpack_data(&shv_ctx->unpack_ctx, 0, 0);
+
+  shv_value_send(shv_ctx, rid, (struct shv_value_cell *)item_node->val_ptr);
+
+  return 0;
+}
+
+/****************************************************************************
+ * Name: shv_value_set
+ *
+ * Description:
+ *   Method "set" of a node holding a value cell.
+ *
+ ****************************************************************************/
+
+int shv_value_set(struct shv_con_ctx *shv_ctx, struct shv_node *item, int rid)
+{
+  struct shv_node_typed_val *item_node = UL_CONTAINEROF(item, struct shv_node_typed_val,
+                                                        shv_node);
+  struct shv_value_cell *cell = (struct shv_value_cell *)item_node->val_ptr;
+  int ret;
+
+  ret = shv_value_unpack_param(shv_ctx, cell);
+  if (ret < 0)
+    {
+      shv_send_error(shv_ctx, rid, SHV_RE_INVALID_PARAMS, "Garbled data");
+    }
+  else if (ret == 2)
+    {
+      shv_send_error(shv_ctx, rid, SHV_RE_TRY_AGAIN_LATER, "Value is being written");
+    }
+  else if (ret > 0)
+    {
+      shv_send_error(shv_ctx, rid, SHV_RE_INVALID_PARAMS, "Invalid value");
+    }
+  else
+    {
+      shv_value_send(shv_ctx, rid, cell);
+    }
+
+  return 0;
+}
@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file rpc_io.c
+ * @brief Transport layer of the tests, feeds requests and captures replies.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include <shv/tree/shv_com_common.h>
+
+#include "rpc_io.h"
+
+static char in_buf[8192];
+static size_t in_len;
+static size_t in_pos;
+static char out_buf[8192];
+static size_t out_len;
+
+static int rpc_io_read(struct shv_connection *connection, void *buf, size_t len)
+{
+    size_t n = in_len - in_pos;
+
+    (void)connection;
+
+    /* Split the input to exercise the partial frames too */
+    if (n > len) {
+        n = len;
+    }
+    if (n > 100) {
+        n = 100;
+    }
+    memcpy(buf, in_buf + in_pos, n);
+    in_pos += n;
+    return n;
+}
+
+static int rpc_io_write(struct shv_connection *connection, void *buf, size_t len)
+{
+    (void)connection;
+    if (out_len + len <= sizeof(out_buf)) {
+        memcpy(out_buf + out_len, buf, len);
+    }
+    out_len += len;
+    return len;
+}
+
+void rpc_io_init(struct shv_connection *connection)
+{
+    memset(connection, 0, sizeof(*connection));
+    connection->tops.read = rpc_io_read;
+    connection->tops.write = rpc_io_write;
+}
+
+void rpc_io_reset(void)
+{
+    in_len = 0;
+    in_pos = 0;
+    out_len = 0;
+}
+
+void rpc_io_request(int rid, const char *path, const char *method, int cid_cnt,
+                    void (*pack_param)(ccpcp_pack_context *ctx))
+{
+    char body[512];
+    ccpcp_pack_context ctx;
+    ccpcp_pack_context_init(&ctx, body, sizeof(body), NULL);
+
+    cchainpack_pack_uint_data(&ctx, 1);
+    cchainpack_pack_meta_begin(&ctx);
+    cchainpack_pack_int(&ctx, 1);
+    cchainpack_pack_int(&ctx, 1);
+    cchainpack_pack_int(&ctx, TAG_REQUEST_ID);
+    cchainpack_pack_int(&ctx, rid);
+    cchainpack_pack_int(&ctx, TAG_SHV_PATH);
+    cchainpack_pack_string(&ctx, path, strlen(path));
+    cchainpack_pack_int(&ctx, TAG_METHOD);
+    cchainpack_pack_string(&ctx, method, strlen(method));
+    if (cid_cnt > 0) {
+        cchainpack_pack_int(&ctx, TAG_CALLER_IDS);
+        cchainpack_pack_list_begin(&ctx);
+        for (int i = 0; i < cid_cnt; i++) {
+            cchainpack_pack_int(&ctx, 100 + i);
+        }
+        cchainpack_pack_container_end(&ctx);
+    }
+    cchainpack_pack_container_end(&ctx);
+    cchainpack_pack_imap_begin(&ctx);
+    if (pack_param != NULL) {
+        cchainpack_pack_int(&ctx, 1);
+        pack_param(&ctx);
+    }
+    cchainpack_pack_container_end(&ctx);
+    assert(ctx.err_no == CCPCP_RC_OK);
+
+    size_t len = ctx.current - ctx.start;
+    ccpcp_pack_context_init(&ctx, in_buf + in_len, sizeof(in_buf) - in_len, NULL);
+    cchainpack_pack_uint_data(&ctx, len);
+    in_len += ctx.current - ctx.start;
+    assert(in_len + len <= sizeof(in_buf));
+    memcpy(in_buf + in_len, body, len);
+    in_len += len;
+}
+
+void rpc_io_process(struct shv_con_ctx *shv_ctx)
+{
+    while (in_pos < in_len) {
+        int ret = shv_process_input(shv_ctx);
+        assert(ret > 0);
+        (void)ret;
+    }
+    assert(shv_ctx->write_err == 0);
+}
+
+size_t rpc_io_out_len(void)
+{
+    return out_len;
+}
+
+/* The error code of the reply in the frame, 0 for a result */
+
+static int rpc_io_frame_error(ccpcp_unpack_context *ctx, int *rid)
+{
+    int64_t key;
+
+    /* Protocol and the meta data */
+    cchainpack_unpack_next(ctx);
+    cchainpack_unpack_next(ctx);
+    assert(ctx->err_no == CCPCP_RC_OK && ctx->item.type == CCPCP_ITEM_META);
+    for (;;) {
+        cchainpack_unpack_next(ctx);
+        assert(ctx->err_no == CCPCP_RC_OK);
+        if (ctx->item.type == CCPCP_ITEM_CONTAINER_END) {
+            break;
+        }
+        key = ctx->item.as.Int;
+        if (key == TAG_REQUEST_ID) {
+            cchainpack_unpack_next(ctx);
+            *rid = ctx->item.as.Int;
+        } else {
+            cchainpack_skip_value(ctx);
+        }
+    }
+
+    /* The result or the error */
+    cchainpack_unpack_next(ctx);
+    assert(ctx->err_no == CCPCP_RC_OK && ctx->item.type == CCPCP_ITEM_IMAP);
+    cchainpack_unpack_next(ctx);
+    assert(ctx->err_no == CCPCP_RC_OK);
+    if (ctx->item.type == CCPCP_ITEM_CONTAINER_END || ctx->item.as.Int != 3) {
+        return 0;
+    }
+    cchainpack_unpack_next(ctx);
+    assert(ctx->item.type == CCPCP_ITEM_IMAP);
+    cchainpack_unpack_next(ctx);
+    assert(ctx->item.as.Int == 1);
+    cchainpack_unpack_next(ctx);
+    assert(ctx->err_no == CCPCP_RC_OK && ctx->item.type == CCPCP_ITEM_INT);
+    return ctx->item.as.Int;
+}
+
+int rpc_io_reply_error(int rid)
+{
+    size_t pos = 0;
+
+    /* Only the replies fitting the buffer are captured */
+    assert(out_len <= sizeof(out_buf));
+    while (pos < out_len) {
+        ccpcp_unpack_context ctx;
+        bool ok;
+        int frame_rid = -1;
+        int error;
+
+        ccpcp_unpack_context_init(&ctx, out_buf + pos, out_len - pos, NULL, NULL);
+        size_t frame_len = cchainpack_unpack_uint_data(&ctx, &ok);
+        assert(ok);
+        pos += ctx.current - ctx.start;
+
+        ccpcp_unpack_context_init(&ctx, out_buf + pos, frame_len, NULL, NULL);
+        error = rpc_io_frame_error(&ctx, &frame_rid);
+        if (frame_rid == rid) {
+            return error;
+        }
+        pos += frame_len;
+    }
+
+    return -1;
+}
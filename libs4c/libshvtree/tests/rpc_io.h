@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file rpc_io.h
+ * @brief Transport layer of the tests, feeds requests and captures replies.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <shv/chainpack/cchainpack.h>
+#include <shv/tree/shv_com.h>
+
+/**
+ * @brief Use the test transport layer for the connection
+ *
+ * @param connection
+ */
+void rpc_io_init(struct shv_connection *connection);
+
+/**
+ * @brief Forget the requests fed and the replies captured so far
+ */
+void rpc_io_reset(void);
+
+/**
+ * @brief Append a request to the input
+ *
+ * @param rid
+ * @param path
+ * @param method
+ * @param cid_cnt Number of caller IDs
+ * @param pack_param Packs the parameter, NULL for none
+ */
+void rpc_io_request(int rid, const char *path, const char *method, int cid_cnt,
+                    void (*pack_param)(ccpcp_pack_context *ctx));
+
+/**
+ * @brief Let the connection process all of the input
+ *
+ * The input is read by at most 100 bytes to exercise the partial frames.
+ *
+ * @param shv_ctx
+ */
+void rpc_io_process(struct shv_con_ctx *shv_ctx);
+
+/**
+ * @brief Number of bytes written since rpc_io_reset()
+ */
+size_t rpc_io_out_len(void);
+
+/**
+ * @brief Find the reply to the request
+ *
+ * @param rid
+ * @return The error code of the reply, 0 for a result, -1 if there's no reply
+ */
+int rpc_io_reply_error(int rid);
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file test_dispatch_alloc.c
+ * @brief Check requests are served without heap allocations.
+ *
+ * Link with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc so that
+ * the allocations done by the library are counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <shv/chainpack/cchainpack.h>
+#include <shv/tree/shv_tree.h>
+#include <shv/tree/shv_com.h>
+#include <shv/tree/shv_com_common.h>
+#include <shv/tree/shv_methods.h>
+
+#include "rpc_io.h"
+
+#define ROUNDS 100
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+static int alloc_count;
+
+void *__wrap_malloc(size_t size)
+{
+    alloc_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    alloc_count++;
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    alloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+static void pack_set_param(ccpcp_pack_context *ctx)
+{
+    cchainpack_pack_double(ctx, 42.5);
+}
+
+static size_t serve_requests(struct shv_con_ctx *shv_ctx)
+{
+    rpc_io_reset();
+    rpc_io_request(1, "dev/sub/value", "get", 1, NULL);
+    rpc_io_request(2, "dev/sub/value", "set", 2, pack_set_param);
+    rpc_io_request(3, "dev/sub/value", "get", 20, NULL);
+    rpc_io_request(4, "dev/sub/value", "dir", 1, NULL);
+    rpc_io_request(5, "dev", "ls", 1, NULL);
+    rpc_io_request(6, "dev/none", "get", 1, NULL);
+    rpc_io_request(7, "dev/sub/value", "none", 1, NULL);
+    rpc_io_process(shv_ctx);
+    return rpc_io_out_len();
+}
+
+int main(void)
+{
+    static double value = 1.5;
+    struct shv_connection connection;
+    struct shv_con_ctx *shv_ctx;
+    size_t out_len = 0;
+
+    struct shv_node *root = shv_tree_node_new("", &shv_root_dmap, 0);
+    struct shv_node *dev = shv_tree_node_new("dev", &shv_dir_ls_dmap, 0);
+    struct shv_node *sub = shv_tree_node_new("sub", &shv_dir_ls_dmap, SHV_NLIST_MODE_GSA);
+    struct shv_node_typed_val *val = shv_tree_node_typed_val_new("value", &shv_double_dmap, 0);
+    assert(root && dev && sub && val);
+    val->val_ptr = &value;
+    val->type_name = "double";
+    shv_tree_add_child(root, dev);
+    shv_tree_add_child(dev, sub);
+    shv_tree_add_child(sub, &val->shv_node);
+
+    rpc_io_init(&connection);
+    shv_ctx = shv_com_init(root, &connection, NULL);
+    assert(shv_ctx != NULL);
+
+    /* The first round fills the path index */
+    serve_requests(shv_ctx);
+
+    alloc_count = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        out_len += serve_requests(shv_ctx);
+    }
+
+    printf("%d requests, %zu bytes of replies, %d allocations\n", 7 * ROUNDS, out_len,
+           alloc_count);
+    assert(value == 42.5);
+    assert(out_len > 0);
+    assert(alloc_count == 0);
+
+    shv_tree_destroy(root);
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file test_loop_reconnect.c
+ * @brief Check a connection served by the loop reconnects on time
+ *        while it is woken again and again, and another one is destroyed
+ *        while the loop serves it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <shv/tree/shv_tree.h>
+#include <shv/tree/shv_com.h>
+#include <shv/tree/shv_methods.h>
+#include <shv/tree/shv_connection.h>
+#include <shv/tree/shv_chng.h>
+#include <shv/tree/shv_loop.h>
+
+static atomic_bool failed;
+
+static void signaller(struct shv_con_ctx *shv_ctx, enum shv_attention_reason reason)
+{
+    (void)shv_ctx;
+    if (reason == SHV_ATTENTION_ERROR) {
+        atomic_store(&failed, true);
+    }
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* A port nobody listens at, connects to it are refused */
+
+static uint16_t refused_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    assert(fd >= 0);
+    assert(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(getsockname(fd, (struct sockaddr *)&addr, &len) == 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+int main(void)
+{
+    static struct shv_value_cell cell = SHV_VALUE_CELL_INIT(SHV_VALUE_INT);
+    struct shv_chng_node node;
+    struct shv_connection connection;
+    struct shv_connection other_connection;
+    struct shv_con_ctx *shv_ctx;
+    struct shv_con_ctx *other;
+    struct shv_node *root;
+    struct shv_loop loop;
+    long start;
+    int ret;
+
+    root = shv_tree_node_new("", &shv_root_dmap, 0);
+    assert(root != NULL);
+
+    shv_connection_init(&connection, SHV_TLAYER_TCPIP);
+    shv_connection_tcpip_init(&connection, "127.0.0.1", refused_port());
+    connection.broker_user = "test";
+    connection.broker_password = "test";
+    connection.reconnect_period = 1;
+    connection.reconnect_retries = 2;
+    shv_ctx = shv_com_init(root, &connection, signaller);
+    assert(shv_ctx != NULL);
+    shv_chng_node_init(&node, &cell, "value", SHV_CHNG_DEADBAND_NONE, 0);
+
+    /* Reconnects forever, it is stopped by shv_com_destroy() */
+    shv_connection_init(&other_connection, SHV_TLAYER_TCPIP);
+    shv_connection_tcpip_init(&other_connection, "127.0.0.1", refused_port());
+    other_connection.broker_user = "test";
+    other_connection.broker_password = "test";
+    other_connection.reconnect_period = 1;
+    other = shv_com_init(root, &other_connection, NULL);
+    assert(other != NULL);
+
+    ret = shv_loop_init(&loop, 1);
+    assert(ret == 0);
+    ret = shv_loop_add(&loop, shv_ctx);
+    assert(ret == 0);
+    ret = shv_loop_add(&loop, other);
+    assert(ret == 0);
+
+    /* The changes wait for the connection, the wakes of the other
+     * connections of the thread must not postpone the reconnects.
+     */
+    start = now_ms();
+    while (!atomic_load(&failed)) {
+        shv_value_set_int(&cell, now_ms());
+        shv_chng_mark(shv_ctx, &node);
+        shv_process_wake(shv_ctx);
+        usleep(20000);
+        assert(now_ms() - start < 6000);
+        if (other != NULL && now_ms() - start > 500) {
+            shv_com_destroy(other);
+            other = NULL;
+        }
+    }
+    printf("reconnects given up after %ld ms\n", now_ms() - start);
+
+    shv_loop_destroy(&loop);
+    assert(shv_ctx->thrd_ctx.thrd_ret == -1);
+    assert(shv_ctx->err_no == SHV_RECONNECTS);
+    shv_com_destroy(shv_ctx);
+    shv_tree_destroy(root);
+    (void)ret;
+    return 0;
+}
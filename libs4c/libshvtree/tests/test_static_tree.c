@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file test_static_tree.c
+ * @brief Check the const tree generated by shvtreegen from static_tree.cpon.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <shv/tree/shv_tree.h>
+#include <shv/tree/shv_methods.h>
+#include <ulut/ul_utdefs.h>
+
+#include "static_tree.h"
+
+double motor_speed = 1.5;
+double motor_current = 0.25;
+double motor_gain = 10.0;
+
+static void check_children(const char *path, const char **names, int count)
+{
+    struct shv_node *node = shv_node_find((struct shv_node *)&static_tree, path);
+    struct shv_node_list_names_it names_it;
+    int i = 0;
+
+    assert(node != NULL);
+    assert(shv_node_list_count(&node->children) == count);
+
+    /* The children come sorted */
+    shv_node_list_names_it_init(&node->children, &names_it);
+    for (const char *name = names_it.str_it.get_next_entry(&names_it.str_it, 1); name != NULL;
+         name = names_it.str_it.get_next_entry(&names_it.str_it, 0)) {
+        assert(i < count);
+        assert(strcmp(name, names[i++]) == 0);
+    }
+    assert(i == count);
+}
+
+static double *typed_val(const char *path, const struct shv_dmap *dmap)
+{
+    struct shv_node *node = shv_node_find((struct shv_node *)&static_tree, path);
+    struct shv_node_typed_val *val;
+
+    assert(node != NULL);
+    assert(node->dir == dmap);
+    val = UL_CONTAINEROF(node, struct shv_node_typed_val, shv_node);
+    assert(strcmp(val->type_name, "double") == 0);
+    return val->val_ptr;
+}
+
+int main(void)
+{
+    static const char *root_children[] = {"alarm", "empty", "motor"};
+    static const char *motor_children[] = {"config", "current", "speed"};
+    static const char *config_children[] = {"gain"};
+
+    assert(static_tree.dir == &shv_root_dmap);
+    assert(static_tree.children.mode & SHV_NLIST_MODE_STATIC);
+
+    check_children("", root_children, 3);
+    check_children("motor", motor_children, 3);
+    check_children("motor/config", config_children, 1);
+    check_children("empty", NULL, 0);
+
+    assert(typed_val("motor/speed", &shv_double_dmap) == &motor_speed);
+    assert(typed_val("motor/current", &shv_double_read_only_dmap) == &motor_current);
+    assert(typed_val("motor/config/gain", &shv_double_dmap) == &motor_gain);
+
+    assert(shv_node_find((struct shv_node *)&static_tree, "motor/torque") == NULL);
+    assert(shv_dmap_find_n(shv_node_find((struct shv_node *)&static_tree, "motor/speed")->dir,
+                           "set", 3) != NULL);
+
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,177 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file test_value_cell.c
+ * @brief Check value cells are never read torn and are set by requests.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <shv/chainpack/cchainpack.h>
+#include <shv/tree/shv_tree.h>
+#include <shv/tree/shv_com.h>
+#include <shv/tree/shv_com_common.h>
+#include <shv/tree/shv_methods.h>
+#include <shv/tree/shv_value.h>
+
+#include "rpc_io.h"
+
+#define WRITES 2000000
+
+static struct shv_value_cell int_cell = SHV_VALUE_CELL_INIT(SHV_VALUE_INT);
+static struct shv_value_cell str_cell = SHV_VALUE_CELL_INIT(SHV_VALUE_STR);
+static struct shv_value_cell bool_cell = SHV_VALUE_CELL_INIT(SHV_VALUE_BOOL);
+static atomic_bool writing = true;
+
+static void *writer(void *arg)
+{
+    char str[SHV_VALUE_STR_LEN];
+
+    (void)arg;
+    for (uint32_t i = 1; i <= WRITES; i++) {
+        /* Both halves are equal in any consistent value */
+        shv_value_set_int(&int_cell, ((int64_t)i << 32) | i);
+        memset(str, 'a' + i % 26, sizeof(str) - 1 - i % 8);
+        str[sizeof(str) - 1 - i % 8] = '\0';
+        shv_value_set_str(&str_cell, str);
+    }
+    atomic_store(&writing, false);
+    return NULL;
+}
+
+static void check_concurrent(void)
+{
+    pthread_t thread;
+    char str[SHV_VALUE_STR_LEN];
+    long reads = 0;
+
+    int ret = pthread_create(&thread, NULL, writer, NULL);
+    assert(ret == 0);
+    (void)ret;
+    while (atomic_load(&writing)) {
+        int64_t val = shv_value_get_int(&int_cell);
+        assert((val >> 32) == (val & 0xffffffff));
+
+        size_t len = shv_value_get_str(&str_cell, str, sizeof(str));
+        assert(len == strlen(str));
+        for (size_t i = 1; i < len; i++) {
+            assert(str[i] == str[0]);
+        }
+        reads++;
+    }
+    pthread_join(thread, NULL);
+    assert(shv_value_get_int(&int_cell) == (((int64_t)WRITES << 32) | WRITES));
+    printf("%d writes, %ld consistent reads\n", WRITES, reads);
+}
+
+static int request_set(struct shv_con_ctx *shv_ctx, const char *path,
+                       void (*pack_param)(ccpcp_pack_context *ctx))
+{
+    rpc_io_reset();
+    rpc_io_request(1, path, "set", 0, pack_param);
+    rpc_io_process(shv_ctx);
+    return rpc_io_reply_error(1);
+}
+
+static void pack_int(ccpcp_pack_context *ctx)
+{
+    cchainpack_pack_int(ctx, -7);
+}
+
+static void pack_str(ccpcp_pack_context *ctx)
+{
+    cchainpack_pack_string(ctx, "hello", 5);
+}
+
+static void pack_bool(ccpcp_pack_context *ctx)
+{
+    cchainpack_pack_boolean(ctx, true);
+}
+
+static void pack_long_str(ccpcp_pack_context *ctx)
+{
+    char str[SHV_VALUE_STR_LEN];
+
+    memset(str, 'x', sizeof(str));
+    cchainpack_pack_string(ctx, str, sizeof(str));
+}
+
+static void add_value(struct shv_node *parent, const char *name, const struct shv_dmap *dmap,
+                      struct shv_value_cell *cell, char *type_name)
+{
+    struct shv_node_typed_val *val = shv_tree_node_typed_val_new(name, dmap, 0);
+    assert(val != NULL);
+    val->val_ptr = cell;
+    val->type_name = type_name;
+    shv_tree_add_child(parent, &val->shv_node);
+}
+
+static void check_requests(void)
+{
+    struct shv_connection connection;
+    struct shv_con_ctx *shv_ctx;
+    char str[SHV_VALUE_STR_LEN];
+    int err;
+
+    struct shv_node *root = shv_tree_node_new("", &shv_root_dmap, 0);
+    assert(root != NULL);
+    add_value(root, "int", &shv_value_int_dmap, &int_cell, "Int");
+    add_value(root, "str", &shv_value_str_dmap, &str_cell, "String");
+    add_value(root, "bool", &shv_value_bool_read_only_dmap, &bool_cell, "Bool");
+
+    rpc_io_init(&connection);
+    shv_ctx = shv_com_init(root, &connection, NULL);
+    assert(shv_ctx != NULL);
+
+    err = request_set(shv_ctx, "int", pack_int);
+    assert(err == 0);
+    assert(shv_value_get_int(&int_cell) == -7);
+
+    err = request_set(shv_ctx, "str", pack_str);
+    assert(err == 0);
+    shv_value_get_str(&str_cell, str, sizeof(str));
+    assert(strcmp(str, "hello") == 0);
+
+    /* Too long and mistyped values are refused */
+    err = request_set(shv_ctx, "str", pack_long_str);
+    assert(err == SHV_RE_INVALID_PARAMS);
+    shv_value_get_str(&str_cell, str, sizeof(str));
+    assert(strcmp(str, "hello") == 0);
+    err = request_set(shv_ctx, "int", pack_str);
+    assert(err == SHV_RE_INVALID_PARAMS);
+    assert(shv_value_get_int(&int_cell) == -7);
+
+    /* Read only */
+    err = request_set(shv_ctx, "bool", pack_bool);
+    assert(err > 0);
+    assert(!shv_value_get_bool(&bool_cell));
+
+    /* Another write in progress is not waited for */
+    shv_value_set_int(&int_cell, 5);
+    atomic_fetch_add(&int_cell.seq, 1);
+    err = shv_value_set_int(&int_cell, 1);
+    assert(err < 0);
+    err = request_set(shv_ctx, "int", pack_int);
+    assert(err == SHV_RE_TRY_AGAIN_LATER);
+    atomic_fetch_add(&int_cell.seq, 1);
+    assert(shv_value_get_int(&int_cell) == 5);
+
+    shv_com_destroy(shv_ctx);
+    shv_tree_destroy(root);
+}
+
+int main(void)
+{
+    check_concurrent();
+    check_requests();
+    printf("PASSED\n");
+    return 0;
+}
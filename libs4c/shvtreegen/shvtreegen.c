@@ -0,0 +1,456 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later OR BSD-2-Clause OR Apache-2.0
+ *
+ * Copyright (c) Michal Lenc 2022-2025 <michallenc@seznam.cz>
+ */
+
+/**
+ * @file shvtreegen.c
+ * @brief Generator of const SHV trees from their CPON description
+ *
+ * The description is a map describing the root node:
+ * @code
+ * {
+ *   "dmap": "shv_root_dmap",
+ *   "children": {
+ *     "motor": {
+ *       "dmap": "shv_dir_ls_dmap",
+ *       "children": {
+ *         "speed": {"dmap": "shv_double_dmap", "type": "double", "value": "motor_speed"}
+ *       }
+ *     }
+ *   }
+ * }
+ * @endcode
+ * Nodes with "type" are struct shv_node_typed_val nodes, "value" names
+ * the variable val_ptr points to and "ctype" its C type, if it differs
+ * from the type name. The dmaps are referred to by their names.
+ *
+ * The generated source defines the root as a const struct shv_node of
+ * the given name. All nodes are const GSA nodes with SHV_NLIST_MODE_STATIC
+ * set and their children sorted in advance, so the whole tree can be
+ * placed to read-only memory and used without any initialization.
+ * Such tree cannot be changed or destroyed.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <shv/chainpack/ccpon.h>
+
+#define SHVTREEGEN_DEPTH_MAX 64
+
+struct gen_node
+{
+    char *name;                  /* Node name */
+    char *dmap;                  /* Name of the dmap */
+    char *type;                  /* Type name of a typed value node, NULL otherwise */
+    char *value;                 /* Variable the typed value node points to */
+    char *ctype;                 /* C type of the variable */
+    struct gen_node **children;  /* Children, sorted by name once parsed */
+    int child_cnt;
+    int id;                      /* Number of the node in the output */
+};
+
+static const char *desc_name;
+static int node_cnt;
+
+static void gen_error(ccpcp_unpack_context *ctx, const char *msg)
+{
+    fprintf(stderr, "ERROR: %s:%d: %s\n", desc_name, ctx->parser_line_no, msg);
+    exit(EXIT_FAILURE);
+}
+
+static void *gen_alloc(size_t size)
+{
+    void *mem = calloc(1, size);
+    if (mem == NULL) {
+        perror("shvtreegen");
+        exit(EXIT_FAILURE);
+    }
+    return mem;
+}
+
+static void gen_unpack_next(ccpcp_unpack_context *ctx)
+{
+    ccpon_unpack_next(ctx);
+    if (ctx->err_no != CCPCP_RC_OK) {
+        gen_error(ctx, ctx->err_msg != NULL && *ctx->err_msg != '\0' ? ctx->err_msg :
+                  "Malformed CPON");
+    }
+}
+
+/* Take the string the context stands at, it may come in several chunks */
+
+static char *gen_take_string(ccpcp_unpack_context *ctx)
+{
+    size_t len = 0;
+    char *str = NULL;
+
+    if (ctx->item.type != CCPCP_ITEM_STRING) {
+        gen_error(ctx, "String expected");
+    }
+
+    for (;;) {
+        ccpcp_string *chunk = &ctx->item.as.String;
+
+        str = realloc(str, len + chunk->chunk_size + 1);
+        if (str == NULL) {
+            perror("shvtreegen");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(str + len, chunk->chunk_start, chunk->chunk_size);
+        len += chunk->chunk_size;
+        if (chunk->last_chunk) {
+            break;
+        }
+        gen_unpack_next(ctx);
+    }
+
+    str[len] = '\0';
+    return str;
+}
+
+static char *gen_unpack_string(ccpcp_unpack_context *ctx)
+{
+    gen_unpack_next(ctx);
+    return gen_take_string(ctx);
+}
+
+static bool gen_is_identifier(const char *str)
+{
+    if (!isalpha((unsigned char)*str) && *str != '_') {
+        return false;
+    }
+    while (*++str != '\0') {
+        if (!isalnum((unsigned char)*str) && *str != '_') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int gen_node_comp(const void *a, const void *b)
+{
+    const struct gen_node *node_a = *(struct gen_node * const *)a;
+    const struct gen_node *node_b = *(struct gen_node * const *)b;
+
+    return strcmp(node_a->name, node_b->name);
+}
+
+static void gen_parse_node(ccpcp_unpack_context *ctx, struct gen_node *node);
+
+static void gen_parse_children(ccpcp_unpack_context *ctx, struct gen_node *node)
+{
+    int alloc_cnt = 0;
+
+    gen_unpack_next(ctx);
+    if (ctx->item.type != CCPCP_ITEM_MAP) {
+        gen_error(ctx, "Map of children expected");
+    }
+
+    for (;;) {
+        struct gen_node *child;
+
+        gen_unpack_next(ctx);
+        if (ctx->item.type == CCPCP_ITEM_CONTAINER_END) {
+            break;
+        }
+
+        child = gen_alloc(sizeof(struct gen_node));
+        child->name = gen_take_string(ctx);
+        gen_parse_node(ctx, child);
+
+        if (node->child_cnt == alloc_cnt) {
+            alloc_cnt = alloc_cnt ? 2 * alloc_cnt : 8;
+            node->children = realloc(node->children, alloc_cnt * sizeof(struct gen_node *));
+            if (node->children == NULL) {
+                perror("shvtreegen");
+                exit(EXIT_FAILURE);
+            }
+        }
+        node->children[node->child_cnt++] = child;
+    }
+
+    /* The children are looked up by binary search */
+    qsort(node->children, node->child_cnt, sizeof(struct gen_node *), gen_node_comp);
+    for (int i = 1; i < node->child_cnt; i++) {
+        if (strcmp(node->children[i - 1]->name, node->children[i]->name) == 0) {
+            fprintf(stderr, "ERROR: %s: Duplicate node '%s' in '%s'\n", desc_name,
+                    node->children[i]->name, node->name);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void gen_parse_node(ccpcp_unpack_context *ctx, struct gen_node *node)
+{
+    gen_unpack_next(ctx);
+    if (ctx->item.type != CCPCP_ITEM_MAP) {
+        gen_error(ctx, "Map describing a node expected");
+    }
+
+    for (;;) {
+        char *key;
+
+        gen_unpack_next(ctx);
+        if (ctx->item.type == CCPCP_ITEM_CONTAINER_END) {
+            break;
+        }
+
+        key = gen_take_string(ctx);
+        if (strcmp(key, "dmap") == 0) {
+            node->dmap = gen_unpack_string(ctx);
+        } else if (strcmp(key, "type") == 0) {
+            node->type = gen_unpack_string(ctx);
+        } else if (strcmp(key, "value") == 0) {
+            node->value = gen_unpack_string(ctx);
+        } else if (strcmp(key, "ctype") == 0) {
+            node->ctype = gen_unpack_string(ctx);
+        } else if (strcmp(key, "children") == 0) {
+            gen_parse_children(ctx, node);
+        } else {
+            fprintf(stderr, "ERROR: %s:%d: Unknown key '%s'\n", desc_name,
+                    ctx->parser_line_no, key);
+            exit(EXIT_FAILURE);
+        }
+        free(key);
+    }
+
+    if (node->dmap == NULL || !gen_is_identifier(node->dmap)) {
+        fprintf(stderr, "ERROR: %s: Node '%s' needs the name of its dmap\n", desc_name,
+                node->name);
+        exit(EXIT_FAILURE);
+    }
+    if (node->type != NULL) {
+        if (node->value == NULL || !gen_is_identifier(node->value)) {
+            fprintf(stderr, "ERROR: %s: Typed node '%s' needs the name of its value\n",
+                    desc_name, node->name);
+            exit(EXIT_FAILURE);
+        }
+        if (node->ctype == NULL) {
+            node->ctype = node->type;
+        }
+    }
+
+    node->id = node_cnt++;
+}
+
+static void gen_print_string(FILE *out, const char *str)
+{
+    fputc('"', out);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if (isprint((unsigned char)*str)) {
+            fputc(*str, out);
+        } else {
+            fprintf(out, "\\%03o", (unsigned char)*str);
+        }
+    }
+    fputc('"', out);
+}
+
+/* Declare the dmaps and values, each name just once */
+
+static void gen_declare(FILE *out, struct gen_node *node, char **declared, int *declared_cnt)
+{
+    const char *names[2] = {node->dmap, node->value};
+
+    for (int k = 0; k < 2; k++) {
+        int i;
+
+        if (names[k] == NULL) {
+            continue;
+        }
+        for (i = 0; i < *declared_cnt; i++) {
+            if (strcmp(declared[i], names[k]) == 0) {
+                break;
+            }
+        }
+        if (i < *declared_cnt) {
+            continue;
+        }
+        declared[(*declared_cnt)++] = (char *)names[k];
+        if (k == 0) {
+            fprintf(out, "extern const struct shv_dmap %s;\n", names[k]);
+        } else {
+            fprintf(out, "extern %s %s;\n", node->ctype, names[k]);
+        }
+    }
+
+    for (int i = 0; i < node->child_cnt; i++) {
+        gen_declare(out, node->children[i], declared, declared_cnt);
+    }
+}
+
+static void gen_print_node_ref(FILE *out, const char *symbol, struct gen_node *node)
+{
+    if (node->type != NULL) {
+        fprintf(out, "(void *)&%s_n%d.shv_node", symbol, node->id);
+    } else {
+        fprintf(out, "(void *)&%s_n%d", symbol, node->id);
+    }
+}
+
+static void gen_print_shv_node(FILE *out, const char *symbol, struct gen_node *node,
+                               const char *indent)
+{
+    fprintf(out, "%s.name = ", indent);
+    gen_print_string(out, node->name);
+    fprintf(out, ",\n%s.dir = (struct shv_dmap *)&%s,\n", indent, node->dmap);
+    fprintf(out, "%s.children =\n%s{\n", indent, indent);
+    fprintf(out, "%s    .mode = SHV_NLIST_MODE_GSA | SHV_NLIST_MODE_STATIC,\n", indent);
+    if (node->child_cnt > 0) {
+        fprintf(out, "%s    .list.gsa.root =\n%s    {\n", indent, indent);
+        fprintf(out, "%s        .items = (void **)%s_n%d_children,\n", indent, symbol, node->id);
+        fprintf(out, "%s        .count = %d,\n", indent, node->child_cnt);
+        fprintf(out, "%s        .alloc_count = 0\n%s    }\n", indent, indent);
+    }
+    fprintf(out, "%s}\n", indent);
+}
+
+/* The children are printed before their parent, so no forward declarations are needed */
+
+static void gen_print_node(FILE *out, const char *symbol, struct gen_node *node, bool root)
+{
+    for (int i = 0; i < node->child_cnt; i++) {
+        gen_print_node(out, symbol, node->children[i], false);
+    }
+
+    if (node->child_cnt > 0) {
+        fprintf(out, "static void *const %s_n%d_children[] =\n{\n", symbol, node->id);
+        for (int i = 0; i < node->child_cnt; i++) {
+            fprintf(out, "    ");
+            gen_print_node_ref(out, symbol, node->children[i]);
+            fprintf(out, ",\n");
+        }
+        fprintf(out, "};\n\n");
+    }
+
+    if (root) {
+        fprintf(out, "const struct shv_node %s =\n{\n", symbol);
+        gen_print_shv_node(out, symbol, node, "    ");
+    } else if (node->type != NULL) {
+        fprintf(out, "static const struct shv_node_typed_val %s_n%d =\n{\n", symbol, node->id);
+        fprintf(out, "    .shv_node =\n    {\n");
+        gen_print_shv_node(out, symbol, node, "        ");
+        fprintf(out, "    },\n    .val_ptr = &%s,\n    .type_name = ", node->value);
+        gen_print_string(out, node->type);
+        fprintf(out, "\n");
+    } else {
+        fprintf(out, "static const struct shv_node %s_n%d =\n{\n", symbol, node->id);
+        gen_print_shv_node(out, symbol, node, "    ");
+    }
+    fprintf(out, "};\n\n");
+}
+
+static char *gen_read_file(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "r");
+    size_t size = 4096;
+    char *data = NULL;
+
+    *len = 0;
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Cannot open %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        data = realloc(data, size);
+        if (data == NULL) {
+            perror("shvtreegen");
+            exit(EXIT_FAILURE);
+        }
+        *len += fread(data + *len, 1, size - *len, file);
+        if (*len < size) {
+            break;
+        }
+        size *= 2;
+    }
+
+    fclose(file);
+    return data;
+}
+
+static FILE *gen_open_output(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "ERROR: Cannot create %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return out;
+}
+
+static void gen_close_output(FILE *out, const char *path)
+{
+    if (ferror(out) || fclose(out) != 0) {
+        fprintf(stderr, "ERROR: Cannot write %s\n", path);
+        remove(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ccpcp_container_state states[2 * SHVTREEGEN_DEPTH_MAX];
+    ccpcp_container_stack stack;
+    ccpcp_unpack_context ctx;
+    struct gen_node root = {.name = ""};
+    const char *symbol;
+    const char *header;
+    char **declared;
+    int declared_cnt = 0;
+    size_t len;
+    char *desc;
+    FILE *out;
+
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: %s <description.cpon> <symbol> <output.c> [<output.h>]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    desc_name = argv[1];
+    symbol = argv[2];
+    header = argc > 4 ? argv[4] : NULL;
+    if (!gen_is_identifier(symbol)) {
+        fprintf(stderr, "ERROR: '%s' is not a valid C identifier\n", symbol);
+        return EXIT_FAILURE;
+    }
+
+    desc = gen_read_file(desc_name, &len);
+    ccpcp_container_stack_init(&stack, states, sizeof(states) / sizeof(states[0]), NULL);
+    ccpcp_unpack_context_init(&ctx, desc, len, NULL, &stack);
+    gen_parse_node(&ctx, &root);
+
+    out = gen_open_output(argv[3]);
+    fprintf(out, "/* Generated by shvtreegen from %s, do not edit */\n\n", desc_name);
+    fprintf(out, "#include <shv/tree/shv_tree.h>\n\n");
+    if (header != NULL) {
+        const char *base = strrchr(header, '/');
+        fprintf(out, "#include \"%s\"\n\n", base != NULL ? base + 1 : header);
+    }
+
+    declared = gen_alloc(2 * node_cnt * sizeof(char *));
+    gen_declare(out, &root, declared, &declared_cnt);
+    fprintf(out, "\n");
+    gen_print_node(out, symbol, &root, true);
+    gen_close_output(out, argv[3]);
+
+    if (header != NULL) {
+        out = gen_open_output(header);
+        fprintf(out, "/* Generated by shvtreegen from %s, do not edit */\n\n", desc_name);
+        fprintf(out, "#pragma once\n\n#include <shv/tree/shv_tree.h>\n\n");
+        fprintf(out, "/* Root of the tree, %d nodes */\n", node_cnt);
+        fprintf(out, "extern const struct shv_node %s;\n", symbol);
+        gen_close_output(out, header);
+    }
+
+    return EXIT_SUCCESS;
+}